@@ -0,0 +1,246 @@
+/* vim:set et sts=4: */
+/* Microbenchmarks of the functions run at every key event or at
+   startup, built and run by "make bench".
+
+   Each case runs a fixed number of iterations several times, and the
+   fastest run is reported, so that results are comparable between
+   builds.  Results are printed as JSON on stdout:
+
+   {"benchmarks": [{"name": "mtext-to-utf8/ascii", "iterations": 100000,
+                    "ns-per-op": 41.2}, ...]} */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <ibus.h>
+#include <glib/gstdio.h>
+#include "m17nutil.h"
+
+#define N_RUNS 5
+
+typedef void (*BenchFunc) (gpointer user_data);
+
+static gboolean first_result = TRUE;
+
+static void
+bench_report (const gchar *name,
+              guint        iterations,
+              gdouble      ns_per_op)
+{
+    gchar buf[G_ASCII_DTOSTR_BUF_SIZE];
+
+    g_print ("%s\n    {\"name\": \"%s\", \"iterations\": %u, \"ns-per-op\": %s}",
+             first_result ? "" : ",",
+             name,
+             iterations,
+             g_ascii_formatd (buf, sizeof (buf), "%.1f", ns_per_op));
+    first_result = FALSE;
+}
+
+static void
+bench_run (const gchar *name,
+           guint        iterations,
+           BenchFunc    func,
+           gpointer     user_data)
+{
+    gint64 best = G_MAXINT64;
+    guint run, i;
+
+    /* warm up caches and lazily initialized state */
+    func (user_data);
+
+    for (run = 0; run < N_RUNS; run++) {
+        gint64 start = g_get_monotonic_time ();
+
+        for (i = 0; i < iterations; i++)
+            func (user_data);
+        best = MIN (best, g_get_monotonic_time () - start);
+    }
+
+    bench_report (name, iterations, best * 1000.0 / iterations);
+}
+
+/* Representative text of each script, repeated to about a line. */
+static const struct {
+    const gchar *name;
+    const gchar *text;
+} samples[] = {
+    { "ascii", "The quick brown fox jumps over the lazy dog. " },
+    { "devanagari", "\340\244\250\340\244\256\340\244\270\340\245\215\340\244\244\340\245\207 \340\244\246\340\245\201\340\244\250\340\244\277\340\244\257\340\244\276 " },
+    { "cjk", "\344\275\240\345\245\275\344\270\226\347\225\214\343\201\223\343\202\223\343\201\253\343\201\241\343\201\257" },
+    { "emoji", "\360\237\230\200\360\237\216\211\360\237\221\215\360\237\214\217" },
+};
+#define SAMPLE_REPEAT 4
+
+static void
+bench_mtext_to_utf8 (gpointer user_data)
+{
+    g_free (ibus_m17n_mtext_to_utf8 (user_data));
+}
+
+static void
+bench_mtext_to_ucs4 (gpointer user_data)
+{
+    glong nchars;
+
+    g_free (ibus_m17n_mtext_to_ucs4 (user_data, &nchars));
+}
+
+static const struct {
+    const gchar *name;
+    guint keyval;
+    guint modifiers;
+} key_events[] = {
+    { "ascii", IBUS_a, 0 },
+    { "shift", IBUS_A, IBUS_SHIFT_MASK },
+    { "control", IBUS_c, IBUS_CONTROL_MASK },
+    { "unicode", 0x1000915, 0 },
+    { "function", IBUS_BackSpace, 0 },
+};
+
+static void
+bench_key_event_to_symbol (gpointer user_data)
+{
+    guint i = GPOINTER_TO_UINT (user_data);
+
+    ibus_m17n_key_event_to_symbol (0,
+                                   key_events[i].keyval,
+                                   key_events[i].modifiers);
+}
+
+static void
+bench_get_engine_config (gpointer user_data)
+{
+    ibus_m17n_engine_config_free (ibus_m17n_get_engine_config (user_data));
+}
+
+/* Write a default.xml with N_ENGINES patterns, shaped like the real
+   one: a catch-all default followed by per-language overrides. */
+static gchar *
+write_default_xml (const gchar *dirname,
+                   guint        n_engines)
+{
+    GString *xml = g_string_new ("<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+                                 "<engines>\n"
+                                 "\t<engine>\n"
+                                 "\t\t<name>m17n:*</name>\n"
+                                 "\t\t<rank>0</rank>\n"
+                                 "\t</engine>\n");
+    gchar *filename, *basename;
+    guint i;
+
+    for (i = 1; i < n_engines; i++)
+        g_string_append_printf (xml,
+                                "\t<engine>\n"
+                                "\t\t<name>m17n:l%u:*</name>\n"
+                                "\t\t<rank>%u</rank>\n"
+                                "\t\t<symbol>%u</symbol>\n"
+                                "\t</engine>\n",
+                                i, i % 3, i);
+    g_string_append (xml, "</engines>\n");
+
+    basename = g_strdup_printf ("default-%u.xml", n_engines);
+    filename = g_build_filename (dirname, basename, NULL);
+    g_free (basename);
+    if (!g_file_set_contents (filename, xml->str, xml->len, NULL))
+        g_error ("Can not write %s", filename);
+    g_string_free (xml, TRUE);
+
+    return filename;
+}
+
+static void
+bench_parse_color (gpointer user_data)
+{
+    ibus_m17n_parse_color (user_data);
+}
+
+static void
+bench_list_engines (gpointer user_data)
+{
+    GList *engines, *p;
+
+    engines = ibus_m17n_list_engines ();
+    for (p = engines; p != NULL; p = p->next)
+        g_object_unref (g_object_ref_sink (p->data));
+    g_list_free (engines);
+}
+
+int
+main (int argc, char **argv)
+{
+    static const guint config_sizes[] = { 10, 100, 1000 };
+    static const gchar *colors[] = { "#ff0000", "#00FF7f", "bogus" };
+    gchar *dirname;
+    guint i;
+
+    ibus_init ();
+    ibus_m17n_init_common ();
+
+    g_print ("{\"benchmarks\": [");
+
+    for (i = 0; i < G_N_ELEMENTS (samples); i++) {
+        GString *text = g_string_new ("");
+        gchar *name;
+        MText *mt;
+        guint j;
+
+        for (j = 0; j < SAMPLE_REPEAT; j++)
+            g_string_append (text, samples[i].text);
+        mt = mtext_from_data (text->str, text->len, MTEXT_FORMAT_UTF_8);
+
+        name = g_strdup_printf ("mtext-to-utf8/%s", samples[i].name);
+        bench_run (name, 100000, bench_mtext_to_utf8, mt);
+        g_free (name);
+        name = g_strdup_printf ("mtext-to-ucs4/%s", samples[i].name);
+        bench_run (name, 100000, bench_mtext_to_ucs4, mt);
+        g_free (name);
+
+        m17n_object_unref (mt);
+        g_string_free (text, TRUE);
+    }
+
+    for (i = 0; i < G_N_ELEMENTS (key_events); i++) {
+        gchar *name = g_strdup_printf ("key-event-to-symbol/%s",
+                                       key_events[i].name);
+        bench_run (name, 1000000, bench_key_event_to_symbol,
+                   GUINT_TO_POINTER (i));
+        g_free (name);
+    }
+
+    dirname = g_dir_make_tmp ("ibus-m17n-bench-XXXXXX", NULL);
+    if (dirname == NULL)
+        g_error ("Can not create a temporary directory");
+    for (i = 0; i < G_N_ELEMENTS (config_sizes); i++) {
+        gchar *filename, *name;
+
+        filename = write_default_xml (dirname, config_sizes[i]);
+        if (ibus_m17n_load_engine_config (filename)) {
+            name = g_strdup_printf ("get-engine-config/%u", config_sizes[i]);
+            /* the worst case: every pattern is tried */
+            bench_run (name, 100000 / config_sizes[i],
+                       bench_get_engine_config, "m17n:hi:inscript");
+            g_free (name);
+        }
+        g_unlink (filename);
+        g_free (filename);
+    }
+    g_rmdir (dirname);
+    g_free (dirname);
+
+    for (i = 0; i < G_N_ELEMENTS (colors); i++) {
+        gchar *name = g_strdup_printf ("parse-color/%s",
+                                       colors[i][0] == '#' ?
+                                       colors[i] + 1 : colors[i]);
+        bench_run (name, 1000000, bench_parse_color, (gpointer) colors[i]);
+        g_free (name);
+    }
+
+    /* go back to the installed defaults, which list_engines consults */
+    ibus_m17n_load_engine_config (NULL);
+    bench_run ("list-engines", 10, bench_list_engines, NULL);
+
+    g_print ("\n]}\n");
+
+    return 0;
+}
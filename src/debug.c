@@ -0,0 +1,194 @@
+/* vim:set et sts=4: */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <ibus.h>
+#ifdef G_OS_UNIX
+#include <glib-unix.h>
+#include <signal.h>
+#endif  /* G_OS_UNIX */
+#include "engine.h"
+#include "debug.h"
+
+static const gchar introspection_xml[] =
+    "<node>"
+    "  <interface name='" IBUS_M17N_DEBUG_INTERFACE "'>"
+    "    <method name='GetStats'>"
+    "      <arg type='a{sv}' name='globals' direction='out'/>"
+    "      <arg type='a{sa{sv}}' name='engines' direction='out'/>"
+    "    </method>"
+    "    <method name='GetKeyStats'>"
+    "      <arg type='a{sa{sv}}' name='engines' direction='out'/>"
+    "    </method>"
+    "  </interface>"
+    "</node>";
+
+static void
+ibus_m17n_debug_method_call (GDBusConnection       *connection,
+                             const gchar           *sender,
+                             const gchar           *object_path,
+                             const gchar           *interface_name,
+                             const gchar           *method_name,
+                             GVariant              *parameters,
+                             GDBusMethodInvocation *invocation,
+                             gpointer               user_data)
+{
+    if (g_strcmp0 (method_name, "GetStats") == 0) {
+        g_dbus_method_invocation_return_value (invocation,
+                                               ibus_m17n_engine_get_stats ());
+    }
+    else if (g_strcmp0 (method_name, "GetKeyStats") == 0) {
+        g_dbus_method_invocation_return_value (invocation,
+                                               ibus_m17n_engine_get_key_stats ());
+    }
+    else {
+        g_dbus_method_invocation_return_error (invocation,
+                                               G_DBUS_ERROR,
+                                               G_DBUS_ERROR_UNKNOWN_METHOD,
+                                               "Unknown method %s",
+                                               method_name);
+    }
+}
+
+static const GDBusInterfaceVTable interface_vtable = {
+    ibus_m17n_debug_method_call,
+    NULL,
+    NULL,
+};
+
+static void
+ibus_m17n_debug_format_histogram (GString     *output,
+                                  const gchar *phase,
+                                  GVariant    *histogram)
+{
+    guint64 count = 0, p50 = 0, p90 = 0, p99 = 0, max = 0;
+
+    g_variant_lookup (histogram, "count", "t", &count);
+    g_variant_lookup (histogram, "p50", "t", &p50);
+    g_variant_lookup (histogram, "p90", "t", &p90);
+    g_variant_lookup (histogram, "p99", "t", &p99);
+    g_variant_lookup (histogram, "max", "t", &max);
+
+    g_string_append_printf (output,
+                            "  %-8s %8" G_GUINT64_FORMAT " keys,"
+                            " p50 %.1f, p90 %.1f, p99 %.1f, max %.1f us\n",
+                            phase, count,
+                            p50 / 1000.0, p90 / 1000.0, p99 / 1000.0,
+                            max / 1000.0);
+}
+
+/* Format STATS, as returned by ibus_m17n_engine_get_stats, and
+   KEY_STATS, as returned by ibus_m17n_engine_get_key_stats, one line
+   per engine or per phase. */
+gchar *
+ibus_m17n_debug_format_stats (GVariant *stats,
+                              GVariant *key_stats)
+{
+    GString *output = g_string_new ("");
+    GVariant *globals, *engines, *values, *value;
+    GVariantIter iter, value_iter;
+    const gchar *name, *key;
+    gchar *str;
+
+    g_variant_get (stats, "(@a{sv}@a{sa{sv}})", &globals, &engines);
+
+    str = g_variant_print (globals, FALSE);
+    g_string_append_printf (output, "%s\n", str);
+    g_free (str);
+
+    g_variant_iter_init (&iter, engines);
+    while (g_variant_iter_next (&iter, "{&s@a{sv}}", &name, &values)) {
+        str = g_variant_print (values, FALSE);
+        g_string_append_printf (output, "%s: %s\n", name, str);
+        g_free (str);
+        g_variant_unref (values);
+    }
+
+    g_variant_unref (globals);
+    g_variant_unref (engines);
+
+    g_variant_get (key_stats, "(@a{sa{sv}})", &engines);
+    g_variant_iter_init (&iter, engines);
+    while (g_variant_iter_next (&iter, "{&s@a{sv}}", &name, &values)) {
+        GString *counters = g_string_new ("");
+
+        g_string_append_printf (output, "%s:\n", name);
+        g_variant_iter_init (&value_iter, values);
+        while (g_variant_iter_next (&value_iter, "{&sv}", &key, &value)) {
+            if (g_variant_is_of_type (value, G_VARIANT_TYPE_VARDICT))
+                ibus_m17n_debug_format_histogram (output, key, value);
+            else if (g_variant_is_of_type (value, G_VARIANT_TYPE_UINT64))
+                g_string_append_printf (counters, "%s%s %" G_GUINT64_FORMAT,
+                                        counters->len > 0 ? ", " : "",
+                                        key, g_variant_get_uint64 (value));
+            g_variant_unref (value);
+        }
+        g_string_append_printf (output, "  %s\n", counters->str);
+        g_string_free (counters, TRUE);
+        g_variant_unref (values);
+    }
+    g_variant_unref (engines);
+
+    return g_string_free (output, FALSE);
+}
+
+/* Log the statistics, one line per engine or per phase. */
+void
+ibus_m17n_debug_dump (void)
+{
+    GVariant *stats, *key_stats;
+    gchar *str, **lines;
+    guint i;
+
+    stats = g_variant_ref_sink (ibus_m17n_engine_get_stats ());
+    key_stats = g_variant_ref_sink (ibus_m17n_engine_get_key_stats ());
+
+    str = ibus_m17n_debug_format_stats (stats, key_stats);
+    lines = g_strsplit (g_strchomp (str), "\n", -1);
+    for (i = 0; lines[i] != NULL; i++)
+        g_message ("%s", lines[i]);
+    g_strfreev (lines);
+    g_free (str);
+
+    g_variant_unref (key_stats);
+    g_variant_unref (stats);
+}
+
+#ifdef G_OS_UNIX
+static gboolean
+ibus_m17n_debug_sigusr1 (gpointer user_data)
+{
+    ibus_m17n_debug_dump ();
+    return TRUE;
+}
+#endif  /* G_OS_UNIX */
+
+/* Export the debug interface on CONNECTION and dump the statistics on
+   SIGUSR1. */
+void
+ibus_m17n_debug_init (GDBusConnection *connection)
+{
+    GDBusNodeInfo *info;
+    GError *error = NULL;
+
+    info = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
+    g_assert (info != NULL);
+
+    if (g_dbus_connection_register_object (connection,
+                                           IBUS_M17N_DEBUG_PATH,
+                                           info->interfaces[0],
+                                           &interface_vtable,
+                                           NULL,
+                                           NULL,
+                                           &error) == 0) {
+        g_warning ("Can not export %s: %s",
+                   IBUS_M17N_DEBUG_PATH, error->message);
+        g_error_free (error);
+    }
+    g_dbus_node_info_unref (info);
+
+#ifdef G_OS_UNIX
+    g_unix_signal_add (SIGUSR1, ibus_m17n_debug_sigusr1, NULL);
+#endif  /* G_OS_UNIX */
+}
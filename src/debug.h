@@ -0,0 +1,16 @@
+/* vim:set et sts=4: */
+#ifndef __DEBUG_H__
+#define __DEBUG_H__
+
+#include <ibus.h>
+
+#define IBUS_M17N_DEBUG_PATH "/org/freedesktop/IBus/M17N/Debug"
+#define IBUS_M17N_DEBUG_INTERFACE "org.freedesktop.IBus.M17N.Debug"
+
+void    ibus_m17n_debug_init    (GDBusConnection *connection);
+void    ibus_m17n_debug_dump    (void);
+gchar  *ibus_m17n_debug_format_stats
+                                (GVariant        *stats,
+                                 GVariant        *key_stats);
+
+#endif
@@ -6,11 +6,174 @@
 #include <ibus.h>
 #include <m17n.h>
 #include <string.h>
+#include <unistd.h>
 #include "m17nutil.h"
 #include "engine.h"
+#include "probes.h"
+
+#ifdef HAVE_PROBES
+/* one for each probe of probes.h */
+IBUS_M17N_PROBE_SEMAPHORE (startup);
+IBUS_M17N_PROBE_SEMAPHORE (key__start);
+IBUS_M17N_PROBE_SEMAPHORE (key__done);
+IBUS_M17N_PROBE_SEMAPHORE (filter__start);
+IBUS_M17N_PROBE_SEMAPHORE (filter__done);
+IBUS_M17N_PROBE_SEMAPHORE (lookup__start);
+IBUS_M17N_PROBE_SEMAPHORE (lookup__done);
+IBUS_M17N_PROBE_SEMAPHORE (callback);
+IBUS_M17N_PROBE_SEMAPHORE (commit);
+IBUS_M17N_PROBE_SEMAPHORE (im__open__start);
+IBUS_M17N_PROBE_SEMAPHORE (im__open__done);
+IBUS_M17N_PROBE_SEMAPHORE (im__close);
+#endif  /* HAVE_PROBES */
 
 typedef struct _IBusM17NEngine IBusM17NEngine;
 typedef struct _IBusM17NEngineClass IBusM17NEngineClass;
+typedef struct _IBusM17NCandidateWindow IBusM17NCandidateWindow;
+typedef struct _IBusM17NKeyRequest IBusM17NKeyRequest;
+typedef struct _IBusM17NCommand IBusM17NCommand;
+typedef struct _IBusM17NKeyStats IBusM17NKeyStats;
+
+typedef void (*IBusM17NDeferFunc) (gpointer data);
+
+/* number of neighbouring candidate windows converted ahead of time */
+#define CANDIDATE_PREFETCH_MAX 4
+
+/* number of characters decoded around the cursor at least, and at
+   most kept, when a MIM asks for surrounding text */
+#define SURROUNDING_TEXT_WINDOW 16
+#define SURROUNDING_TEXT_CACHE_MAX 256
+
+/* default number of input methods kept open at once, counting those
+   in use; unused ones beyond it are closed least recently used first */
+#define MAX_RESIDENT_INPUT_METHODS 8
+
+/* default number of seconds an unfocused instance without preedit
+   keeps its input context */
+#define CONTEXT_IDLE_TIMEOUT 300
+
+/* number of reset input contexts kept per input method, and of lookup
+   tables kept overall, for reuse by new instances; pools are emptied
+   after POOL_TRIM_TIMEOUT seconds without being drawn from */
+#define CONTEXT_POOL_MAX 4
+#define LOOKUP_TABLE_POOL_MAX 4
+#define POOL_TRIM_TIMEOUT 30
+
+/* default number of most used input methods opened after startup */
+#define PRELOAD_INPUT_METHODS 3
+
+/* seconds to wait after a use before saving the usage history */
+#define HISTORY_SAVE_DELAY 10
+
+/* default number of milliseconds key events are held while an input
+   method is being opened, before they are passed to the client */
+#define LOAD_TIMEOUT 1000
+
+/* default number of milliseconds a key may take on the worker thread
+   before worker_policy applies */
+#define WORKER_DEADLINE 50
+
+/* phases of a key event timed in IBusM17NKeyStats; filter and lookup
+   exclude the callbacks run meanwhile, which are counted in emit */
+typedef enum {
+    KEY_PHASE_SYMBOL,
+    KEY_PHASE_FILTER,
+    KEY_PHASE_LOOKUP,
+    KEY_PHASE_CONVERT,
+    KEY_PHASE_EMIT,
+    KEY_PHASE_TOTAL,
+    N_KEY_PHASES
+} KeyPhase;
+
+static const gchar *key_phase_names[N_KEY_PHASES] = {
+    "symbol", "filter", "lookup", "convert", "emit", "total",
+};
+
+typedef enum {
+    KEY_COUNTER_CALLBACKS,
+    KEY_COUNTER_COMMITS,
+    KEY_COUNTER_SURROUNDING_HITS,
+    KEY_COUNTER_SURROUNDING_MISSES,
+    KEY_COUNTER_PREFETCH_HITS,
+    KEY_COUNTER_PREFETCH_MISSES,
+    N_KEY_COUNTERS
+} KeyCounter;
+
+static const gchar *key_counter_names[N_KEY_COUNTERS] = {
+    "callbacks", "commits", "surrounding-hits", "surrounding-misses",
+    "prefetch-hits", "prefetch-misses",
+};
+
+/* latencies in nanoseconds and counts of an engine, kept from its
+   first key event on */
+struct _IBusM17NKeyStats {
+    IBusM17NHistogram phases[N_KEY_PHASES];
+    guint64 counters[N_KEY_COUNTERS];
+};
+
+/* converted candidates of a window of a candidate group */
+struct _IBusM17NCandidateWindow {
+    MPlist *group;
+    gint offset;
+    GPtrArray *candidates;
+};
+
+/* callback command recorded on the worker thread, with the argument
+   of Minput_delete_surrounding_text */
+struct _IBusM17NCommand {
+    MSymbol command;
+    long len;
+};
+
+/* ProcessKeyEvent call handled on the worker thread or, with func
+   set, work of the main thread on m17n queued behind the keys, or
+   with klass set, the opening of its input method for M17N, if not
+   NULL */
+struct _IBusM17NKeyRequest {
+    IBusM17NEngine *m17n;
+    IBusM17NDeferFunc func;
+    gpointer data;
+
+    /* opened on the worker thread, and installed in the main thread */
+    IBusM17NEngineClass *klass;
+    MInputMethod *im;
+    gssize im_cost;
+
+    GDBusMethodInvocation *invocation;
+    guint keyval;
+    guint keycode;
+    guint modifiers;
+    /* when the key arrived */
+    gint64 time;
+    guint64 start_ns;
+    /* set once the key went to the input method; only such keys are
+       timed as a whole */
+    gboolean timed;
+    /* time spent on the worker thread */
+    guint64 filter_ns;
+    guint64 lookup_ns;
+
+    MSymbol key;
+    gboolean filtered;
+    gint retval;
+    MText *produced;
+    GArray *commands;
+
+    /* surrounding text as the client last sent it, taken from the
+       engine in the main thread if the client supports it, for the MIM
+       to read */
+    IBusText *surrounding_text;
+    gsize surrounding_cursor_index;
+    /* counted on the worker thread, added up once the key is done */
+    guint counters[N_KEY_COUNTERS];
+
+    /* set once the client got an answer before the key was done */
+    gboolean replied;
+    guint deadline_id;
+    /* preedit shown before the key, committed when the key is passed
+       to the client, as m17n drops it afterwards */
+    IBusText *preedit;
+};
 
 struct _IBusM17NEngine {
     IBusEngine parent;
@@ -19,10 +182,58 @@ struct _IBusM17NEngine {
     MInputContext *context;
     IBusLookupTable *table;
     IBusProperty    *status_prop;
-#ifdef HAVE_SETUP
-    IBusProperty    *setup_prop;
-#endif  /* HAVE_SETUP */
     IBusPropList    *prop_list;
+
+    /* candidates currently loaded into the lookup table; only a
+       window of at most lookup_table_page_size candidates of the
+       current group is materialized */
+    MPlist          *candidate_list;
+    IBusM17NCandidateIndex
+                    *candidate_groups;
+    MPlist          *candidate_group;
+    gint             candidate_window_start;
+    gint             candidate_window_len;
+
+    /* windows next to the current one, converted in idle time */
+    GPtrArray       *candidate_prefetch;
+    guint            candidate_prefetch_id;
+
+    /* surrounding text decoded during the current key event; the
+       complete flags are set when the text ends within the window */
+    MText           *surrounding_before;
+    MText           *surrounding_after;
+    gboolean         surrounding_before_complete;
+    gboolean         surrounding_after_complete;
+
+    /* surrounding text as the client last sent it, handed to keys run
+       on the worker thread without asking the client again */
+    IBusText        *surrounding_text;
+    guint            surrounding_cursor_pos;
+    /* byte index of the cursor, found once per text */
+    gsize            surrounding_cursor_index;
+
+    /* scratch buffer for the characters of a character group */
+    GArray          *ucs4_buffer;
+
+    /* source releasing the context after context_idle_timeout */
+    guint            release_context_id;
+
+    /* while load_request is set, the input method is opened on the
+       worker thread and key events wait in key_requests; after
+       load_timeout, or if opening fails, keys are passed through
+       instead */
+    IBusM17NKeyRequest
+                    *load_request;
+    guint            load_timeout_id;
+    gboolean         pass_through;
+
+    /* task sending the status property to the panel */
+    guint            status_update_id;
+
+    /* key being handled on the worker thread; callbacks are recorded
+       in it and replayed in the main thread */
+    IBusM17NKeyRequest
+                    *key_request;
 };
 
 struct _IBusM17NEngineClass {
@@ -34,12 +245,32 @@ struct _IBusM17NEngineClass {
     guint preedit_background;
     gint preedit_underline;
     gint lookup_table_orientation;
+    gint lookup_table_page_size;
 
+    /* interned, as registered by ibus_m17n_engine_get_type_for_name */
+    const gchar *engine_name;
     MInputMethod *im;
+    /* number of instances holding an input context of im; when it
+       drops to zero, unused_link is queued in unused_ims */
+    guint im_refcount;
+    GList *unused_link;
+
+    /* reset input contexts of im, not owned by any instance */
+    GQueue context_pool;
+
+    /* for ibus_m17n_engine_get_stats: growth of RSS while im was last
+       opened, and the live instances */
+    gssize im_cost;
+    GList *instances;
+
+    /* for ibus_m17n_engine_get_key_stats; allocated on first use, in
+       the main thread */
+    IBusM17NKeyStats *key_stats;
 };
 
 /* functions prototype */
-static void ibus_m17n_engine_class_init     (IBusM17NEngineClass    *klass);
+static void ibus_m17n_engine_class_init     (IBusM17NEngineClass    *klass,
+                                             const gchar            *engine_name);
 static void ibus_m17n_config_value_changed  (IBusConfig             *config,
                                              const gchar            *section,
                                              const gchar            *name,
@@ -71,6 +302,13 @@ static void ibus_engine_set_cursor_location (IBusEngine             *engine,
 static void ibus_m17n_engine_set_capabilities
                                             (IBusEngine             *engine,
                                              guint                   caps);
+#ifdef HAVE_IBUS_ENGINE_GET_SURROUNDING_TEXT
+static void ibus_m17n_engine_set_surrounding_text
+                                            (IBusEngine             *engine,
+                                             IBusText               *text,
+                                             guint                   cursor_pos,
+                                             guint                   anchor_pos);
+#endif  /* HAVE_IBUS_ENGINE_GET_SURROUNDING_TEXT */
 static void ibus_m17n_engine_page_up        (IBusEngine             *engine);
 static void ibus_m17n_engine_page_down      (IBusEngine             *engine);
 static void ibus_m17n_engine_cursor_up      (IBusEngine             *engine);
@@ -86,26 +324,465 @@ static void ibus_m17n_engine_property_hide
                                             (IBusEngine             *engine,
                                              const gchar            *prop_name);
 
-static void ibus_m17n_engine_commit_string
+static void ibus_m17n_engine_commit_text
                                             (IBusM17NEngine         *m17n,
-                                             const gchar            *string);
+                                             IBusText               *text);
 static void ibus_m17n_engine_callback       (MInputContext          *context,
                                              MSymbol                 command);
 static void ibus_m17n_engine_update_preedit (IBusM17NEngine *m17n);
 static void ibus_m17n_engine_update_lookup_table
                                             (IBusM17NEngine *m17n);
+static void ibus_m17n_engine_forget_candidates
+                                            (IBusM17NEngine *m17n);
+static void ibus_m17n_engine_cancel_prefetch
+                                            (IBusM17NEngine *m17n);
+static void ibus_m17n_engine_forget_surrounding_text
+                                            (IBusM17NEngine *m17n);
+static void ibus_m17n_preload_top_ims       (void);
+static void ibus_m17n_engine_service_method_call
+                                            (IBusService            *service,
+                                             GDBusConnection        *connection,
+                                             const gchar            *sender,
+                                             const gchar            *object_path,
+                                             const gchar            *interface_name,
+                                             const gchar            *method_name,
+                                             GVariant               *parameters,
+                                             GDBusMethodInvocation  *invocation);
+static gboolean
+            ibus_m17n_engine_defer          (IBusM17NEngine         *m17n,
+                                             IBusM17NDeferFunc       func,
+                                             gpointer                data);
+static void ibus_m17n_engine_delete_surrounding_text
+                                            (IBusM17NEngine         *m17n,
+                                             long                    len);
+static gboolean
+            ibus_m17n_engine_process_key    (IBusM17NEngine         *m17n,
+                                             MSymbol                 key);
+static gboolean
+            ibus_m17n_engine_process_key_full
+                                            (IBusM17NEngine         *m17n,
+                                             MSymbol                 key,
+                                             gboolean                key_event);
+static void ibus_m17n_key_request_reply     (IBusM17NKeyRequest     *request,
+                                             gboolean                handled);
+static void ibus_m17n_key_request_free      (IBusM17NKeyRequest     *request);
+static void ibus_m17n_engine_run_key_requests
+                                            (void);
 
 static IBusEngineClass *parent_class = NULL;
 
 static IBusConfig      *config = NULL;
 
+/* opened input methods not used by any instance, most recently used
+   first */
+static GQueue           unused_ims = G_QUEUE_INIT;
+static guint            n_opened_ims = 0;
+static gint             max_resident_ims = MAX_RESIDENT_INPUT_METHODS;
+static gint             context_idle_timeout = CONTEXT_IDLE_TIMEOUT;
+static gint             preload_ims = PRELOAD_INPUT_METHODS;
+static gint             load_timeout = LOAD_TIMEOUT;
+
+/* input methods are opened on this thread, started on first use; with
+   worker_thread set, m17n processing of key events runs on it too,
+   one key at a time.  A key taking longer than worker_deadline is
+   waited for, or with worker_policy "forward", passed to the client
+   unhandled; then the preedit is committed as it was and the rest of
+   the input method state, like open candidates, is reset.  While an
+   open or a key runs, whatever else needs m17n, key events of every
+   engine included, is queued behind it and the scheduler is blocked,
+   so that the main loop never waits for the worker */
+typedef enum {
+    WORKER_POLICY_WAIT,
+    WORKER_POLICY_FORWARD
+} WorkerPolicy;
+
+static IBusM17NWorker  *worker = NULL;
+static gboolean         worker_thread = FALSE;
+static gint             worker_deadline = WORKER_DEADLINE;
+static WorkerPolicy     worker_policy = WORKER_POLICY_WAIT;
+static IBusM17NKeyRequest
+                       *running_key_request = NULL;
+static GQueue           key_requests = G_QUEUE_INIT;
+
+/* shard served by the process, or NULL for the default one */
+static gchar           *engine_shard = NULL;
+
+/* engine usage, and names of the engines to open ahead of time */
+static IBusM17NHistory *history = NULL;
+static guint            history_save_id = 0;
+static GQueue           preload_queue = G_QUEUE_INIT;
+static guint            preload_id = 0;
+
+/* nanoseconds spent in callbacks of m17n in the main thread so far;
+   the difference over a call to m17n is what it spent emitting */
+static guint64          emit_ns = 0;
+
+/* with IBUS_M17N_TRACE set to PATH, the events engines receive are
+   recorded in PATH.PID; see m17ntrace.c.  IBUS_M17N_TRACE_SCRAMBLE
+   set to 1 hides repeated keys too. */
+static IBusM17NTraceWriter
+                       *trace = NULL;
+
+/* input contexts alive, and those released from idle instances */
+static guint            n_contexts = 0;
+static guint            n_released_contexts = 0;
+
+#ifdef HAVE_SETUP
+/* the setup property is the same for every instance */
+static IBusProperty    *setup_prop = NULL;
+#endif  /* HAVE_SETUP */
+
+static GSList          *engine_classes = NULL;
+static GQueue           lookup_table_pool = G_QUEUE_INIT;
+static guint            pool_trim_id = 0;
+
+static void
+ibus_m17n_engine_class_drain_pool (IBusM17NEngineClass *klass)
+{
+    MInputContext *context;
+
+    while ((context = g_queue_pop_head (&klass->context_pool)) != NULL)
+        minput_destroy_ic (context);
+}
+
+static gboolean
+ibus_m17n_trim_pools (gpointer user_data)
+{
+    GSList *p;
+    IBusLookupTable *table;
+
+    /* try again later rather than wait for the worker */
+    if (running_key_request != NULL)
+        return TRUE;
+
+    for (p = engine_classes; p != NULL; p = p->next)
+        ibus_m17n_engine_class_drain_pool (p->data);
+
+    while ((table = g_queue_pop_head (&lookup_table_pool)) != NULL)
+        g_object_unref (table);
+
+    pool_trim_id = 0;
+    return FALSE;
+}
+
+/* (Re)start the countdown to emptying the pools. */
+static void
+ibus_m17n_schedule_trim_pools (void)
+{
+    if (pool_trim_id != 0)
+        g_source_remove (pool_trim_id);
+    pool_trim_id = g_timeout_add_seconds_full (G_PRIORITY_LOW,
+                                               POOL_TRIM_TIMEOUT,
+                                               ibus_m17n_trim_pools,
+                                               NULL,
+                                               NULL);
+}
+
+/* A table acquired here is owned by the instance holding it in
+   m17n->table alone: IBus serializes the table when it is updated and
+   keeps no reference, and nothing else takes one.  Releasing it hands
+   that sole reference back to the pool. */
+/* Empty TABLE, labels included, which ibus_lookup_table_clear()
+   keeps. */
+static void
+ibus_m17n_reset_lookup_table (IBusLookupTable *table)
+{
+    guint i;
+
+    ibus_lookup_table_clear (table);
+    for (i = 0; i < table->labels->len; i++) {
+        IBusText *label = g_array_index (table->labels, IBusText *, i);
+
+        if (label != NULL)
+            g_object_unref (label);
+    }
+    g_array_set_size (table->labels, 0);
+}
+
+static IBusLookupTable *
+ibus_m17n_acquire_lookup_table (void)
+{
+    IBusLookupTable *table = g_queue_pop_head (&lookup_table_pool);
+
+    if (table != NULL) {
+        ibus_m17n_reset_lookup_table (table);
+        ibus_m17n_schedule_trim_pools ();
+        return table;
+    }
+
+    table = ibus_lookup_table_new (9, 0, TRUE, TRUE);
+    g_object_ref_sink (table);
+    return table;
+}
+
+static void
+ibus_m17n_release_lookup_table (IBusLookupTable *table)
+{
+    if (g_queue_get_length (&lookup_table_pool) >= LOOKUP_TABLE_POOL_MAX) {
+        g_object_unref (table);
+        return;
+    }
+
+    ibus_lookup_table_clear (table);
+    g_queue_push_head (&lookup_table_pool, table);
+    ibus_m17n_schedule_trim_pools ();
+}
+
+static void ibus_m17n_close_unused_ims_deferred (gpointer data);
+
+static void
+ibus_m17n_close_unused_ims (guint max_opened)
+{
+    if (ibus_m17n_engine_defer (NULL, ibus_m17n_close_unused_ims_deferred,
+                                GUINT_TO_POINTER (max_opened)))
+        return;
+
+    while (n_opened_ims > max_opened && !g_queue_is_empty (&unused_ims)) {
+        IBusM17NEngineClass *klass = g_queue_pop_tail (&unused_ims);
+
+        g_assert (klass->im_refcount == 0);
+        g_list_free (klass->unused_link);
+        klass->unused_link = NULL;
+
+        ibus_m17n_engine_class_drain_pool (klass);
+        IBUS_M17N_PROBE1 (im__close, klass->engine_name);
+        minput_close_im (klass->im);
+        klass->im = NULL;
+        n_opened_ims--;
+    }
+}
+
+static void
+ibus_m17n_close_unused_ims_deferred (gpointer data)
+{
+    ibus_m17n_close_unused_ims (GPOINTER_TO_UINT (data));
+}
+
+static void
+ibus_m17n_global_config_value_changed (IBusConfig  *config,
+                                       const gchar *section,
+                                       const gchar *name,
+                                       GVariant    *value,
+                                       gpointer     user_data)
+{
+    if (g_strcmp0 (section, "engine/M17N") != 0 || value == NULL)
+        return;
+
+    if (g_strcmp0 (name, "worker_policy") == 0 &&
+        g_variant_is_of_type (value, G_VARIANT_TYPE_STRING)) {
+        worker_policy =
+            g_strcmp0 (g_variant_get_string (value, NULL), "forward") == 0 ?
+            WORKER_POLICY_FORWARD : WORKER_POLICY_WAIT;
+        return;
+    }
+
+    if (!g_variant_is_of_type (value, G_VARIANT_TYPE_INT32))
+        return;
+
+    if (g_strcmp0 (name, "max_resident_input_methods") == 0) {
+        max_resident_ims = g_variant_get_int32 (value);
+        if (max_resident_ims >= 0)
+            ibus_m17n_close_unused_ims (max_resident_ims);
+    } else if (g_strcmp0 (name, "context_idle_timeout") == 0) {
+        context_idle_timeout = g_variant_get_int32 (value);
+    } else if (g_strcmp0 (name, "preload_input_methods") == 0) {
+        preload_ims = g_variant_get_int32 (value);
+    } else if (g_strcmp0 (name, "load_timeout") == 0) {
+        load_timeout = g_variant_get_int32 (value);
+    } else if (g_strcmp0 (name, "worker_deadline") == 0) {
+        worker_deadline = g_variant_get_int32 (value);
+    }
+}
+
+static void
+ibus_m17n_get_global_config (const gchar *name,
+                             gint        *retval)
+{
+    GVariant *value;
+
+    value = ibus_config_get_value (config, "engine/M17N", name);
+    if (value != NULL) {
+        if (g_variant_is_of_type (value, G_VARIANT_TYPE_INT32))
+            *retval = g_variant_get_int32 (value);
+        g_variant_unref (value);
+    }
+}
+
+#if GLIB_CHECK_VERSION(2,64,0)
+static void
+ibus_m17n_low_memory_warning (GMemoryMonitor             *monitor,
+                              GMemoryMonitorWarningLevel  level,
+                              gpointer                    user_data)
+{
+    /* unused input methods are reopened on demand */
+    ibus_m17n_close_unused_ims (0);
+}
+#endif  /* GLIB_CHECK_VERSION(2,64,0) */
+
+static void
+ibus_m17n_open_trace (void)
+{
+    const gchar *path = g_getenv ("IBUS_M17N_TRACE");
+    gchar *filename;
+    gboolean scramble;
+    GError *error = NULL;
+
+    if (path == NULL || *path == '\0')
+        return;
+
+    filename = g_strdup_printf ("%s.%d", path, (gint) getpid ());
+    scramble = g_strcmp0 (g_getenv ("IBUS_M17N_TRACE_SCRAMBLE"), "1") == 0;
+    trace = ibus_m17n_trace_writer_new (filename, scramble, &error);
+    if (trace == NULL) {
+        g_warning ("Can not open trace: %s", error->message);
+        g_error_free (error);
+    }
+    g_free (filename);
+}
+
+/* the buffered end of the trace would be lost at exit */
+static void
+ibus_m17n_close_trace (IBusBus  *bus,
+                       gpointer  user_data)
+{
+    if (trace != NULL) {
+        ibus_m17n_trace_writer_free (trace);
+        trace = NULL;
+    }
+}
+
+static void
+ibus_m17n_engine_trace_key (IBusM17NEngine *m17n,
+                            gint64          time,
+                            guint           keyval,
+                            guint           keycode,
+                            guint           modifiers,
+                            gboolean        handled)
+{
+    IBusM17NTraceEvent event;
+
+    /* a destroyed engine has lost its name */
+    if (trace == NULL || IBUS_OBJECT_DESTROYED (m17n))
+        return;
+
+    event.type = IBUS_M17N_TRACE_KEY;
+    event.time = time;
+    event.engine_name = ibus_engine_get_name ((IBusEngine *) m17n);
+    event.keyval = keyval;
+    event.keycode = keycode;
+    event.modifiers = modifiers;
+    event.handled = handled;
+    ibus_m17n_trace_writer_add (trace, &event, FALSE);
+}
+
+static void
+ibus_m17n_engine_trace (IBusM17NEngine        *m17n,
+                        IBusM17NTraceEventType type)
+{
+    IBusM17NTraceEvent event = { 0, };
+
+    if (trace == NULL)
+        return;
+
+    event.type = type;
+    event.time = g_get_monotonic_time ();
+    event.engine_name = ibus_engine_get_name ((IBusEngine *) m17n);
+    /* the user is away from the engine, a good time to write out */
+    ibus_m17n_trace_writer_add (trace, &event,
+                                type == IBUS_M17N_TRACE_FOCUS_OUT);
+}
+
+static IBusM17NKeyStats *
+ibus_m17n_engine_class_key_stats (IBusM17NEngine *m17n)
+{
+    IBusM17NEngineClass *klass =
+        (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+
+    if (klass->key_stats == NULL)
+        klass->key_stats = g_new0 (IBusM17NKeyStats, 1);
+    return klass->key_stats;
+}
+
+static void
+ibus_m17n_engine_count (IBusM17NEngine *m17n,
+                        KeyCounter      counter)
+{
+    if (m17n->key_request != NULL)
+        m17n->key_request->counters[counter]++;
+    else
+        ibus_m17n_engine_class_key_stats (m17n)->counters[counter]++;
+}
+
+static void
+ibus_m17n_engine_add_phase (IBusM17NEngine *m17n,
+                            KeyPhase        phase,
+                            guint64         ns)
+{
+    ibus_m17n_histogram_add (&ibus_m17n_engine_class_key_stats (m17n)->phases[phase],
+                             ns);
+}
+
 void
-ibus_m17n_init (IBusBus *bus)
+ibus_m17n_init (IBusBus     *bus,
+                const gchar *shard)
 {
+    GVariant *value;
+#if GLIB_CHECK_VERSION(2,64,0)
+    GMemoryMonitor *monitor;
+#endif  /* GLIB_CHECK_VERSION(2,64,0) */
+
+    engine_shard = g_strdup (shard);
+
     config = ibus_bus_get_config (bus);
-    if (config)
+    if (config) {
         g_object_ref_sink (config);
+
+        ibus_m17n_get_global_config ("max_resident_input_methods",
+                                     &max_resident_ims);
+        ibus_m17n_get_global_config ("context_idle_timeout",
+                                     &context_idle_timeout);
+        ibus_m17n_get_global_config ("preload_input_methods",
+                                     &preload_ims);
+        ibus_m17n_get_global_config ("load_timeout", &load_timeout);
+        ibus_m17n_get_global_config ("worker_deadline", &worker_deadline);
+
+        value = ibus_config_get_value (config, "engine/M17N", "worker_policy");
+        if (value != NULL) {
+            ibus_m17n_global_config_value_changed (config, "engine/M17N",
+                                                   "worker_policy", value,
+                                                   NULL);
+            g_variant_unref (value);
+        }
+
+        value = ibus_config_get_value (config, "engine/M17N", "worker_thread");
+        if (value != NULL) {
+            if (g_variant_is_of_type (value, G_VARIANT_TYPE_BOOLEAN) &&
+                g_variant_get_boolean (value))
+                worker_thread = TRUE;
+            g_variant_unref (value);
+        }
+
+        g_signal_connect (config, "value-changed",
+                          G_CALLBACK(ibus_m17n_global_config_value_changed),
+                          NULL);
+    }
+
+#if GLIB_CHECK_VERSION(2,64,0)
+    /* the monitor is kept for the lifetime of the process */
+    monitor = g_memory_monitor_dup_default ();
+    g_signal_connect (monitor, "low-memory-warning",
+                      G_CALLBACK(ibus_m17n_low_memory_warning),
+                      NULL);
+#endif  /* GLIB_CHECK_VERSION(2,64,0) */
+
     ibus_m17n_init_common ();
+
+    ibus_m17n_open_trace ();
+    if (trace != NULL)
+        g_signal_connect (bus, "disconnected",
+                          G_CALLBACK (ibus_m17n_close_trace), NULL);
+
+    ibus_m17n_preload_top_ims ();
 }
 
 static gboolean
@@ -172,7 +849,7 @@ ibus_m17n_engine_get_type_for_name (const gchar *engine_name)
         (GBaseFinalizeFunc)  NULL,
         (GClassInitFunc)     ibus_m17n_engine_class_init,
         (GClassFinalizeFunc) NULL,
-        NULL,
+        NULL,   /* class_data, the engine name */
         sizeof (IBusM17NEngine),
         0,
         (GInstanceInitFunc)  ibus_m17n_engine_init,
@@ -193,6 +870,9 @@ ibus_m17n_engine_get_type_for_name (const gchar *engine_name)
     g_assert (type == 0 || g_type_is_a (type, IBUS_TYPE_ENGINE));
 
     if (type == 0) {
+        /* the type name does not round-trip the case of the name, so
+           the class is told the engine name itself */
+        type_info.class_data = g_intern_string (engine_name);
         type = g_type_register_static (IBUS_TYPE_ENGINE,
                                        type_name,
                                        &type_info,
@@ -203,13 +883,147 @@ ibus_m17n_engine_get_type_for_name (const gchar *engine_name)
     return type;
 }
 
+static guint64
+ibus_m17n_mtext_cost (MText *mt)
+{
+    /* m17n stores at most four bytes per character */
+    return mt ? (guint64) mtext_len (mt) * 4 : 0;
+}
+
+static GVariant *
+ibus_m17n_engine_class_get_stats (IBusM17NEngineClass *klass)
+{
+    GVariantBuilder builder;
+    guint n_contexts = 0, n_candidates = 0;
+    guint64 cached_bytes = 0;
+    GList *p;
+    guint i, j;
+
+    for (p = klass->instances; p != NULL; p = p->next) {
+        IBusM17NEngine *m17n = p->data;
+
+        if (m17n->context != NULL)
+            n_contexts++;
+        if (m17n->table != NULL)
+            n_candidates +=
+                ibus_lookup_table_get_number_of_candidates (m17n->table);
+
+        /* the worker thread may be decoding it */
+        if (m17n->key_request == NULL) {
+            cached_bytes += ibus_m17n_mtext_cost (m17n->surrounding_before);
+            cached_bytes += ibus_m17n_mtext_cost (m17n->surrounding_after);
+        }
+        cached_bytes += m17n->ucs4_buffer->len * sizeof (gunichar);
+        if (m17n->candidate_prefetch != NULL) {
+            for (i = 0; i < m17n->candidate_prefetch->len; i++) {
+                IBusM17NCandidateWindow *window =
+                    g_ptr_array_index (m17n->candidate_prefetch, i);
+
+                for (j = 0; j < window->candidates->len; j++) {
+                    IBusText *text = g_ptr_array_index (window->candidates, j);
+                    cached_bytes += strlen (text->text) + 1;
+                }
+            }
+        }
+    }
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (&builder, "{sv}", "im-open",
+                           g_variant_new_boolean (klass->im != NULL));
+    g_variant_builder_add (&builder, "{sv}", "im-cost",
+                           g_variant_new_int64 (klass->im_cost));
+    g_variant_builder_add (&builder, "{sv}", "instances",
+                           g_variant_new_uint32 (g_list_length (klass->instances)));
+    g_variant_builder_add (&builder, "{sv}", "contexts",
+                           g_variant_new_uint32 (n_contexts));
+    g_variant_builder_add (&builder, "{sv}", "pooled-contexts",
+                           g_variant_new_uint32 (g_queue_get_length (&klass->context_pool)));
+    g_variant_builder_add (&builder, "{sv}", "lookup-table-candidates",
+                           g_variant_new_uint32 (n_candidates));
+    g_variant_builder_add (&builder, "{sv}", "cached-bytes",
+                           g_variant_new_uint64 (cached_bytes));
+    return g_variant_builder_end (&builder);
+}
+
+/* Return the memory accounting of the process and of each engine
+   class with an open input method or live instances, as
+   (a{sv}a{sa{sv}}). */
+GVariant *
+ibus_m17n_engine_get_stats (void)
+{
+    GVariantBuilder globals, engines;
+    GSList *p;
+
+    g_variant_builder_init (&globals, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (&globals, "{sv}", "rss",
+                           g_variant_new_uint64 (ibus_m17n_get_rss ()));
+    g_variant_builder_add (&globals, "{sv}", "opened-ims",
+                           g_variant_new_uint32 (n_opened_ims));
+    g_variant_builder_add (&globals, "{sv}", "unused-ims",
+                           g_variant_new_uint32 (g_queue_get_length (&unused_ims)));
+    g_variant_builder_add (&globals, "{sv}", "contexts",
+                           g_variant_new_uint32 (n_contexts));
+    g_variant_builder_add (&globals, "{sv}", "released-contexts",
+                           g_variant_new_uint32 (n_released_contexts));
+    g_variant_builder_add (&globals, "{sv}", "pooled-lookup-tables",
+                           g_variant_new_uint32 (g_queue_get_length (&lookup_table_pool)));
+
+    g_variant_builder_init (&engines, G_VARIANT_TYPE ("a{sa{sv}}"));
+    for (p = engine_classes; p != NULL; p = p->next) {
+        IBusM17NEngineClass *klass = p->data;
+
+        if (klass->engine_name == NULL ||
+            (klass->im == NULL && klass->instances == NULL))
+            continue;
+        g_variant_builder_add (&engines, "{s@a{sv}}",
+                               klass->engine_name,
+                               ibus_m17n_engine_class_get_stats (klass));
+    }
+
+    return g_variant_new ("(a{sv}a{sa{sv}})", &globals, &engines);
+}
+
+/* Return the key event statistics of each engine which has had key
+   events, as (a{sa{sv}}): for each phase, its histogram as returned
+   by ibus_m17n_histogram_serialize, and each counter. */
+GVariant *
+ibus_m17n_engine_get_key_stats (void)
+{
+    GVariantBuilder engines;
+    GSList *p;
+
+    g_variant_builder_init (&engines, G_VARIANT_TYPE ("a{sa{sv}}"));
+    for (p = engine_classes; p != NULL; p = p->next) {
+        IBusM17NEngineClass *klass = p->data;
+        GVariantBuilder values;
+        guint i;
+
+        if (klass->key_stats == NULL)
+            continue;
+
+        g_variant_builder_init (&values, G_VARIANT_TYPE_VARDICT);
+        for (i = 0; i < N_KEY_PHASES; i++)
+            g_variant_builder_add (&values, "{sv}", key_phase_names[i],
+                                   ibus_m17n_histogram_serialize (&klass->key_stats->phases[i]));
+        for (i = 0; i < N_KEY_COUNTERS; i++)
+            g_variant_builder_add (&values, "{sv}", key_counter_names[i],
+                                   g_variant_new_uint64 (klass->key_stats->counters[i]));
+        g_variant_builder_add (&engines, "{sa{sv}}", klass->engine_name,
+                               &values);
+    }
+
+    return g_variant_new ("(a{sa{sv}})", &engines);
+}
+
 static void
-ibus_m17n_engine_class_init (IBusM17NEngineClass *klass)
+ibus_m17n_engine_class_init (IBusM17NEngineClass *klass,
+                             const gchar         *engine_name)
 {
     GObjectClass *object_class = G_OBJECT_CLASS (klass);
     IBusObjectClass *ibus_object_class = IBUS_OBJECT_CLASS (klass);
+    IBusServiceClass *service_class = IBUS_SERVICE_CLASS (klass);
     IBusEngineClass *engine_class = IBUS_ENGINE_CLASS (klass);
-    gchar *engine_name, *lang = NULL, *name = NULL;
+    gchar *lang = NULL, *name = NULL;
     IBusM17NEngineConfig *engine_config;
     GVariant *values;
 
@@ -219,6 +1033,8 @@ ibus_m17n_engine_class_init (IBusM17NEngineClass *klass)
     object_class->constructor = ibus_m17n_engine_constructor;
     ibus_object_class->destroy = (IBusObjectDestroyFunc) ibus_m17n_engine_destroy;
 
+    service_class->service_method_call = ibus_m17n_engine_service_method_call;
+
     engine_class->process_key_event = ibus_m17n_engine_process_key_event;
 
     engine_class->reset = ibus_m17n_engine_reset;
@@ -236,19 +1052,24 @@ ibus_m17n_engine_class_init (IBusM17NEngineClass *klass)
 
     engine_class->property_activate = ibus_m17n_engine_property_activate;
 
+#ifdef HAVE_IBUS_ENGINE_GET_SURROUNDING_TEXT
+    engine_class->set_surrounding_text = ibus_m17n_engine_set_surrounding_text;
+#endif  /* HAVE_IBUS_ENGINE_GET_SURROUNDING_TEXT */
+
+    klass->engine_name = engine_name;
+
+    /* the config section keeps the name it always had */
     if (!ibus_m17n_scan_class_name (G_OBJECT_CLASS_NAME (klass),
                                     &lang, &name)) {
         g_free (lang);
         g_free (name);
         return;
     }
-    engine_name = g_strdup_printf ("m17n:%s:%s", lang, name);
     klass->config_section = g_strdup_printf ("engine/M17N/%s/%s", lang, name);
     g_free (lang);
     g_free (name);
 
     engine_config = ibus_m17n_get_engine_config (engine_name);
-    g_free (engine_name);
 
     /* configurations are per class */
     klass->preedit_foreground = engine_config->preedit_highlight ?
@@ -259,11 +1080,13 @@ ibus_m17n_engine_class_init (IBusM17NEngineClass *klass)
         INVALID_COLOR;
     klass->preedit_underline = IBUS_ATTR_UNDERLINE_NONE;
     klass->lookup_table_orientation = IBUS_ORIENTATION_SYSTEM;
+    klass->lookup_table_page_size = LOOKUP_TABLE_PAGE_SIZE;
 
     ibus_m17n_engine_config_free (engine_config);
 
-    values = ibus_config_get_values (config,
-                                     klass->config_section);
+    /* there is no config when the engine runs without ibus-daemon */
+    values = config ? ibus_config_get_values (config,
+                                              klass->config_section) : NULL;
     if (values != NULL) {
         GVariant *value;
 
@@ -300,86 +1123,685 @@ ibus_m17n_engine_class_init (IBusM17NEngineClass *klass)
             klass->lookup_table_orientation = g_variant_get_int32 (value);
         }
         g_variant_unref (value);
+
+        value = g_variant_lookup_value (values,
+                                        "lookup_table_page_size",
+                                        G_VARIANT_TYPE_INT32);
+        if (value != NULL) {
+            klass->lookup_table_page_size = g_variant_get_int32 (value);
+        }
+        g_variant_unref (value);
         g_variant_unref (values);
     }
 
-    g_signal_connect (config, "value-changed",
-                      G_CALLBACK(ibus_m17n_config_value_changed),
-                      klass);
+    if (config)
+        g_signal_connect (config, "value-changed",
+                          G_CALLBACK(ibus_m17n_config_value_changed),
+                          klass);
 
     klass->im = NULL;
+    klass->im_refcount = 0;
+    klass->unused_link = NULL;
+    g_queue_init (&klass->context_pool);
+
+    klass->im_cost = 0;
+    klass->instances = NULL;
+    klass->key_stats = NULL;
+
+    engine_classes = g_slist_prepend (engine_classes, klass);
 }
 
-static void
-ibus_m17n_config_value_changed (IBusConfig          *config,
-                                const gchar         *section,
-                                const gchar         *name,
-                                GVariant            *value,
-                                IBusM17NEngineClass *klass)
+static IBusM17NWorker *
+ibus_m17n_get_worker (void)
 {
-    if (g_strcmp0 (section, klass->config_section) == 0) {
-        if (g_strcmp0 (name, "preedit_foreground") == 0) {
-            const gchar *hex = g_variant_get_string (value, NULL);
-            guint color;
-            color = ibus_m17n_parse_color (hex);
-            if (color != INVALID_COLOR) {
-                klass->preedit_foreground = color;
-            }
-        } else if (g_strcmp0 (name, "preedit_background") == 0) {
-            const gchar *hex = g_variant_get_string (value, NULL);
-            guint color;
-            color = ibus_m17n_parse_color (hex);
-            if (color != INVALID_COLOR) {
-                klass->preedit_background = color;
-            }
-        } else if (g_strcmp0 (name, "preedit_underline") == 0) {
-            klass->preedit_underline = g_variant_get_int32 (value);
-        } else if (g_strcmp0 (name, "lookup_table_orientation") == 0) {
-            klass->lookup_table_orientation = g_variant_get_int32 (value);
-        }
-    }
+    if (worker == NULL)
+        worker = ibus_m17n_worker_new (8);
+    return worker;
 }
 
+/* Open the input method of KLASS into REQUEST.  Runs on the worker
+   thread, so KLASS is only read. */
 static void
-ibus_m17n_engine_init (IBusM17NEngine *m17n)
+ibus_m17n_load_request_run (gpointer user_data)
 {
-    IBusText* label;
-    IBusText* tooltip;
-
-    m17n->prop_list = ibus_prop_list_new ();
-    g_object_ref_sink (m17n->prop_list);
-
-    m17n->status_prop = ibus_property_new ("status",
-                                           PROP_TYPE_NORMAL,
-                                           NULL,
-                                           NULL,
-                                           NULL,
-                                           TRUE,
-                                           FALSE,
-                                           0,
-                                           NULL);
-    g_object_ref_sink (m17n->status_prop);
-    ibus_prop_list_append (m17n->prop_list,  m17n->status_prop);
+    IBusM17NKeyRequest *request = user_data;
+    IBusM17NEngineClass *klass = request->klass;
+    gchar *lang = NULL, *name = NULL;
+    gsize rss;
 
-#ifdef HAVE_SETUP
-    label = ibus_text_new_from_string ("Setup");
-    tooltip = ibus_text_new_from_string ("Configure M17N engine");
-    m17n->setup_prop = ibus_property_new ("setup",
-                                          PROP_TYPE_NORMAL,
-                                          label,
-                                          "gtk-preferences",
-                                          tooltip,
-                                          TRUE,
-                                          TRUE,
-                                          PROP_STATE_UNCHECKED,
-                                          NULL);
-    g_object_ref_sink (m17n->setup_prop);
-    ibus_prop_list_append (m17n->prop_list, m17n->setup_prop);
-#endif  /* HAVE_SETUP */
+    if (klass->engine_name == NULL ||
+        !ibus_m17n_scan_engine_name (klass->engine_name, &lang, &name)) {
+        g_free (lang);
+        g_free (name);
+        return;
+    }
 
-    m17n->table = ibus_lookup_table_new (9, 0, TRUE, TRUE);
-    g_object_ref_sink (m17n->table);
-    m17n->context = NULL;
+    IBUS_M17N_PROBE1 (im__open__start, klass->engine_name);
+    rss = ibus_m17n_get_rss ();
+    request->im = ibus_m17n_open_im (msymbol (lang), msymbol (name));
+    request->im_cost = (gssize) ibus_m17n_get_rss () - (gssize) rss;
+    IBUS_M17N_PROBE2 (im__open__done, klass->engine_name,
+                      request->im != NULL);
+    g_free (lang);
+    g_free (name);
+}
+
+/* Queue the opening of the input method of KLASS on the worker
+   thread, for M17N if not NULL. */
+static IBusM17NKeyRequest *
+ibus_m17n_load_request_new (IBusM17NEngineClass *klass,
+                            IBusM17NEngine      *m17n)
+{
+    IBusM17NKeyRequest *request = g_slice_new0 (IBusM17NKeyRequest);
+
+    request->klass = g_type_class_ref (G_TYPE_FROM_CLASS (klass));
+    if (m17n != NULL)
+        request->m17n = g_object_ref (m17n);
+    g_queue_push_tail (&key_requests, request);
+
+    return request;
+}
+
+/* Make IM, opened on the worker thread, the input method of KLASS,
+   unused until an instance takes a reference. */
+static void
+ibus_m17n_engine_class_install_im (IBusM17NEngineClass *klass,
+                                   MInputMethod        *im,
+                                   gssize               im_cost)
+{
+    if (im == NULL) {
+        g_warning ("Can not find m17n keymap %s", klass->engine_name);
+        return;
+    }
+
+    klass->im = im;
+    klass->im_cost = im_cost;
+    n_opened_ims++;
+
+    mplist_put (klass->im->driver.callback_list, Minput_preedit_start, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_preedit_draw, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_preedit_done, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_status_start, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_status_draw, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_status_done, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_candidates_start, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_candidates_draw, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_candidates_done, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_set_spot, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_toggle, ibus_m17n_engine_callback);
+    /*
+      Does not set reset callback, uses the default callback in m17n.
+      mplist_put (klass->im->driver.callback_list, Minput_reset, ibus_m17n_engine_callback);
+    */
+    mplist_put (klass->im->driver.callback_list, Minput_get_surrounding_text, ibus_m17n_engine_callback);
+    mplist_put (klass->im->driver.callback_list, Minput_delete_surrounding_text, ibus_m17n_engine_callback);
+
+    g_queue_push_head (&unused_ims, klass);
+    klass->unused_link = g_queue_peek_head_link (&unused_ims);
+}
+
+/* Take a reference to the input method of KLASS, or return NULL if it
+   is not open; see ibus_m17n_engine_start_loading. */
+static MInputMethod *
+ibus_m17n_engine_class_ref_im (IBusM17NEngineClass *klass)
+{
+    if (klass->im == NULL)
+        return NULL;
+
+    if (klass->unused_link != NULL) {
+        g_queue_unlink (&unused_ims, klass->unused_link);
+        g_list_free (klass->unused_link);
+        klass->unused_link = NULL;
+    }
+    klass->im_refcount++;
+
+    return klass->im;
+}
+
+/* Drop a reference taken with ibus_m17n_engine_class_ref_im.  The
+   input method stays open until the resident budget is exceeded or
+   memory runs low. */
+static void
+ibus_m17n_engine_class_unref_im (IBusM17NEngineClass *klass)
+{
+    g_return_if_fail (klass->im_refcount > 0);
+
+    if (--klass->im_refcount > 0)
+        return;
+
+    g_queue_push_head (&unused_ims, klass);
+    klass->unused_link = g_queue_peek_head_link (&unused_ims);
+
+    if (max_resident_ims >= 0)
+        ibus_m17n_close_unused_ims (max_resident_ims);
+}
+
+/* Return whether ENGINE_NAME has the shape m17n:LANG:NAME, without
+   the criticals of ibus_m17n_scan_engine_name. */
+static gboolean
+ibus_m17n_is_engine_name (const gchar *engine_name)
+{
+    gchar **strv;
+    gboolean retval;
+
+    strv = g_strsplit (engine_name, ":", 3);
+    retval = g_strv_length (strv) == 3 &&
+        g_strcmp0 (strv[0], "m17n") == 0 &&
+        *strv[1] != '\0' && *strv[2] != '\0';
+    g_strfreev (strv);
+
+    return retval;
+}
+
+/* Have the input method of ENGINE_NAME opened, if it is not open yet,
+   and left unused for the first instance to pick up. */
+static void
+ibus_m17n_preload_im (const gchar *engine_name)
+{
+    GType type;
+    IBusM17NEngineClass *klass;
+    IBusM17NEngineConfig *engine_config;
+    gboolean served;
+
+    /* names come from the history file, which may be corrupt */
+    if (!ibus_m17n_is_engine_name (engine_name))
+        return;
+
+    /* the history may name engines of other shards */
+    engine_config = ibus_m17n_get_engine_config (engine_name);
+    served = g_strcmp0 (engine_config->shard, engine_shard) == 0;
+    ibus_m17n_engine_config_free (engine_config);
+    if (!served)
+        return;
+
+    type = ibus_m17n_engine_get_type_for_name (engine_name);
+    if (type == G_TYPE_INVALID)
+        return;
+
+    klass = g_type_class_ref (type);
+    if (klass->im == NULL) {
+        ibus_m17n_load_request_new (klass, NULL);
+        ibus_m17n_engine_run_key_requests ();
+    }
+    g_type_class_unref (klass);
+}
+
+static gboolean
+ibus_m17n_preload_idle (gpointer user_data)
+{
+    gchar *engine_name = g_queue_pop_head (&preload_queue);
+
+    /* one input method per idle call, so that the opens queued by new
+       instances are not kept behind all of them */
+    if (engine_name != NULL) {
+        ibus_m17n_preload_im (engine_name);
+        g_free (engine_name);
+    }
+
+    if (g_queue_is_empty (&preload_queue)) {
+        preload_id = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+ibus_m17n_schedule_preload (const gchar *engine_name)
+{
+    g_queue_push_tail (&preload_queue, g_strdup (engine_name));
+    if (preload_id == 0)
+        preload_id = ibus_m17n_scheduler_add (IBUS_M17N_TASK_BACKGROUND,
+                                              ibus_m17n_preload_idle,
+                                              NULL,
+                                              NULL);
+}
+
+/* Load the usage history and open the most used input methods in
+   idle time. */
+static void
+ibus_m17n_preload_top_ims (void)
+{
+    gchar *basename, *filename, **top;
+    guint n, i;
+
+    /* shards run at once, and each would overwrite the file of the
+       others */
+    basename = engine_shard ? g_strconcat ("history-", engine_shard, NULL) :
+        g_strdup ("history");
+    filename = g_build_filename (g_get_user_cache_dir (),
+                                 "ibus-m17n", basename, NULL);
+    g_free (basename);
+    history = ibus_m17n_history_new (filename);
+    g_free (filename);
+
+    if (preload_ims <= 0)
+        return;
+
+    /* do not open more than would stay open */
+    n = preload_ims;
+    if (max_resident_ims >= 0)
+        n = MIN (n, (guint) max_resident_ims);
+
+    top = ibus_m17n_history_get_top (history, n);
+    for (i = 0; top[i] != NULL; i++)
+        ibus_m17n_schedule_preload (top[i]);
+    g_strfreev (top);
+}
+
+static gboolean
+ibus_m17n_save_history (gpointer user_data)
+{
+    GError *error = NULL;
+
+    if (!ibus_m17n_history_save (history, &error)) {
+        g_warning ("Can not save usage history: %s", error->message);
+        g_error_free (error);
+    }
+    history_save_id = 0;
+    return FALSE;
+}
+
+/* Count a use of ENGINE_NAME and open the input method usually
+   switched to next. */
+static void
+ibus_m17n_record_use (const gchar *engine_name)
+{
+    gchar *next;
+
+    if (history == NULL)
+        return;
+
+    ibus_m17n_history_record (history, engine_name);
+    if (history_save_id == 0)
+        history_save_id = g_timeout_add_seconds_full (G_PRIORITY_LOW,
+                                                      HISTORY_SAVE_DELAY,
+                                                      ibus_m17n_save_history,
+                                                      NULL,
+                                                      NULL);
+
+    next = ibus_m17n_history_get_next (history, engine_name);
+    if (next != NULL && preload_ims > 0)
+        ibus_m17n_schedule_preload (next);
+    g_free (next);
+}
+
+static void
+ibus_m17n_config_value_changed (IBusConfig          *config,
+                                const gchar         *section,
+                                const gchar         *name,
+                                GVariant            *value,
+                                IBusM17NEngineClass *klass)
+{
+    if (g_strcmp0 (section, klass->config_section) == 0) {
+        if (g_strcmp0 (name, "preedit_foreground") == 0) {
+            const gchar *hex = g_variant_get_string (value, NULL);
+            guint color;
+            color = ibus_m17n_parse_color (hex);
+            if (color != INVALID_COLOR) {
+                klass->preedit_foreground = color;
+            }
+        } else if (g_strcmp0 (name, "preedit_background") == 0) {
+            const gchar *hex = g_variant_get_string (value, NULL);
+            guint color;
+            color = ibus_m17n_parse_color (hex);
+            if (color != INVALID_COLOR) {
+                klass->preedit_background = color;
+            }
+        } else if (g_strcmp0 (name, "preedit_underline") == 0) {
+            klass->preedit_underline = g_variant_get_int32 (value);
+        } else if (g_strcmp0 (name, "lookup_table_orientation") == 0) {
+            klass->lookup_table_orientation = g_variant_get_int32 (value);
+        } else if (g_strcmp0 (name, "lookup_table_page_size") == 0) {
+            GList *p;
+
+            klass->lookup_table_page_size = g_variant_get_int32 (value);
+            /* the current and prefetched windows have the old size */
+            for (p = klass->instances; p != NULL; p = p->next) {
+                if (!ibus_m17n_engine_defer (p->data,
+                                             (IBusM17NDeferFunc) ibus_m17n_engine_forget_candidates,
+                                             p->data))
+                    ibus_m17n_engine_forget_candidates (p->data);
+            }
+        }
+    }
+}
+
+static void
+ibus_m17n_engine_init (IBusM17NEngine *m17n)
+{
+    m17n->prop_list = ibus_prop_list_new ();
+    g_object_ref_sink (m17n->prop_list);
+
+    m17n->status_prop = ibus_property_new ("status",
+                                           PROP_TYPE_NORMAL,
+                                           NULL,
+                                           NULL,
+                                           NULL,
+                                           TRUE,
+                                           FALSE,
+                                           0,
+                                           NULL);
+    g_object_ref_sink (m17n->status_prop);
+    ibus_prop_list_append (m17n->prop_list,  m17n->status_prop);
+
+#ifdef HAVE_SETUP
+    if (setup_prop == NULL) {
+        IBusText* label;
+        IBusText* tooltip;
+
+        label = ibus_text_new_from_string ("Setup");
+        tooltip = ibus_text_new_from_string ("Configure M17N engine");
+        setup_prop = ibus_property_new ("setup",
+                                        PROP_TYPE_NORMAL,
+                                        label,
+                                        "gtk-preferences",
+                                        tooltip,
+                                        TRUE,
+                                        TRUE,
+                                        PROP_STATE_UNCHECKED,
+                                        NULL);
+        g_object_ref_sink (setup_prop);
+    }
+    ibus_prop_list_append (m17n->prop_list, setup_prop);
+#endif  /* HAVE_SETUP */
+
+    /* most instances never show candidates; the table is acquired on
+       the first Minput_candidates_draw */
+    m17n->table = NULL;
+    m17n->context = NULL;
+
+    m17n->candidate_list = NULL;
+    m17n->candidate_groups = NULL;
+    m17n->candidate_group = NULL;
+    m17n->candidate_window_start = 0;
+    m17n->candidate_window_len = 0;
+    m17n->candidate_prefetch = NULL;
+    m17n->candidate_prefetch_id = 0;
+
+    m17n->surrounding_before = NULL;
+    m17n->surrounding_after = NULL;
+    m17n->surrounding_before_complete = FALSE;
+    m17n->surrounding_after_complete = FALSE;
+    m17n->surrounding_text = NULL;
+    m17n->surrounding_cursor_pos = 0;
+    m17n->surrounding_cursor_index = 0;
+
+    m17n->ucs4_buffer = g_array_new (FALSE, FALSE, sizeof (gunichar));
+
+    m17n->release_context_id = 0;
+
+    m17n->load_request = NULL;
+    m17n->load_timeout_id = 0;
+    m17n->pass_through = FALSE;
+
+    m17n->status_update_id = 0;
+
+    m17n->key_request = NULL;
+}
+
+/* Create the input context of M17N if it has been released.  Returns
+   FALSE if the input method cannot be opened. */
+static gboolean
+ibus_m17n_engine_ensure_context (IBusM17NEngine *m17n)
+{
+    IBusM17NEngineClass *klass;
+    MInputMethod *im;
+    MInputContext *context;
+
+    if (m17n->context != NULL)
+        return TRUE;
+
+    klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    im = ibus_m17n_engine_class_ref_im (klass);
+    if (im == NULL)
+        return FALSE;
+
+    context = g_queue_pop_head (&klass->context_pool);
+    if (context != NULL) {
+        /* a pooled context is already reset; only the status, drawn by
+           minput_create_ic for new contexts, needs to be shown */
+        context->arg = m17n;
+        m17n->context = context;
+        ibus_m17n_engine_callback (context, Minput_status_draw);
+        ibus_m17n_schedule_trim_pools ();
+    }
+    else {
+        context = minput_create_ic (im, m17n);
+        if (context == NULL) {
+            ibus_m17n_engine_class_unref_im (klass);
+            return FALSE;
+        }
+        /* the callbacks run by minput_create_ic may already have set it */
+        m17n->context = context;
+    }
+    n_contexts++;
+
+    return TRUE;
+}
+
+static void
+ibus_m17n_engine_release_context (IBusM17NEngine *m17n)
+{
+    IBusM17NEngineClass *klass;
+
+    if (m17n->context == NULL)
+        return;
+
+    klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+
+    ibus_m17n_engine_forget_candidates (m17n);
+    ibus_m17n_engine_forget_surrounding_text (m17n);
+
+    if (m17n->table != NULL) {
+        ibus_m17n_release_lookup_table (m17n->table);
+        m17n->table = NULL;
+    }
+
+    if (g_queue_get_length (&klass->context_pool) < CONTEXT_POOL_MAX) {
+        /* detach the context first, so that the callbacks run while
+           resetting it do not reach this instance */
+        m17n->context->arg = NULL;
+        minput_reset_ic (m17n->context);
+        g_queue_push_head (&klass->context_pool, m17n->context);
+        ibus_m17n_schedule_trim_pools ();
+    }
+    else
+        minput_destroy_ic (m17n->context);
+    m17n->context = NULL;
+    n_contexts--;
+
+    ibus_m17n_engine_class_unref_im (klass);
+}
+
+static gboolean
+ibus_m17n_engine_release_idle_context (IBusM17NEngine *m17n)
+{
+    /* try again later rather than wait for the worker */
+    if (running_key_request != NULL)
+        return TRUE;
+
+    m17n->release_context_id = 0;
+
+    if (!((IBusEngine *) m17n)->has_focus &&
+        m17n->context != NULL &&
+        mtext_len (m17n->context->preedit) == 0) {
+        ibus_m17n_engine_release_context (m17n);
+        /* reported by GetStats as released-contexts */
+        n_released_contexts++;
+    }
+    return FALSE;
+}
+
+static void
+ibus_m17n_engine_cancel_release_context (IBusM17NEngine *m17n)
+{
+    if (m17n->release_context_id != 0) {
+        g_source_remove (m17n->release_context_id);
+        m17n->release_context_id = 0;
+    }
+}
+
+/* Release the context of M17N once it has been idle, without focus
+   and preedit, for context_idle_timeout seconds. */
+static void
+ibus_m17n_engine_schedule_release_context (IBusM17NEngine *m17n)
+{
+    ibus_m17n_engine_cancel_release_context (m17n);
+
+    if (context_idle_timeout <= 0 || m17n->context == NULL)
+        return;
+
+    m17n->release_context_id =
+        g_timeout_add_seconds_full (G_PRIORITY_LOW,
+                                    context_idle_timeout,
+                                    (GSourceFunc) ibus_m17n_engine_release_idle_context,
+                                    m17n,
+                                    NULL);
+}
+
+/* Handle a key event with the input context, which must exist.
+   *TIMED is set if the key goes to the input method. */
+static gboolean
+ibus_m17n_engine_filter_key_event (IBusM17NEngine *m17n,
+                                   guint           keyval,
+                                   guint           keycode,
+                                   guint           modifiers,
+                                   gboolean       *timed)
+{
+    MSymbol m17n_key;
+    guint64 start;
+
+    if (modifiers & IBUS_RELEASE_MASK)
+        return FALSE;
+    start = ibus_m17n_stats_now ();
+    m17n_key = ibus_m17n_key_event_to_symbol (keycode, keyval, modifiers);
+    ibus_m17n_engine_add_phase (m17n, KEY_PHASE_SYMBOL,
+                                ibus_m17n_stats_now () - start);
+
+    if (m17n_key == Mnil)
+        return FALSE;
+
+    *timed = TRUE;
+    return ibus_m17n_engine_process_key_full (m17n, m17n_key, TRUE);
+}
+
+static void
+ibus_m17n_engine_cancel_loading (IBusM17NEngine *m17n)
+{
+    /* a queued request is dropped along with the engine */
+    m17n->load_request = NULL;
+    if (m17n->load_timeout_id != 0) {
+        g_source_remove (m17n->load_timeout_id);
+        m17n->load_timeout_id = 0;
+    }
+}
+
+/* Whether the input method of M17N has to be opened before it can
+   handle key events. */
+static gboolean
+ibus_m17n_engine_needs_loading (IBusM17NEngine *m17n)
+{
+    IBusM17NEngineClass *klass =
+        (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+
+    return m17n->context == NULL && !m17n->pass_through &&
+        (m17n->load_request != NULL || klass->im == NULL);
+}
+
+static gboolean
+ibus_m17n_engine_load_timeout (IBusM17NEngine *m17n)
+{
+    GList *p, *next;
+
+    /* keep loading, but stop holding keys back */
+    m17n->load_timeout_id = 0;
+    m17n->pass_through = TRUE;
+
+    for (p = key_requests.head; p != NULL; p = next) {
+        IBusM17NKeyRequest *request = p->data;
+
+        next = p->next;
+        if (request->m17n == m17n && request->invocation != NULL) {
+            ibus_m17n_key_request_reply (request, FALSE);
+            ibus_m17n_key_request_free (request);
+            g_queue_delete_link (&key_requests, p);
+        }
+    }
+
+    return FALSE;
+}
+
+/* Open the input method of M17N on the worker thread; key events
+   wait behind it until it is open, or until load_timeout. */
+static void
+ibus_m17n_engine_start_loading (IBusM17NEngine *m17n)
+{
+    if (m17n->load_request != NULL)
+        return;
+
+    m17n->load_request =
+        ibus_m17n_load_request_new ((IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n),
+                                    m17n);
+    if (load_timeout > 0)
+        m17n->load_timeout_id =
+            g_timeout_add (load_timeout,
+                           (GSourceFunc) ibus_m17n_engine_load_timeout,
+                           m17n);
+}
+
+/* Set M17N up once its input method is open, or has failed to. */
+static void
+ibus_m17n_engine_finish_loading (IBusM17NEngine *m17n)
+{
+    ibus_m17n_engine_cancel_loading (m17n);
+
+    if (ibus_m17n_engine_ensure_context (m17n)) {
+        m17n->pass_through = FALSE;
+        /* focus_in was not passed on while loading */
+        if (((IBusEngine *) m17n)->has_focus)
+            ibus_m17n_engine_process_key (m17n, Minput_focus_in);
+    }
+    else
+        m17n->pass_through = TRUE;
+}
+
+/* Install the input method opened by REQUEST on the worker thread,
+   and set up the instance it was opened for. */
+static void
+ibus_m17n_load_request_finish (IBusM17NKeyRequest *request)
+{
+    ibus_m17n_engine_class_install_im (request->klass, request->im,
+                                       request->im_cost);
+
+    if (request->m17n == NULL) {
+        if (request->im != NULL)
+            g_debug ("preloaded %s", request->klass->engine_name);
+    }
+    else if (!IBUS_OBJECT_DESTROYED (request->m17n))
+        ibus_m17n_engine_finish_loading (request->m17n);
+
+    if (max_resident_ims >= 0)
+        ibus_m17n_close_unused_ims (max_resident_ims);
+}
+
+/* Return whether the m17n database has the input method of KLASS,
+   without loading it. */
+static gboolean
+ibus_m17n_engine_class_has_im (IBusM17NEngineClass *klass)
+{
+    gchar *lang = NULL, *name = NULL;
+    gboolean retval = FALSE;
+
+    if (klass->engine_name != NULL &&
+        ibus_m17n_scan_engine_name (klass->engine_name, &lang, &name))
+        retval = mdatabase_find (msymbol ("input-method"),
+                                 msymbol (lang),
+                                 msymbol (name),
+                                 Mnil) != NULL;
+    g_free (lang);
+    g_free (name);
+
+    return retval;
 }
 
 static GObject*
@@ -388,63 +1810,58 @@ ibus_m17n_engine_constructor (GType                   type,
                               GObjectConstructParam  *construct_params)
 {
     IBusM17NEngine *m17n;
-    GObjectClass *object_class;
     IBusM17NEngineClass *klass;
 
     m17n = (IBusM17NEngine *) G_OBJECT_CLASS (parent_class)->constructor (type,
                                                        n_construct_params,
                                                        construct_params);
 
-    object_class = G_OBJECT_GET_CLASS (m17n);
-    klass = (IBusM17NEngineClass *) object_class;
-    if (klass->im == NULL) {
-        const gchar *engine_name;
-        gchar *lang = NULL, *name = NULL;
-
-        engine_name = ibus_engine_get_name ((IBusEngine *) m17n);
-        if (!ibus_m17n_scan_engine_name (engine_name, &lang, &name)) {
-            g_free (lang);
-            g_free (name);
-            return NULL;
-        }
-
-        klass->im = minput_open_im (msymbol (lang), msymbol (name), NULL);
-        g_free (lang);
-        g_free (name);
+    klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
 
-        if (klass->im == NULL) {
-            g_warning ("Can not find m17n keymap %s", engine_name);
+    /* opening an input method can take long; it is opened on the
+       worker thread, unless it is already open.  One removed since the
+       engines were listed fails creation right away, unless m17n is in
+       use by the worker */
+    if (klass->im == NULL) {
+        if (running_key_request == NULL &&
+            !ibus_m17n_engine_class_has_im (klass)) {
+            g_warning ("Can not find m17n keymap %s", klass->engine_name);
             g_object_unref (m17n);
             return NULL;
         }
-
-        mplist_put (klass->im->driver.callback_list, Minput_preedit_start, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_preedit_draw, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_preedit_done, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_status_start, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_status_draw, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_status_done, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_candidates_start, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_candidates_draw, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_candidates_done, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_set_spot, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_toggle, ibus_m17n_engine_callback);
-        /*
-          Does not set reset callback, uses the default callback in m17n.
-          mplist_put (klass->im->driver.callback_list, Minput_reset, ibus_m17n_engine_callback);
-        */
-        mplist_put (klass->im->driver.callback_list, Minput_get_surrounding_text, ibus_m17n_engine_callback);
-        mplist_put (klass->im->driver.callback_list, Minput_delete_surrounding_text, ibus_m17n_engine_callback);
+        ibus_m17n_engine_start_loading (m17n);
+        ibus_m17n_engine_run_key_requests ();
+    }
+    /* while the worker is busy, the context is created on first use */
+    else if (running_key_request == NULL &&
+             !ibus_m17n_engine_ensure_context (m17n)) {
+        g_object_unref (m17n);
+        return NULL;
     }
 
-    m17n->context = minput_create_ic (klass->im, m17n);
+    klass->instances = g_list_prepend (klass->instances, m17n);
 
     return (GObject *) m17n;
 }
 
+/* The part of destroying M17N that uses m17n; drops a reference. */
+static void
+ibus_m17n_engine_release_m17n (IBusM17NEngine *m17n)
+{
+    ibus_m17n_engine_forget_candidates (m17n);
+    ibus_m17n_engine_forget_surrounding_text (m17n);
+    ibus_m17n_engine_release_context (m17n);
+    g_object_unref (m17n);
+}
+
 static void
 ibus_m17n_engine_destroy (IBusM17NEngine *m17n)
 {
+    IBusM17NEngineClass *klass =
+        (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+
+    klass->instances = g_list_remove (klass->instances, m17n);
+
     if (m17n->prop_list) {
         g_object_unref (m17n->prop_list);
         m17n->prop_list = NULL;
@@ -455,21 +1872,31 @@ ibus_m17n_engine_destroy (IBusM17NEngine *m17n)
         m17n->status_prop = NULL;
     }
 
-#if HAVE_SETUP
-    if (m17n->setup_prop) {
-        g_object_unref (m17n->setup_prop);
-        m17n->setup_prop = NULL;
+    if (m17n->ucs4_buffer) {
+        g_array_free (m17n->ucs4_buffer, TRUE);
+        m17n->ucs4_buffer = NULL;
+    }
+
+    if (m17n->surrounding_text) {
+        g_object_unref (m17n->surrounding_text);
+        m17n->surrounding_text = NULL;
     }
-#endif  /* HAVE_SETUP */
 
     if (m17n->table) {
-        g_object_unref (m17n->table);
+        ibus_m17n_release_lookup_table (m17n->table);
         m17n->table = NULL;
     }
 
-    if (m17n->context) {
-        minput_destroy_ic (m17n->context);
-        m17n->context = NULL;
+    ibus_m17n_engine_cancel_release_context (m17n);
+    if (!ibus_m17n_engine_defer (NULL,
+                                 (IBusM17NDeferFunc) ibus_m17n_engine_release_m17n,
+                                 g_object_ref (m17n)))
+        ibus_m17n_engine_release_m17n (m17n);
+
+    ibus_m17n_engine_cancel_loading (m17n);
+    if (m17n->status_update_id != 0) {
+        ibus_m17n_scheduler_remove (m17n->status_update_id);
+        m17n->status_update_id = 0;
     }
 
     IBUS_OBJECT_CLASS (parent_class)->destroy ((IBusObject *)m17n);
@@ -479,12 +1906,10 @@ static void
 ibus_m17n_engine_update_preedit (IBusM17NEngine *m17n)
 {
     IBusText *text;
-    gchar *buf;
     IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
 
-    buf = ibus_m17n_mtext_to_utf8 (m17n->context->preedit);
-    if (buf) {
-        text = ibus_text_new_from_static_string (buf);
+    text = ibus_m17n_mtext_to_text (m17n->context->preedit);
+    if (text) {
         if (klass->preedit_foreground != INVALID_COLOR)
             ibus_text_append_attribute (text, IBUS_ATTR_TYPE_FOREGROUND,
                                         klass->preedit_foreground, 0, -1);
@@ -501,164 +1926,551 @@ ibus_m17n_engine_update_preedit (IBusM17NEngine *m17n)
 }
 
 static void
-ibus_m17n_engine_commit_string (IBusM17NEngine *m17n,
-                                const gchar    *string)
+ibus_m17n_engine_commit_text (IBusM17NEngine *m17n,
+                              IBusText       *text)
 {
-    IBusText *text;
-    text = ibus_text_new_from_static_string (string);
+    guint64 start = ibus_m17n_stats_now ();
+
+    IBUS_M17N_PROBE2 (commit, ibus_engine_get_name ((IBusEngine *) m17n),
+                      text->text);
     ibus_engine_commit_text ((IBusEngine *)m17n, text);
     ibus_m17n_engine_update_preedit (m17n);
+
+    ibus_m17n_engine_count (m17n, KEY_COUNTER_COMMITS);
+    emit_ns += ibus_m17n_stats_now () - start;
+}
+
+/* Commit PRODUCED, timing its conversion if it comes from a key
+   event. */
+static void
+ibus_m17n_engine_commit_mtext (IBusM17NEngine *m17n,
+                               MText          *produced,
+                               gboolean        key_event)
+{
+    guint64 start = ibus_m17n_stats_now ();
+    IBusText *text = ibus_m17n_mtext_to_text (produced);
+
+    if (key_event)
+        ibus_m17n_engine_add_phase (m17n, KEY_PHASE_CONVERT,
+                                    ibus_m17n_stats_now () - start);
+    ibus_m17n_engine_commit_text (m17n, text);
 }
 
-/* Note on AltGr (Level3 Shift) handling: While currently we expect
-   AltGr == mod5, it would be better to not expect the modifier always
-   be assigned to particular modX.  However, it needs some code like:
+/* Pass KEY to the input context.  Only KEY_EVENT keys, not focus
+   changes or the keys of lookup table moves, are timed. */
+static gboolean
+ibus_m17n_engine_process_key_full (IBusM17NEngine *m17n,
+                                   MSymbol         key,
+                                   gboolean        key_event)
+{
+    MText *produced;
+    gint retval;
+    guint64 start, start_emit;
+
+    if (m17n->load_request != NULL ||
+        !ibus_m17n_engine_ensure_context (m17n))
+        return FALSE;
+
+    /* surrounding text is decoded at most once per key event */
+    ibus_m17n_engine_forget_surrounding_text (m17n);
+
+    start = ibus_m17n_stats_now ();
+    start_emit = emit_ns;
+    IBUS_M17N_PROBE2 (filter__start,
+                      ibus_engine_get_name ((IBusEngine *) m17n),
+                      msymbol_name (key));
+    retval = minput_filter (m17n->context, key, NULL);
+    IBUS_M17N_PROBE2 (filter__done,
+                      ibus_engine_get_name ((IBusEngine *) m17n), retval);
+    if (key_event)
+        ibus_m17n_engine_add_phase (m17n, KEY_PHASE_FILTER,
+                                    ibus_m17n_stats_now () - start -
+                                    (emit_ns - start_emit));
+
+    if (retval) {
+        ibus_m17n_engine_forget_surrounding_text (m17n);
+        return TRUE;
+    }
+
+    produced = mtext ();
+
+    start = ibus_m17n_stats_now ();
+    start_emit = emit_ns;
+    IBUS_M17N_PROBE2 (lookup__start,
+                      ibus_engine_get_name ((IBusEngine *) m17n),
+                      msymbol_name (key));
+    retval = minput_lookup (m17n->context, key, NULL, produced);
+    IBUS_M17N_PROBE2 (lookup__done,
+                      ibus_engine_get_name ((IBusEngine *) m17n), retval);
+    if (key_event)
+        ibus_m17n_engine_add_phase (m17n, KEY_PHASE_LOOKUP,
+                                    ibus_m17n_stats_now () - start -
+                                    (emit_ns - start_emit));
+
+    if (retval) {
+        // g_debug ("minput_lookup returns %d", retval);
+    }
+
+    ibus_m17n_engine_forget_surrounding_text (m17n);
 
-   KeyCode altgr = XKeysymToKeycode (display, XK_ISO_Level3_Shift);
-   XModifierKeymap *mods = XGetModifierMapping (display);
-   for (i = 3; i < 8; i++)
-     for (j = 0; j < mods->max_keypermod; j++) {
-       KeyCode code = mods->modifiermap[i * mods->max_keypermod + j];
-       if (code == altgr)
-         ...
-     }
-                
-   Since IBus engines are supposed to be cross-platform, the code
-   should go into IBus core, instead of ibus-m17n. */
-MSymbol
-ibus_m17n_key_event_to_symbol (guint keycode,
-                               guint keyval,
-                               guint modifiers)
+    if (mtext_len (produced) > 0) {
+        ibus_m17n_engine_commit_mtext (m17n, produced, key_event);
+    }
+    m17n_object_unref (produced);
+
+    return retval == 0;
+}
+
+static gboolean
+ibus_m17n_engine_process_key (IBusM17NEngine *m17n,
+                              MSymbol         key)
+{
+    return ibus_m17n_engine_process_key_full (m17n, key, FALSE);
+}
+
+static gboolean
+ibus_m17n_engine_handle_key_event (IBusM17NEngine *m17n,
+                                   guint           keyval,
+                                   guint           keycode,
+                                   guint           modifiers,
+                                   gboolean       *timed)
 {
-    GString *keysym;
-    MSymbol mkeysym = Mnil;
-    guint mask = 0;
-    IBusKeymap *keymap;
+    /* a real key event takes precedence over candidate prefetching */
+    ibus_m17n_engine_cancel_prefetch (m17n);
+
+    /* still loading after load_timeout, or failed to load; keys
+       needing a load are queued by service_method_call */
+    if (m17n->load_request != NULL ||
+        !ibus_m17n_engine_ensure_context (m17n))
+        return FALSE;
 
-    if (keyval >= IBUS_Shift_L && keyval <= IBUS_Hyper_R) {
-        return Mnil;
+    return ibus_m17n_engine_filter_key_event (m17n, keyval, keycode, modifiers,
+                                              timed);
+}
+
+static gboolean
+ibus_m17n_engine_process_key_event (IBusEngine     *engine,
+                                    guint           keyval,
+                                    guint           keycode,
+                                    guint           modifiers)
+{
+    IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
+    gint64 time = trace ? g_get_monotonic_time () : 0;
+    guint64 start = ibus_m17n_stats_now ();
+    guint64 start_emit = emit_ns;
+    gboolean handled, timed = FALSE;
+
+    IBUS_M17N_PROBE4 (key__start, ibus_engine_get_name (engine),
+                      keyval, keycode, modifiers);
+    handled = ibus_m17n_engine_handle_key_event (m17n, keyval, keycode,
+                                                 modifiers, &timed);
+    IBUS_M17N_PROBE3 (key__done, ibus_engine_get_name (engine),
+                      keyval, handled);
+    if (timed) {
+        ibus_m17n_engine_add_phase (m17n, KEY_PHASE_EMIT,
+                                    emit_ns - start_emit);
+        ibus_m17n_engine_add_phase (m17n, KEY_PHASE_TOTAL,
+                                    ibus_m17n_stats_now () - start);
+    }
+    ibus_m17n_engine_trace_key (m17n, time, keyval, keycode, modifiers,
+                                handled);
+    return handled;
+}
+
+static void
+ibus_m17n_key_request_reply (IBusM17NKeyRequest *request,
+                             gboolean            handled)
+{
+    g_dbus_method_invocation_return_value (request->invocation,
+                                           g_variant_new ("(b)", handled));
+    request->replied = TRUE;
+    /* balances key-start even for a destroyed engine, which has lost
+       its name, so the class tells it */
+    IBUS_M17N_PROBE3 (key__done,
+                      ((IBusM17NEngineClass *) G_OBJECT_GET_CLASS (request->m17n))->engine_name,
+                      request->keyval, handled);
+    if (request->timed && !IBUS_OBJECT_DESTROYED (request->m17n)) {
+        ibus_m17n_engine_add_phase (request->m17n, KEY_PHASE_TOTAL,
+                                    ibus_m17n_stats_now () - request->start_ns);
+    }
+    ibus_m17n_engine_trace_key (request->m17n, request->time,
+                                request->keyval, request->keycode,
+                                request->modifiers, handled);
+}
+
+static void
+ibus_m17n_key_request_free (IBusM17NKeyRequest *request)
+{
+    if (request->produced)
+        m17n_object_unref (request->produced);
+    if (request->surrounding_text)
+        g_object_unref (request->surrounding_text);
+    if (request->preedit)
+        g_object_unref (request->preedit);
+    if (request->commands)
+        g_array_free (request->commands, TRUE);
+    if (request->m17n)
+        g_object_unref (request->m17n);
+    if (request->klass)
+        g_type_class_unref (request->klass);
+    g_slice_free (IBusM17NKeyRequest, request);
+}
+
+/* Runs on the worker thread. */
+static void
+ibus_m17n_key_request_run (gpointer user_data)
+{
+    IBusM17NKeyRequest *request = user_data;
+    IBusM17NEngine *m17n = request->m17n;
+    guint64 start;
+
+    start = ibus_m17n_stats_now ();
+    IBUS_M17N_PROBE2 (filter__start,
+                      ibus_engine_get_name ((IBusEngine *) m17n),
+                      msymbol_name (request->key));
+    request->filtered = minput_filter (m17n->context, request->key, NULL);
+    IBUS_M17N_PROBE2 (filter__done,
+                      ibus_engine_get_name ((IBusEngine *) m17n),
+                      request->filtered);
+    request->filter_ns = ibus_m17n_stats_now () - start;
+    ibus_m17n_engine_forget_surrounding_text (m17n);
+    if (request->filtered)
+        return;
+
+    request->produced = mtext ();
+    start = ibus_m17n_stats_now ();
+    IBUS_M17N_PROBE2 (lookup__start,
+                      ibus_engine_get_name ((IBusEngine *) m17n),
+                      msymbol_name (request->key));
+    request->retval = minput_lookup (m17n->context, request->key, NULL,
+                                     request->produced);
+    IBUS_M17N_PROBE2 (lookup__done,
+                      ibus_engine_get_name ((IBusEngine *) m17n),
+                      request->retval);
+    request->lookup_ns = ibus_m17n_stats_now () - start;
+    ibus_m17n_engine_forget_surrounding_text (m17n);
+}
+
+/* Apply the outcome of the running request in the main thread, once
+   the worker is done with it. */
+static void
+ibus_m17n_key_request_finish (IBusM17NKeyRequest *request)
+{
+    IBusM17NEngine *m17n = request->m17n;
+    IBusM17NKeyStats *key_stats;
+    guint64 start_emit;
+    guint i;
+
+    m17n->key_request = NULL;
+    if (request->deadline_id != 0) {
+        g_source_remove (request->deadline_id);
+        request->deadline_id = 0;
+    }
+
+    key_stats = ibus_m17n_engine_class_key_stats (m17n);
+    for (i = 0; i < N_KEY_COUNTERS; i++)
+        key_stats->counters[i] += request->counters[i];
+
+    if (IBUS_OBJECT_DESTROYED (m17n)) {
+        /* its context is released next, behind this key */
+        if (!request->replied)
+            ibus_m17n_key_request_reply (request, FALSE);
+        return;
     }
 
-    /* Here, keyval is already translated by IBUS_MOD5_MASK.  Obtain
-       the untranslated keyval from the underlying keymap and
-       represent the translated keyval as the form "G-<untranslated
-       keyval>", which m17n-lib accepts. */
-    if (modifiers & IBUS_MOD5_MASK) {
-        keymap = ibus_keymap_get ("us");
-        keyval = ibus_keymap_lookup_keysym (keymap, keycode,
-                                            modifiers & ~IBUS_MOD5_MASK);
-        g_object_unref (keymap);
+    if (request->replied) {
+        /* the key went to the client; drop what m17n made of it */
+        minput_reset_ic (m17n->context);
+        ibus_m17n_engine_forget_candidates (m17n);
+        ibus_engine_hide_lookup_table ((IBusEngine *) m17n);
+        ibus_engine_hide_auxiliary_text ((IBusEngine *) m17n);
+        return;
+    }
+
+    ibus_m17n_engine_add_phase (m17n, KEY_PHASE_FILTER, request->filter_ns);
+    if (!request->filtered)
+        ibus_m17n_engine_add_phase (m17n, KEY_PHASE_LOOKUP, request->lookup_ns);
+
+    start_emit = emit_ns;
+    for (i = 0; i < request->commands->len; i++) {
+        IBusM17NCommand *record = &g_array_index (request->commands,
+                                                  IBusM17NCommand, i);
+
+        if (record->command == Minput_delete_surrounding_text) {
+            /* as in ibus_m17n_engine_handle_callback */
+            if ((((IBusEngine *) m17n)->client_capabilities &
+                 IBUS_CAP_SURROUNDING_TEXT) != 0)
+                ibus_m17n_engine_delete_surrounding_text (m17n, record->len);
+        }
+        else
+            ibus_m17n_engine_callback (m17n->context, record->command);
     }
 
-    keysym = g_string_new ("");
+    if (!request->filtered && mtext_len (request->produced) > 0)
+        ibus_m17n_engine_commit_mtext (m17n, request->produced, TRUE);
+    ibus_m17n_engine_add_phase (m17n, KEY_PHASE_EMIT, emit_ns - start_emit);
+
+    ibus_m17n_key_request_reply (request,
+                                 request->filtered || request->retval == 0);
+}
+
+/* While a key runs on the worker thread, queue FUNC (DATA) behind it
+   and the keys waiting, instead of waiting for the worker.  M17N, if
+   not NULL, is kept alive meanwhile, and FUNC is dropped if M17N is
+   destroyed first.  Returns FALSE if m17n can be used right away. */
+static gboolean
+ibus_m17n_engine_defer (IBusM17NEngine    *m17n,
+                        IBusM17NDeferFunc  func,
+                        gpointer           data)
+{
+    IBusM17NKeyRequest *request;
+
+    if (running_key_request == NULL)
+        return FALSE;
+
+    request = g_slice_new0 (IBusM17NKeyRequest);
+    if (m17n != NULL)
+        request->m17n = g_object_ref (m17n);
+    request->func = func;
+    request->data = data;
+    g_queue_push_tail (&key_requests, request);
+
+    return TRUE;
+}
+
+static gboolean
+ibus_m17n_key_request_deadline (gpointer user_data)
+{
+    IBusM17NKeyRequest *request = user_data;
+
+    request->deadline_id = 0;
+    g_debug ("key took longer than %d ms; passed to the client",
+             worker_deadline);
+    /* committed before the key, where the user typed it; the worker
+       still owns the context, so m17n->context is not read here */
+    if (request->preedit != NULL && !IBUS_OBJECT_DESTROYED (request->m17n)) {
+        ibus_engine_commit_text ((IBusEngine *) request->m17n,
+                                 request->preedit);
+        ibus_engine_hide_preedit_text ((IBusEngine *) request->m17n);
+    }
+    ibus_m17n_key_request_reply (request, FALSE);
+    return FALSE;
+}
 
-    if (keyval >= IBUS_space && keyval <= IBUS_asciitilde) {
-        gint c = keyval;
+static gboolean
+ibus_m17n_key_request_done (gpointer user_data)
+{
+    IBusM17NKeyRequest *request = user_data;
+
+    running_key_request = NULL;
+    ibus_m17n_scheduler_unblock ();
+    if (request->klass != NULL)
+        ibus_m17n_load_request_finish (request);
+    else
+        ibus_m17n_key_request_finish (request);
+    ibus_m17n_key_request_free (request);
+
+    ibus_m17n_engine_run_key_requests ();
+    return FALSE;
+}
 
-        if (keyval == IBUS_space && modifiers & IBUS_SHIFT_MASK)
-            mask |= IBUS_SHIFT_MASK;
+/* Hand the next queued key or open to the worker thread, once it is
+   idle, running the deferred work queued before it.  Keys that cannot
+   be processed by m17n on the worker thread are handled here. */
+static void
+ibus_m17n_engine_run_key_requests (void)
+{
+    IBusM17NKeyRequest *request;
 
-        if (modifiers & IBUS_CONTROL_MASK) {
-            if (c >= IBUS_a && c <= IBUS_z)
-                c += IBUS_A - IBUS_a;
-            mask |= IBUS_CONTROL_MASK;
-        }
+    while (running_key_request == NULL &&
+           (request = g_queue_pop_head (&key_requests)) != NULL) {
+        IBusM17NEngine *m17n = request->m17n;
 
-        g_string_append_c (keysym, c);
-    }
-    else {
-        mask |= modifiers & (IBUS_CONTROL_MASK | IBUS_SHIFT_MASK);
-        g_string_append (keysym, ibus_keyval_name (keyval));
-        if (keysym->len == 0) {
-            g_string_free (keysym, TRUE);
-            return Mnil;
+        if (request->func != NULL) {
+            if (m17n == NULL || !IBUS_OBJECT_DESTROYED (m17n))
+                request->func (request->data);
+            ibus_m17n_key_request_free (request);
+            continue;
         }
-    }
-
-    mask |= modifiers & (IBUS_MOD1_MASK |
-                         IBUS_MOD5_MASK |
-                         IBUS_META_MASK |
-                         IBUS_SUPER_MASK |
-                         IBUS_HYPER_MASK);
 
+        if (request->klass != NULL) {
+            /* dropped along with its engine */
+            if (m17n != NULL && IBUS_OBJECT_DESTROYED (m17n)) {
+                ibus_m17n_key_request_free (request);
+                continue;
+            }
+            /* opened meanwhile, for another instance */
+            if (request->klass->im != NULL) {
+                if (m17n != NULL)
+                    ibus_m17n_engine_finish_loading (m17n);
+                ibus_m17n_key_request_free (request);
+                continue;
+            }
 
-    if (mask & IBUS_HYPER_MASK) {
-        g_string_prepend (keysym, "H-");
-    }
-    if (mask & IBUS_SUPER_MASK) {
-        g_string_prepend (keysym, "s-");
-    }
-    if (mask & IBUS_MOD5_MASK) {
-        g_string_prepend (keysym, "G-");
-    }
-    if (mask & IBUS_MOD1_MASK) {
-        g_string_prepend (keysym, "A-");
-    }
-    if (mask & IBUS_META_MASK) {
-        g_string_prepend (keysym, "M-");
-    }
-    if (mask & IBUS_CONTROL_MASK) {
-        g_string_prepend (keysym, "C-");
-    }
-    if (mask & IBUS_SHIFT_MASK) {
-        g_string_prepend (keysym, "S-");
-    }
+            running_key_request = request;
+            ibus_m17n_scheduler_block ();
+            if (!ibus_m17n_worker_push (ibus_m17n_get_worker (),
+                                        ibus_m17n_load_request_run,
+                                        ibus_m17n_key_request_done,
+                                        request)) {
+                ibus_m17n_load_request_run (request);
+                ibus_m17n_key_request_done (request);
+            }
+            continue;
+        }
 
-    mkeysym = msymbol (keysym->str);
-    g_string_free (keysym, TRUE);
+        if (IBUS_OBJECT_DESTROYED (m17n)) {
+            ibus_m17n_key_request_reply (request, FALSE);
+            ibus_m17n_key_request_free (request);
+            continue;
+        }
 
-    return mkeysym;
-}
+        /* behind the opening of its input method */
+        if (ibus_m17n_engine_needs_loading (m17n)) {
+            ibus_m17n_engine_start_loading (m17n);
+            g_queue_remove (&key_requests, m17n->load_request);
+            g_queue_push_head (&key_requests, request);
+            g_queue_push_head (&key_requests, m17n->load_request);
+            continue;
+        }
 
-static gboolean
-ibus_m17n_engine_process_key (IBusM17NEngine *m17n,
-                              MSymbol         key)
-{
-    gchar *buf;
-    MText *produced;
-    gint retval;
+        /* m17n is free: without worker_thread the key is handled here,
+           as are keys passed through after load_timeout or a failed
+           load */
+        if (!worker_thread || m17n->load_request != NULL ||
+            !ibus_m17n_engine_ensure_context (m17n)) {
+            guint64 start_emit = emit_ns;
+            gboolean handled;
+
+            handled = ibus_m17n_engine_handle_key_event (m17n,
+                                                         request->keyval,
+                                                         request->keycode,
+                                                         request->modifiers,
+                                                         &request->timed);
+            if (request->timed)
+                ibus_m17n_engine_add_phase (m17n, KEY_PHASE_EMIT,
+                                            emit_ns - start_emit);
+            ibus_m17n_key_request_reply (request, handled);
+            ibus_m17n_key_request_free (request);
+            continue;
+        }
 
-    retval = minput_filter (m17n->context, key, NULL);
+        ibus_m17n_engine_cancel_prefetch (m17n);
 
-    if (retval) {
-        return TRUE;
-    }
+        if (request->modifiers & IBUS_RELEASE_MASK)
+            request->key = Mnil;
+        else {
+            guint64 start = ibus_m17n_stats_now ();
 
-    produced = mtext ();
+            request->key = ibus_m17n_key_event_to_symbol (request->keycode,
+                                                          request->keyval,
+                                                          request->modifiers);
+            ibus_m17n_engine_add_phase (m17n, KEY_PHASE_SYMBOL,
+                                        ibus_m17n_stats_now () - start);
+        }
+        if (request->key == Mnil) {
+            ibus_m17n_key_request_reply (request, FALSE);
+            ibus_m17n_key_request_free (request);
+            continue;
+        }
+        request->timed = TRUE;
 
-    retval = minput_lookup (m17n->context, key, NULL, produced);
+        ibus_m17n_engine_forget_surrounding_text (m17n);
+#ifdef HAVE_IBUS_ENGINE_GET_SURROUNDING_TEXT
+        /* ibus_engine_get_surrounding_text would signal the client for
+           every key, whether the MIM reads the text or not */
+        if (m17n->surrounding_text != NULL &&
+            (((IBusEngine *) m17n)->client_capabilities &
+             IBUS_CAP_SURROUNDING_TEXT) != 0) {
+            request->surrounding_text = g_object_ref (m17n->surrounding_text);
+            request->surrounding_cursor_index =
+                m17n->surrounding_cursor_index;
+        }
+#endif  /* HAVE_IBUS_ENGINE_GET_SURROUNDING_TEXT */
 
-    if (retval) {
-        // g_debug ("minput_lookup returns %d", retval);
-    }
+        if (worker_policy == WORKER_POLICY_FORWARD && worker_deadline > 0 &&
+            mtext_len (m17n->context->preedit) > 0) {
+            request->preedit = ibus_m17n_mtext_to_text (m17n->context->preedit);
+            if (request->preedit)
+                g_object_ref_sink (request->preedit);
+        }
 
-    buf = ibus_m17n_mtext_to_utf8 (produced);
-    m17n_object_unref (produced);
+        m17n->key_request = request;
+        running_key_request = request;
+        ibus_m17n_scheduler_block ();
+        if (!ibus_m17n_worker_push (ibus_m17n_get_worker (),
+                                    ibus_m17n_key_request_run,
+                                    ibus_m17n_key_request_done,
+                                    request)) {
+            /* cannot happen with one key at a time; run it here */
+            ibus_m17n_key_request_run (request);
+            ibus_m17n_key_request_done (request);
+            continue;
+        }
 
-    if (buf && strlen (buf)) {
-        ibus_m17n_engine_commit_string (m17n, buf);
+        if (worker_policy == WORKER_POLICY_FORWARD && worker_deadline > 0)
+            request->deadline_id =
+                g_timeout_add (worker_deadline,
+                               ibus_m17n_key_request_deadline,
+                               request);
     }
-    g_free (buf);
-
-    return retval == 0;
 }
 
-static gboolean
-ibus_m17n_engine_process_key_event (IBusEngine     *engine,
-                                    guint           keyval,
-                                    guint           keycode,
-                                    guint           modifiers)
+static void
+ibus_m17n_engine_service_method_call (IBusService           *service,
+                                      GDBusConnection       *connection,
+                                      const gchar           *sender,
+                                      const gchar           *object_path,
+                                      const gchar           *interface_name,
+                                      const gchar           *method_name,
+                                      GVariant              *parameters,
+                                      GDBusMethodInvocation *invocation)
 {
-    IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
-
-    if (modifiers & IBUS_RELEASE_MASK)
-        return FALSE;
-    MSymbol m17n_key = ibus_m17n_key_event_to_symbol (keycode, keyval, modifiers);
+    IBusM17NEngine *m17n = (IBusM17NEngine *) service;
+    IBusM17NKeyRequest *request;
+
+    /* keys go through the queue when they run on the worker thread,
+       when m17n is in use there or has work waiting, and when the
+       input method has to be opened first */
+    if (g_strcmp0 (interface_name, IBUS_INTERFACE_ENGINE) != 0 ||
+        g_strcmp0 (method_name, "ProcessKeyEvent") != 0 ||
+        !(worker_thread || running_key_request != NULL ||
+          !g_queue_is_empty (&key_requests) ||
+          ibus_m17n_engine_needs_loading (m17n))) {
+        IBUS_SERVICE_CLASS (parent_class)->service_method_call (service,
+                                                                connection,
+                                                                sender,
+                                                                object_path,
+                                                                interface_name,
+                                                                method_name,
+                                                                parameters,
+                                                                invocation);
+        return;
+    }
 
-    if (m17n_key == Mnil)
-        return FALSE;
+    /* answered once the key has been handled */
+    request = g_slice_new0 (IBusM17NKeyRequest);
+    request->m17n = g_object_ref (service);
+    request->invocation = invocation;
+    request->time = g_get_monotonic_time ();
+    request->start_ns = ibus_m17n_stats_now ();
+    g_variant_get (parameters, "(uuu)",
+                   &request->keyval, &request->keycode, &request->modifiers);
+    IBUS_M17N_PROBE4 (key__start,
+                      ibus_engine_get_name ((IBusEngine *) service),
+                      request->keyval, request->keycode, request->modifiers);
+    request->commands = g_array_new (FALSE, FALSE, sizeof (IBusM17NCommand));
+
+    /* still loading after load_timeout; the keys queued before have
+       been passed through */
+    if (m17n->load_request != NULL && m17n->pass_through) {
+        ibus_m17n_key_request_reply (request, FALSE);
+        ibus_m17n_key_request_free (request);
+        return;
+    }
 
-    return ibus_m17n_engine_process_key (m17n, m17n_key);
+    g_queue_push_tail (&key_requests, request);
+    ibus_m17n_engine_run_key_requests ();
 }
 
 static void
@@ -666,6 +2478,14 @@ ibus_m17n_engine_focus_in (IBusEngine *engine)
 {
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
+    if (ibus_m17n_engine_defer (m17n,
+                                (IBusM17NDeferFunc) ibus_m17n_engine_focus_in,
+                                m17n))
+        return;
+
+    ibus_m17n_engine_trace (m17n, IBUS_M17N_TRACE_FOCUS_IN);
+    ibus_m17n_engine_cancel_release_context (m17n);
+
     ibus_engine_register_properties (engine, m17n->prop_list);
     ibus_m17n_engine_process_key (m17n, Minput_focus_in);
 
@@ -677,9 +2497,20 @@ ibus_m17n_engine_focus_out (IBusEngine *engine)
 {
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
-    ibus_m17n_engine_process_key (m17n, Minput_focus_out);
+    if (ibus_m17n_engine_defer (m17n,
+                                (IBusM17NDeferFunc) ibus_m17n_engine_focus_out,
+                                m17n))
+        return;
+
+    ibus_m17n_engine_trace (m17n, IBUS_M17N_TRACE_FOCUS_OUT);
+
+    /* a released context has nothing to tell about focus */
+    if (m17n->context != NULL)
+        ibus_m17n_engine_process_key (m17n, Minput_focus_out);
 
     parent_class->focus_out (engine);
+
+    ibus_m17n_engine_schedule_release_context (m17n);
 }
 
 static void
@@ -687,18 +2518,25 @@ ibus_m17n_engine_reset (IBusEngine *engine)
 {
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
+    if (ibus_m17n_engine_defer (m17n,
+                                (IBusM17NDeferFunc) ibus_m17n_engine_reset,
+                                m17n))
+        return;
+
+    ibus_m17n_engine_trace (m17n, IBUS_M17N_TRACE_RESET);
     parent_class->reset (engine);
 
-    minput_reset_ic (m17n->context);
+    if (m17n->context != NULL)
+        minput_reset_ic (m17n->context);
 }
 
 static void
 ibus_m17n_engine_enable (IBusEngine *engine)
 {
-    IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
-
     parent_class->enable (engine);
 
+    ibus_m17n_record_use (ibus_engine_get_name (engine));
+
 #ifdef HAVE_IBUS_ENGINE_GET_SURROUNDING_TEXT
     /* Issue a dummy ibus_engine_get_surrounding_text() call to tell
        input context that we will use surrounding-text. */
@@ -706,6 +2544,34 @@ ibus_m17n_engine_enable (IBusEngine *engine)
 #endif  /* HAVE_IBUS_ENGINE_GET_SURROUNDING_TEXT */
 }
 
+#ifdef HAVE_IBUS_ENGINE_GET_SURROUNDING_TEXT
+static void
+ibus_m17n_engine_set_surrounding_text (IBusEngine *engine,
+                                       IBusText   *text,
+                                       guint       cursor_pos,
+                                       guint       anchor_pos)
+{
+    IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
+
+    /* the window decoded by the worker is forgotten once the key is
+       done; the worker reads its own copy of the text */
+    if (m17n->key_request == NULL)
+        ibus_m17n_engine_forget_surrounding_text (m17n);
+    parent_class->set_surrounding_text (engine, text, cursor_pos, anchor_pos);
+
+    if (m17n->surrounding_text)
+        g_object_unref (m17n->surrounding_text);
+    m17n->surrounding_text = text ? g_object_ref_sink (text) : NULL;
+    m17n->surrounding_cursor_pos = cursor_pos;
+    m17n->surrounding_cursor_index = 0;
+    if (text)
+        m17n->surrounding_cursor_index =
+            ibus_m17n_utf8_offset_to_pointer (text->text,
+                                              strlen (text->text),
+                                              cursor_pos) - text->text;
+}
+#endif  /* HAVE_IBUS_ENGINE_GET_SURROUNDING_TEXT */
+
 static void
 ibus_m17n_engine_disable (IBusEngine *engine)
 {
@@ -720,6 +2586,13 @@ ibus_m17n_engine_page_up (IBusEngine *engine)
 {
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
+    /* msymbol may not run alongside the worker */
+    if (ibus_m17n_engine_defer (m17n,
+                                (IBusM17NDeferFunc) ibus_m17n_engine_page_up,
+                                m17n))
+        return;
+
+    ibus_m17n_engine_trace (m17n, IBUS_M17N_TRACE_PAGE_UP);
     ibus_m17n_engine_process_key (m17n, msymbol ("Up"));
     parent_class->page_up (engine);
 }
@@ -730,6 +2603,12 @@ ibus_m17n_engine_page_down (IBusEngine *engine)
 
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
+    if (ibus_m17n_engine_defer (m17n,
+                                (IBusM17NDeferFunc) ibus_m17n_engine_page_down,
+                                m17n))
+        return;
+
+    ibus_m17n_engine_trace (m17n, IBUS_M17N_TRACE_PAGE_DOWN);
     ibus_m17n_engine_process_key (m17n, msymbol ("Down"));
     parent_class->page_down (engine);
 }
@@ -740,6 +2619,12 @@ ibus_m17n_engine_cursor_up (IBusEngine *engine)
 
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
+    if (ibus_m17n_engine_defer (m17n,
+                                (IBusM17NDeferFunc) ibus_m17n_engine_cursor_up,
+                                m17n))
+        return;
+
+    ibus_m17n_engine_trace (m17n, IBUS_M17N_TRACE_CURSOR_UP);
     ibus_m17n_engine_process_key (m17n, msymbol ("Left"));
     parent_class->cursor_up (engine);
 }
@@ -750,6 +2635,12 @@ ibus_m17n_engine_cursor_down (IBusEngine *engine)
 
     IBusM17NEngine *m17n = (IBusM17NEngine *) engine;
 
+    if (ibus_m17n_engine_defer (m17n,
+                                (IBusM17NDeferFunc) ibus_m17n_engine_cursor_down,
+                                m17n))
+        return;
+
+    ibus_m17n_engine_trace (m17n, IBUS_M17N_TRACE_CURSOR_DOWN);
     ibus_m17n_engine_process_key (m17n, msymbol ("Right"));
     parent_class->cursor_down (engine);
 }
@@ -779,108 +2670,544 @@ ibus_m17n_engine_property_activate (IBusEngine  *engine,
 }
 
 static void
-ibus_m17n_engine_update_lookup_table (IBusM17NEngine *m17n)
+ibus_m17n_candidate_window_free (IBusM17NCandidateWindow *window)
 {
-    ibus_lookup_table_clear (m17n->table);
+    g_ptr_array_free (window->candidates, TRUE);
+    g_slice_free (IBusM17NCandidateWindow, window);
+}
 
-    if (m17n->context->candidate_list && m17n->context->candidate_show) {
-        IBusText *text;
-        MPlist *group;
-        group = m17n->context->candidate_list;
-        gint i = 0;
-        gint page = 1;
-        IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+static void
+ibus_m17n_engine_cancel_prefetch (IBusM17NEngine *m17n)
+{
+    if (m17n->candidate_prefetch_id != 0) {
+        ibus_m17n_scheduler_remove (m17n->candidate_prefetch_id);
+        m17n->candidate_prefetch_id = 0;
+    }
+}
 
-        while (1) {
-            gint len;
-            if (mplist_key (group) == Mtext)
-                len = mtext_len ((MText *) mplist_value (group));
-            else
-                len = mplist_length ((MPlist *) mplist_value (group));
+static void
+ibus_m17n_engine_forget_candidates (IBusM17NEngine *m17n)
+{
+    ibus_m17n_engine_cancel_prefetch (m17n);
+    if (m17n->candidate_prefetch) {
+        g_ptr_array_free (m17n->candidate_prefetch, TRUE);
+        m17n->candidate_prefetch = NULL;
+    }
+    if (m17n->candidate_list) {
+        m17n_object_unref (m17n->candidate_list);
+        m17n->candidate_list = NULL;
+    }
+    if (m17n->candidate_groups) {
+        ibus_m17n_candidate_index_free (m17n->candidate_groups);
+        m17n->candidate_groups = NULL;
+    }
+    m17n->candidate_group = NULL;
+    m17n->candidate_window_start = 0;
+    m17n->candidate_window_len = 0;
+}
 
-            if (i + len > m17n->context->candidate_index)
-                break;
+/* Compute the window of the group [START, START + LEN) which contains
+   candidate INDEX, as an offset into the group and a number of rows. */
+static void
+ibus_m17n_engine_get_candidate_window (IBusM17NEngine *m17n,
+                                       gint            start,
+                                       gint            len,
+                                       gint            index,
+                                       gint           *offset,
+                                       gint           *nrows)
+{
+    IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+    gint page_size;
 
-            i += len;
-            group = mplist_next (group);
-            page ++;
-        }
+    page_size = klass->lookup_table_page_size;
+    if (page_size <= 0 || page_size > len)
+        page_size = len;
+    *offset = (index - start) / page_size * page_size;
+    *nrows = MIN (page_size, len - *offset);
+}
 
-        if (mplist_key (group) == Mtext) {
-            MText *mt;
-            gunichar *buf;
-            glong nchars, i;
+static GPtrArray *
+ibus_m17n_engine_convert_candidates (IBusM17NEngine *m17n,
+                                     MPlist         *group,
+                                     gint            offset,
+                                     gint            nrows)
+{
+    GPtrArray *candidates;
 
-            mt = (MText *) mplist_value (group);
-            ibus_lookup_table_set_page_size (m17n->table, mtext_len (mt));
+    candidates = g_ptr_array_new_with_free_func (g_object_unref);
 
-            buf = ibus_m17n_mtext_to_ucs4 (mt, &nchars);
-            g_warn_if_fail (buf != NULL);
+    if (mplist_key (group) == Mtext) {
+        MText *mt;
+        gunichar *buf;
+        gint nchars, i;
 
-            for (i = 0; buf != NULL && i < nchars; i++) {
-                IBusText *text = ibus_text_new_from_unichar (buf[i]);
-                if (text == NULL) {
-                    text = ibus_text_new_from_printf ("INVCODE=U+%04"G_GINT32_FORMAT"X", buf[i]);
-                    g_warn_if_reached ();
-                }
-                ibus_lookup_table_append_candidate (m17n->table, text);
+        mt = (MText *) mplist_value (group);
+
+        g_array_set_size (m17n->ucs4_buffer, nrows);
+        buf = (gunichar *) m17n->ucs4_buffer->data;
+        nchars = ibus_m17n_mtext_get_ucs4 (mt, offset, offset + nrows, buf);
+
+        for (i = 0; i < nchars; i++) {
+            gunichar c = buf[i];
+            IBusText *text = ibus_text_new_from_unichar (c);
+            if (text == NULL) {
+                text = ibus_text_new_from_printf ("INVCODE=U+%04"G_GINT32_FORMAT"X", c);
+                g_warn_if_reached ();
             }
-            g_free (buf);
+            g_ptr_array_add (candidates, g_object_ref_sink (text));
         }
-        else {
-            MPlist *p;
+    }
+    else {
+        MPlist *p;
+        gint i;
 
-            p = (MPlist *) mplist_value (group);
-            ibus_lookup_table_set_page_size (m17n->table, mplist_length (p));
+        p = (MPlist *) mplist_value (group);
+        for (i = 0; i < offset && mplist_key (p) != Mnil; i++)
+            p = mplist_next (p);
 
-            for (; mplist_key (p) != Mnil; p = mplist_next (p)) {
-                MText *mtext;
-                gchar *buf;
+        for (i = 0; i < nrows && mplist_key (p) != Mnil; i++, p = mplist_next (p)) {
+            MText *mtext;
+            IBusText *text;
 
-                mtext = (MText *) mplist_value (p);
-                buf = ibus_m17n_mtext_to_utf8 (mtext);
-                if (buf) {
-                    ibus_lookup_table_append_candidate (m17n->table,
-                        ibus_text_new_from_string (buf));
-                    g_free (buf);
-                }
-                else {
-                    ibus_lookup_table_append_candidate (m17n->table,
-                        ibus_text_new_from_static_string ("NULL"));
-                    g_warn_if_reached();
-                }
+            mtext = (MText *) mplist_value (p);
+            text = ibus_m17n_mtext_to_text (mtext);
+            if (text == NULL) {
+                text = ibus_text_new_from_static_string ("NULL");
+                g_warn_if_reached();
+            }
+            g_ptr_array_add (candidates, g_object_ref_sink (text));
+        }
+    }
+
+    return candidates;
+}
+
+/* Take the converted candidates of the window at OFFSET of GROUP out
+   of the prefetched windows, if they are there. */
+static GPtrArray *
+ibus_m17n_engine_take_prefetched (IBusM17NEngine *m17n,
+                                  MPlist         *group,
+                                  gint            offset)
+{
+    guint i;
+
+    if (m17n->candidate_prefetch == NULL)
+        return NULL;
+
+    for (i = 0; i < m17n->candidate_prefetch->len; i++) {
+        IBusM17NCandidateWindow *window =
+            g_ptr_array_index (m17n->candidate_prefetch, i);
+
+        if (window->group == group && window->offset == offset) {
+            GPtrArray *candidates = window->candidates;
+
+            window->candidates = g_ptr_array_new ();
+            g_ptr_array_remove_index (m17n->candidate_prefetch, i);
+            return candidates;
+        }
+    }
+    return NULL;
+}
+
+/* Convert one window that a page flip or cursor movement from the
+   current window may show next.  Called repeatedly from idle until
+   every neighbour is converted. */
+static gboolean
+ibus_m17n_engine_prefetch_candidates (IBusM17NEngine *m17n)
+{
+    gint n, n_groups, start, len, column, i;
+
+    if (m17n->candidate_groups == NULL || m17n->candidate_group == NULL)
+        goto done;
+
+    n = ibus_m17n_candidate_index_lookup (m17n->candidate_groups,
+                                          m17n->candidate_window_start,
+                                          &start, &len);
+    if (n < 0)
+        goto done;
+    n_groups = ibus_m17n_candidate_index_get_n_groups (m17n->candidate_groups);
+    column = m17n->context->candidate_index - start;
+
+    if (m17n->candidate_prefetch == NULL)
+        m17n->candidate_prefetch = g_ptr_array_new_with_free_func (
+            (GDestroyNotify) ibus_m17n_candidate_window_free);
+
+    /* the next and previous windows of the current group, then the
+       windows of the next and previous groups that keep the column of
+       the highlighted candidate, as m17n-lib does when moving between
+       groups */
+    for (i = 0; i < CANDIDATE_PREFETCH_MAX; i++) {
+        gint target_start, target_len, index, offset, nrows;
+        guint j;
+        MPlist *group;
+        gboolean found = FALSE;
+
+        if (i < 2) {
+            index = m17n->candidate_window_start +
+                (i == 0 ? m17n->candidate_window_len : -1);
+            if (index < start || index >= start + len)
+                continue;
+            target_start = start;
+            target_len = len;
+            group = m17n->candidate_group;
+        }
+        else {
+            gint target;
+
+            if (n_groups < 2)
+                continue;
+            target = (n + (i == 2 ? 1 : n_groups - 1)) % n_groups;
+            group = ibus_m17n_candidate_index_get_group (m17n->candidate_groups,
+                                                         target);
+            ibus_m17n_candidate_index_get_group_range (m17n->candidate_groups,
+                                                       target,
+                                                       &target_start,
+                                                       &target_len);
+            if (target_len == 0)
+                continue;
+            index = target_start + MIN (column, target_len - 1);
+        }
+
+        ibus_m17n_engine_get_candidate_window (m17n, target_start, target_len,
+                                               index, &offset, &nrows);
+
+        for (j = 0; j < m17n->candidate_prefetch->len; j++) {
+            IBusM17NCandidateWindow *window =
+                g_ptr_array_index (m17n->candidate_prefetch, j);
+            if (window->group == group && window->offset == offset) {
+                found = TRUE;
+                break;
             }
         }
+        if (!found) {
+            IBusM17NCandidateWindow *window;
+
+            window = g_slice_new (IBusM17NCandidateWindow);
+            window->group = group;
+            window->offset = offset;
+            window->candidates =
+                ibus_m17n_engine_convert_candidates (m17n, group, offset, nrows);
+            /* keep at most as many windows as there are neighbours,
+               dropping the oldest */
+            if (m17n->candidate_prefetch->len >= CANDIDATE_PREFETCH_MAX)
+                g_ptr_array_remove_index (m17n->candidate_prefetch, 0);
+            g_ptr_array_add (m17n->candidate_prefetch, window);
+            /* one window per idle call, so that pending events are
+               dispatched in between */
+            return TRUE;
+        }
+    }
+
+ done:
+    m17n->candidate_prefetch_id = 0;
+    return FALSE;
+}
+
+static void
+ibus_m17n_engine_update_lookup_table (IBusM17NEngine *m17n)
+{
+    MInputContext *context = m17n->context;
+
+    if (context->candidate_list && context->candidate_show) {
+        IBusText *text;
+        MPlist *group;
+        GPtrArray *candidates;
+        gint n, start, len;
+        gint offset, nrows;
+        guint i;
+        IBusM17NEngineClass *klass = (IBusM17NEngineClass *) G_OBJECT_GET_CLASS (m17n);
+
+        if (context->candidate_list != m17n->candidate_list ||
+            (context->candidates_changed & MINPUT_CANDIDATES_LIST_CHANGED) != 0) {
+            /* A new candidate list; index its groups once so that
+               paging through it does not walk the whole list on each
+               draw.  The list is referenced so that its address
+               cannot be reused by a different list while we compare
+               against it. */
+            ibus_m17n_engine_forget_candidates (m17n);
+            m17n->candidate_list = context->candidate_list;
+            m17n_object_ref (m17n->candidate_list);
+            m17n->candidate_groups =
+                ibus_m17n_candidate_index_new (m17n->candidate_list);
+        }
+        else if (m17n->candidate_group != NULL &&
+                 context->candidate_index >= m17n->candidate_window_start &&
+                 context->candidate_index < m17n->candidate_window_start +
+                                            m17n->candidate_window_len) {
+            /* Only the highlighted candidate moved within the window
+               already loaded into the table; skip rebuilding the table
+               and the auxiliary text. */
+            ibus_lookup_table_set_cursor_pos (m17n->table,
+                context->candidate_index - m17n->candidate_window_start);
+            ibus_engine_update_lookup_table_fast ((IBusEngine *)m17n,
+                                                  m17n->table,
+                                                  TRUE);
+            return;
+        }
+
+        n = ibus_m17n_candidate_index_lookup (m17n->candidate_groups,
+                                              context->candidate_index,
+                                              &start, &len);
+        if (n < 0) {
+            g_warning ("candidate index %d is out of range",
+                       context->candidate_index);
+            ibus_m17n_engine_forget_candidates (m17n);
+            ibus_engine_hide_lookup_table ((IBusEngine *)m17n);
+            ibus_engine_hide_auxiliary_text ((IBusEngine *)m17n);
+            return;
+        }
+        group = ibus_m17n_candidate_index_get_group (m17n->candidate_groups, n);
+
+        /* Large groups (e.g. character pickers) are shown through a
+           window of lookup_table_page_size candidates, so that neither
+           the conversion work nor the serialized table grows with the
+           size of the group. */
+        ibus_m17n_engine_get_candidate_window (m17n, start, len,
+                                               context->candidate_index,
+                                               &offset, &nrows);
+
+        candidates = ibus_m17n_engine_take_prefetched (m17n, group, offset);
+        if (candidates != NULL)
+            ibus_m17n_engine_count (m17n, KEY_COUNTER_PREFETCH_HITS);
+        else {
+            ibus_m17n_engine_count (m17n, KEY_COUNTER_PREFETCH_MISSES);
+            candidates = ibus_m17n_engine_convert_candidates (m17n, group, offset, nrows);
+        }
+
+        if (m17n->table == NULL)
+            m17n->table = ibus_m17n_acquire_lookup_table ();
+        ibus_m17n_reset_lookup_table (m17n->table);
+        ibus_lookup_table_set_page_size (m17n->table, nrows);
+        for (i = 0; i < candidates->len; i++) {
+            ibus_lookup_table_append_candidate (m17n->table,
+                                                g_ptr_array_index (candidates, i));
+            /* number the rows of the page 1 to 9 and 0, as selection
+               keys are; further rows of a longer page go unnumbered */
+            if (i < 10)
+                ibus_lookup_table_set_label (m17n->table, i,
+                                             ibus_text_new_from_printf ("%d.",
+                                                                        (i + 1) % 10));
+        }
+        g_ptr_array_free (candidates, TRUE);
+
+        m17n->candidate_group = group;
+        m17n->candidate_window_start = start + offset;
+        m17n->candidate_window_len = nrows;
 
-        ibus_lookup_table_set_cursor_pos (m17n->table, m17n->context->candidate_index - i);
+        ibus_lookup_table_set_cursor_pos (m17n->table,
+            context->candidate_index - m17n->candidate_window_start);
         ibus_lookup_table_set_orientation (m17n->table, klass->lookup_table_orientation);
 
-        text = ibus_text_new_from_printf ("( %d / %d )", page, mplist_length (m17n->context->candidate_list));
+        text = ibus_text_new_from_printf ("( %d / %d )", n + 1,
+            ibus_m17n_candidate_index_get_n_groups (m17n->candidate_groups));
 
         ibus_engine_update_lookup_table ((IBusEngine *)m17n, m17n->table, TRUE);
         ibus_engine_update_auxiliary_text ((IBusEngine *)m17n, text, TRUE);
+
+        /* convert the neighbouring windows while the user is idle */
+        if (m17n->candidate_prefetch_id == 0)
+            m17n->candidate_prefetch_id =
+                ibus_m17n_scheduler_add (IBUS_M17N_TASK_BACKGROUND,
+                                         (IBusM17NTaskFunc) ibus_m17n_engine_prefetch_candidates,
+                                         m17n,
+                                         NULL);
     }
     else {
+        ibus_m17n_engine_forget_candidates (m17n);
         ibus_engine_hide_lookup_table ((IBusEngine *)m17n);
         ibus_engine_hide_auxiliary_text ((IBusEngine *)m17n);
     }
 }
 
 static void
-ibus_m17n_engine_callback (MInputContext *context,
-                           MSymbol        command)
+ibus_m17n_engine_forget_surrounding_text (IBusM17NEngine *m17n)
+{
+    if (m17n->surrounding_before) {
+        m17n_object_unref (m17n->surrounding_before);
+        m17n->surrounding_before = NULL;
+    }
+    if (m17n->surrounding_after) {
+        m17n_object_unref (m17n->surrounding_after);
+        m17n->surrounding_after = NULL;
+    }
+    m17n->surrounding_before_complete = FALSE;
+    m17n->surrounding_after_complete = FALSE;
+}
+
+#ifdef HAVE_IBUS_ENGINE_GET_SURROUNDING_TEXT
+/* Whether the surrounding text can be read; on the worker thread, only
+   the snapshot in the running key is. */
+static gboolean
+ibus_m17n_engine_has_surrounding_text (IBusM17NEngine *m17n)
+{
+    if (m17n->key_request != NULL)
+        return m17n->key_request->surrounding_text != NULL;
+    return (((IBusEngine *) m17n)->client_capabilities &
+            IBUS_CAP_SURROUNDING_TEXT) != 0;
+}
+
+/* Return an M-text of at most -LEN characters before (LEN < 0) or LEN
+   characters after (LEN > 0) the cursor.  Only a window around the
+   cursor is decoded, and the window is remembered until the current
+   key event ends or the surrounding text changes. */
+static MText *
+ibus_m17n_engine_get_surrounding_text (IBusM17NEngine *m17n,
+                                       gint            len)
+{
+    IBusText *text;
+    guint cursor_pos, anchor_pos;
+    MText **cache, *mt, *surround;
+    gboolean *complete, is_complete;
+    const gchar *start, *end, *cursor;
+    gint n, window;
+
+    if (len == 0)
+        return mtext ();
+
+    if (len < 0) {
+        n = -len;
+        cache = &m17n->surrounding_before;
+        complete = &m17n->surrounding_before_complete;
+    }
+    else {
+        n = len;
+        cache = &m17n->surrounding_after;
+        complete = &m17n->surrounding_after_complete;
+    }
+
+    if (*cache && (mtext_len (*cache) >= n || *complete)) {
+        ibus_m17n_engine_count (m17n, KEY_COUNTER_SURROUNDING_HITS);
+        window = mtext_len (*cache);
+        n = MIN (n, window);
+        if (len < 0)
+            return mtext_duplicate (*cache, window - n, window);
+        return mtext_duplicate (*cache, 0, n);
+    }
+
+    ibus_m17n_engine_count (m17n, KEY_COUNTER_SURROUNDING_MISSES);
+    if (m17n->key_request != NULL) {
+        /* on the worker thread */
+        text = g_object_ref (m17n->key_request->surrounding_text);
+        cursor = text->text + m17n->key_request->surrounding_cursor_index;
+    }
+    else {
+        ibus_engine_get_surrounding_text ((IBusEngine *) m17n,
+                                          &text,
+                                          &cursor_pos,
+                                          &anchor_pos);
+        if (text == m17n->surrounding_text &&
+            cursor_pos == m17n->surrounding_cursor_pos)
+            cursor = text->text + m17n->surrounding_cursor_index;
+        else
+            cursor = ibus_m17n_utf8_offset_to_pointer (text->text,
+                                                       strlen (text->text),
+                                                       cursor_pos);
+    }
+
+    /* decode a little more than asked, so that a MIM looking further
+       during the same key event is served from the cache; the window
+       is found from the cursor, so its cost does not grow with the
+       length of the text before the cursor */
+    window = MAX (n, SURROUNDING_TEXT_WINDOW);
+    if (len < 0) {
+        start = ibus_m17n_utf8_rewind (text->text, cursor, window);
+        end = cursor;
+        window = ibus_m17n_utf8_strlen (start, end - start);
+        is_complete = start == text->text;
+    }
+    else {
+        /* no character takes more than 6 bytes, even a broken one */
+        start = cursor;
+        end = ibus_m17n_utf8_offset_to_pointer (start,
+                                                strnlen (start, window * 6),
+                                                window);
+        window = ibus_m17n_utf8_strlen (start, end - start);
+        is_complete = *end == '\0';
+    }
+
+    mt = mtext ();
+    if (ibus_m17n_utf8_validate (start, end - start, NULL)) {
+        /* valid UTF-8 is appended as it is, without a converter */
+        if (end > start) {
+            MText *window_text = mtext_from_data (start, end - start,
+                                                  MTEXT_FORMAT_UTF_8);
+            mtext_cat (mt, window_text);
+            m17n_object_unref (window_text);
+        }
+    }
+    else {
+        m17n_object_unref (mt);
+        mt = mconv_decode_buffer (Mcoding_utf_8,
+                                  (const unsigned char *) start,
+                                  end - start);
+        window = mtext_len (mt);
+    }
+    g_object_unref (text);
+
+    n = MIN (n, window);
+    if (len < 0)
+        surround = mtext_duplicate (mt, window - n, window);
+    else
+        surround = mtext_duplicate (mt, 0, n);
+
+    if (window <= SURROUNDING_TEXT_CACHE_MAX) {
+        if (*cache)
+            m17n_object_unref (*cache);
+        *cache = mt;
+        *complete = is_complete;
+    }
+    else
+        m17n_object_unref (mt);
+
+    return surround;
+}
+#endif  /* HAVE_IBUS_ENGINE_GET_SURROUNDING_TEXT */
+
+static void
+ibus_m17n_engine_delete_surrounding_text (IBusM17NEngine *m17n,
+                                          long            len)
 {
-    IBusM17NEngine *m17n = NULL;
+    if (len < 0)
+        ibus_engine_delete_surrounding_text ((IBusEngine *) m17n,
+                                             len, -len);
+    else if (len > 0)
+        ibus_engine_delete_surrounding_text ((IBusEngine *) m17n,
+                                             0, len);
+}
 
-    m17n = context->arg;
-    g_return_if_fail (m17n != NULL);
+static gboolean
+ibus_m17n_engine_update_status (IBusM17NEngine *m17n)
+{
+    m17n->status_update_id = 0;
+    ibus_engine_update_property ((IBusEngine *)m17n, m17n->status_prop);
+    return FALSE;
+}
 
+static void
+ibus_m17n_engine_handle_callback (IBusM17NEngine *m17n,
+                                  MInputContext  *context,
+                                  MSymbol         command)
+{
     /* the callback may be called in minput_create_ic, in the time
      * m17n->context has not be assigned, so need assign it. */
     if (m17n->context == NULL) {
         m17n->context = context;
     }
 
+    /* on the worker thread, only answer what m17n waits for and leave
+       the rest to the main thread */
+    if (m17n->key_request != NULL &&
+        command != Minput_get_surrounding_text) {
+        IBusM17NCommand record = { command, 0 };
+
+        if (command == Minput_delete_surrounding_text) {
+            ibus_m17n_engine_forget_surrounding_text (m17n);
+            record.len = (long) mplist_value (m17n->context->plist);
+        }
+        g_array_append_val (m17n->key_request->commands, record);
+        return;
+    }
+
     if (command == Minput_preedit_start) {
         ibus_engine_hide_preedit_text ((IBusEngine *)m17n);
     }
@@ -894,12 +3221,11 @@ ibus_m17n_engine_callback (MInputContext *context,
         ibus_engine_hide_preedit_text ((IBusEngine *)m17n);
     }
     else if (command == Minput_status_draw) {
-        gchar *status;
-        status = ibus_m17n_mtext_to_utf8 (m17n->context->status);
+        MText *status = m17n->context->status;
 
-        if (status && strlen (status)) {
+        if (status && mtext_len (status) > 0) {
             IBusText *text;
-            text = ibus_text_new_from_string (status);
+            text = ibus_m17n_mtext_to_text (status);
             ibus_property_set_label (m17n->status_prop, text);
             ibus_property_set_visible (m17n->status_prop, TRUE);
         }
@@ -908,12 +3234,18 @@ ibus_m17n_engine_callback (MInputContext *context,
             ibus_property_set_visible (m17n->status_prop, FALSE);
         }
 
-        ibus_engine_update_property ((IBusEngine *)m17n, m17n->status_prop);
-        g_free (status);
+        /* only the panel shows the status; let key events go first */
+        if (m17n->status_update_id == 0)
+            m17n->status_update_id =
+                ibus_m17n_scheduler_add (IBUS_M17N_TASK_UI,
+                                         (IBusM17NTaskFunc) ibus_m17n_engine_update_status,
+                                         m17n,
+                                         NULL);
     }
     else if (command == Minput_status_done) {
     }
     else if (command == Minput_candidates_start) {
+        ibus_m17n_engine_forget_candidates (m17n);
         ibus_engine_hide_lookup_table ((IBusEngine *) m17n);
         ibus_engine_hide_auxiliary_text ((IBusEngine *) m17n);
     }
@@ -921,6 +3253,7 @@ ibus_m17n_engine_callback (MInputContext *context,
         ibus_m17n_engine_update_lookup_table (m17n);
     }
     else if (command == Minput_candidates_done) {
+        ibus_m17n_engine_forget_candidates (m17n);
         ibus_engine_hide_lookup_table ((IBusEngine *) m17n);
         ibus_engine_hide_auxiliary_text ((IBusEngine *) m17n);
     }
@@ -934,39 +3267,12 @@ ibus_m17n_engine_callback (MInputContext *context,
        git master (1.3.99+) */
 #ifdef HAVE_IBUS_ENGINE_GET_SURROUNDING_TEXT
     else if (command == Minput_get_surrounding_text &&
-             (((IBusEngine *) m17n)->client_capabilities &
-              IBUS_CAP_SURROUNDING_TEXT) != 0) {
-        IBusText *text;
-        guint cursor_pos, anchor_pos, nchars, nbytes;
-        MText *mt, *surround;
-        int len, pos;
-
-        ibus_engine_get_surrounding_text ((IBusEngine *) m17n,
-                                          &text,
-                                          &cursor_pos,
-                                          &anchor_pos);
-        nchars = ibus_text_get_length (text);
-        nbytes = g_utf8_offset_to_pointer (text->text, nchars) - text->text;
-        mt = mconv_decode_buffer (Mcoding_utf_8, text->text, nbytes);
-        g_object_unref (text);
+             ibus_m17n_engine_has_surrounding_text (m17n)) {
+        MText *surround;
+        int len;
 
         len = (long) mplist_value (m17n->context->plist);
-        if (len < 0) {
-            pos = cursor_pos + len;
-            if (pos < 0)
-                pos = 0;
-            surround = mtext_duplicate (mt, pos, cursor_pos);
-        }
-        else if (len > 0) {
-            pos = cursor_pos + len;
-            if (pos > nchars)
-                pos = nchars;
-            surround = mtext_duplicate (mt, cursor_pos, pos);
-        }
-        else {
-            surround = mtext ();
-        }
-        m17n_object_unref (mt);
+        surround = ibus_m17n_engine_get_surrounding_text (m17n, len);
         mplist_set (m17n->context->plist, Mtext, surround);
         m17n_object_unref (surround);
     }
@@ -974,14 +3280,34 @@ ibus_m17n_engine_callback (MInputContext *context,
     else if (command == Minput_delete_surrounding_text &&
              (((IBusEngine *) m17n)->client_capabilities &
               IBUS_CAP_SURROUNDING_TEXT) != 0) {
-        int len;
+        ibus_m17n_engine_forget_surrounding_text (m17n);
+        ibus_m17n_engine_delete_surrounding_text
+            (m17n, (long) mplist_value (m17n->context->plist));
+    }
+}
 
-        len = (long) mplist_value (m17n->context->plist);
-        if (len < 0)
-            ibus_engine_delete_surrounding_text ((IBusEngine *) m17n,
-                                                 len, -len);
-        else if (len > 0)
-            ibus_engine_delete_surrounding_text ((IBusEngine *) m17n,
-                                                 0, len);
+static void
+ibus_m17n_engine_callback (MInputContext *context,
+                           MSymbol        command)
+{
+    IBusM17NEngine *m17n = context->arg;
+    guint64 start;
+
+    /* pooled contexts belong to no instance */
+    if (m17n == NULL)
+        return;
+
+    /* the worker thread only records callbacks; they are counted
+       when replayed */
+    if (m17n->key_request != NULL) {
+        ibus_m17n_engine_handle_callback (m17n, context, command);
+        return;
     }
+
+    IBUS_M17N_PROBE2 (callback, ibus_engine_get_name ((IBusEngine *) m17n),
+                      msymbol_name (command));
+    start = ibus_m17n_stats_now ();
+    ibus_m17n_engine_handle_callback (m17n, context, command);
+    emit_ns += ibus_m17n_stats_now () - start;
+    ibus_m17n_engine_count (m17n, KEY_COUNTER_CALLBACKS);
 }
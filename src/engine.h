@@ -4,6 +4,8 @@
 
 #include <ibus.h>
 
-GType   ibus_m17n_engine_get_type_for_name (const gchar *name);
+GType     ibus_m17n_engine_get_type_for_name (const gchar *name);
+GVariant *ibus_m17n_engine_get_stats         (void);
+GVariant *ibus_m17n_engine_get_key_stats     (void);
 
 #endif
@@ -0,0 +1,168 @@
+/* vim:set et sts=4: */
+/* Record of which engines are used, how often, and which engine is
+   usually switched to from each, kept in a key file:
+
+   [m17n:hi:inscript]
+   count=42
+   next:m17n:hi:itrans=3
+
+   It is consulted to decide which input methods to open ahead of
+   time. */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include "m17nutil.h"
+
+#define HISTORY_COUNT_KEY "count"
+#define HISTORY_NEXT_PREFIX "next:"
+
+struct _IBusM17NHistory {
+    gchar *filename;
+    GKeyFile *key_file;
+    gchar *last_engine;
+};
+
+IBusM17NHistory *
+ibus_m17n_history_new (const gchar *filename)
+{
+    IBusM17NHistory *history = g_slice_new0 (IBusM17NHistory);
+
+    history->filename = g_strdup (filename);
+    history->key_file = g_key_file_new ();
+    /* a missing or broken file just starts a new history */
+    g_key_file_load_from_file (history->key_file, filename,
+                               G_KEY_FILE_NONE, NULL);
+    return history;
+}
+
+void
+ibus_m17n_history_free (IBusM17NHistory *history)
+{
+    g_free (history->filename);
+    g_key_file_free (history->key_file);
+    g_free (history->last_engine);
+    g_slice_free (IBusM17NHistory, history);
+}
+
+static void
+ibus_m17n_history_increment (IBusM17NHistory *history,
+                             const gchar     *group,
+                             const gchar     *key)
+{
+    gint count;
+
+    count = g_key_file_get_integer (history->key_file, group, key, NULL);
+    g_key_file_set_integer (history->key_file, group, key, count + 1);
+}
+
+/* Count a use of ENGINE_NAME, and the switch to it from the engine
+   recorded last. */
+void
+ibus_m17n_history_record (IBusM17NHistory *history,
+                          const gchar     *engine_name)
+{
+    if (g_strcmp0 (history->last_engine, engine_name) == 0)
+        return;
+
+    ibus_m17n_history_increment (history, engine_name, HISTORY_COUNT_KEY);
+
+    if (history->last_engine != NULL) {
+        gchar *key = g_strconcat (HISTORY_NEXT_PREFIX, engine_name, NULL);
+        ibus_m17n_history_increment (history, history->last_engine, key);
+        g_free (key);
+    }
+
+    g_free (history->last_engine);
+    history->last_engine = g_strdup (engine_name);
+}
+
+static gint
+compare_count (gconstpointer a,
+               gconstpointer b,
+               gpointer      user_data)
+{
+    GKeyFile *key_file = user_data;
+    const gchar *name_a = *(const gchar **) a;
+    const gchar *name_b = *(const gchar **) b;
+    gint count_a, count_b;
+
+    count_a = g_key_file_get_integer (key_file, name_a, HISTORY_COUNT_KEY, NULL);
+    count_b = g_key_file_get_integer (key_file, name_b, HISTORY_COUNT_KEY, NULL);
+    if (count_a != count_b)
+        return count_b - count_a;
+    return strcmp (name_a, name_b);
+}
+
+/* Return the N most used engines, most used first, as a
+   NULL-terminated array to be freed with g_strfreev. */
+gchar **
+ibus_m17n_history_get_top (IBusM17NHistory *history,
+                           guint            n)
+{
+    gchar **groups;
+    gsize length, i;
+
+    groups = g_key_file_get_groups (history->key_file, &length);
+    g_qsort_with_data (groups, length, sizeof (gchar *),
+                       compare_count, history->key_file);
+
+    for (i = n; i < length; i++) {
+        g_free (groups[i]);
+        groups[i] = NULL;
+    }
+    return groups;
+}
+
+/* Return the engine most often switched to from ENGINE_NAME, or NULL
+   if there is none yet. */
+gchar *
+ibus_m17n_history_get_next (IBusM17NHistory *history,
+                            const gchar     *engine_name)
+{
+    gchar **keys;
+    gchar *next = NULL;
+    gint max_count = 0;
+    gsize i;
+
+    keys = g_key_file_get_keys (history->key_file, engine_name, NULL, NULL);
+    if (keys == NULL)
+        return NULL;
+
+    for (i = 0; keys[i] != NULL; i++) {
+        gint count;
+
+        if (!g_str_has_prefix (keys[i], HISTORY_NEXT_PREFIX))
+            continue;
+        count = g_key_file_get_integer (history->key_file, engine_name,
+                                        keys[i], NULL);
+        if (count > max_count) {
+            max_count = count;
+            g_free (next);
+            next = g_strdup (keys[i] + strlen (HISTORY_NEXT_PREFIX));
+        }
+    }
+    g_strfreev (keys);
+
+    return next;
+}
+
+gboolean
+ibus_m17n_history_save (IBusM17NHistory *history,
+                        GError         **error)
+{
+    gchar *dirname, *data;
+    gsize length;
+    gboolean retval;
+
+    dirname = g_path_get_dirname (history->filename);
+    g_mkdir_with_parents (dirname, 0700);
+    g_free (dirname);
+
+    data = g_key_file_to_data (history->key_file, &length, NULL);
+    retval = g_file_set_contents (history->filename, data, length, error);
+    g_free (data);
+
+    return retval;
+}
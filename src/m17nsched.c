@@ -0,0 +1,186 @@
+/* vim:set et sts=4: */
+/* Scheduler for work that must not delay key events.
+
+   Key events come from D-Bus at G_PRIORITY_DEFAULT.  UI tasks run
+   after them, at G_PRIORITY_HIGH_IDLE; background tasks run at
+   G_PRIORITY_LOW.  Tasks are called round robin, each call being one
+   chunk of work, and a dispatch returns to the main loop once the
+   slice budget is spent, so that a key event waits for at most one
+   chunk.  While blocked, no task is called at all. */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "m17nutil.h"
+
+#define DEFAULT_SLICE_BUDGET 2000   /* microseconds */
+
+typedef struct _IBusM17NTask IBusM17NTask;
+
+struct _IBusM17NTask {
+    guint id;
+    IBusM17NTaskFunc func;
+    gpointer user_data;
+    GDestroyNotify destroy;
+};
+
+typedef struct _IBusM17NTaskQueue IBusM17NTaskQueue;
+
+struct _IBusM17NTaskQueue {
+    gint priority;
+    GQueue tasks;
+    guint source_id;
+};
+
+static IBusM17NTaskQueue queues[] = {
+    { G_PRIORITY_HIGH_IDLE, G_QUEUE_INIT, 0 },
+    { G_PRIORITY_LOW, G_QUEUE_INIT, 0 },
+};
+
+static guint next_task_id = 1;
+static gint64 slice_budget = DEFAULT_SLICE_BUDGET;
+static guint block_count = 0;
+/* the task being called, and whether it was removed meanwhile */
+static IBusM17NTask *running_task = NULL;
+static gboolean running_task_removed = FALSE;
+
+static void
+ibus_m17n_task_free (IBusM17NTask *task)
+{
+    if (task->destroy)
+        task->destroy (task->user_data);
+    g_slice_free (IBusM17NTask, task);
+}
+
+static gboolean ibus_m17n_scheduler_dispatch (gpointer user_data);
+
+static void
+ibus_m17n_task_queue_wake (IBusM17NTaskQueue *queue)
+{
+    if (queue->source_id == 0 && block_count == 0 &&
+        !g_queue_is_empty (&queue->tasks))
+        queue->source_id = g_idle_add_full (queue->priority,
+                                            ibus_m17n_scheduler_dispatch,
+                                            queue,
+                                            NULL);
+}
+
+static gboolean
+ibus_m17n_scheduler_dispatch (gpointer user_data)
+{
+    IBusM17NTaskQueue *queue = user_data;
+    gint64 deadline = g_get_monotonic_time () + slice_budget;
+
+    if (block_count > 0) {
+        queue->source_id = 0;
+        return FALSE;
+    }
+
+    do {
+        IBusM17NTask *task = g_queue_pop_head (&queue->tasks);
+        gboolean again;
+
+        if (task == NULL)
+            break;
+
+        running_task = task;
+        running_task_removed = FALSE;
+        again = task->func (task->user_data);
+        running_task = NULL;
+
+        if (again && !running_task_removed)
+            g_queue_push_tail (&queue->tasks, task);
+        else
+            ibus_m17n_task_free (task);
+    } while (block_count == 0 && g_get_monotonic_time () < deadline);
+
+    if (g_queue_is_empty (&queue->tasks) || block_count > 0) {
+        queue->source_id = 0;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Schedule FUNC to be called with USER_DATA at PRIORITY until it
+   returns FALSE or the task is removed; each call should do a small
+   chunk of work.  DESTROY is called on USER_DATA when the task ends.
+   Returns the task id. */
+guint
+ibus_m17n_scheduler_add (IBusM17NTaskPriority priority,
+                         IBusM17NTaskFunc     func,
+                         gpointer             user_data,
+                         GDestroyNotify       destroy)
+{
+    IBusM17NTaskQueue *queue;
+    IBusM17NTask *task;
+
+    g_return_val_if_fail (priority < G_N_ELEMENTS (queues), 0);
+    queue = &queues[priority];
+
+    task = g_slice_new (IBusM17NTask);
+    task->id = next_task_id++;
+    if (next_task_id == 0)
+        next_task_id = 1;
+    task->func = func;
+    task->user_data = user_data;
+    task->destroy = destroy;
+    g_queue_push_tail (&queue->tasks, task);
+    ibus_m17n_task_queue_wake (queue);
+
+    return task->id;
+}
+
+/* Remove the task ID, which may be the one being called. */
+void
+ibus_m17n_scheduler_remove (guint id)
+{
+    guint i;
+
+    if (running_task != NULL && running_task->id == id) {
+        running_task_removed = TRUE;
+        return;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS (queues); i++) {
+        GList *p;
+
+        for (p = queues[i].tasks.head; p != NULL; p = p->next) {
+            IBusM17NTask *task = p->data;
+
+            if (task->id == id) {
+                g_queue_delete_link (&queues[i].tasks, p);
+                ibus_m17n_task_free (task);
+                return;
+            }
+        }
+    }
+}
+
+/* Set how many microseconds a dispatch may spend calling tasks before
+   yielding to the main loop. */
+void
+ibus_m17n_scheduler_set_budget (gint64 usec)
+{
+    slice_budget = usec;
+}
+
+/* Stop calling tasks until ibus_m17n_scheduler_unblock has been called
+   as many times; tasks can still be added and removed meanwhile. */
+void
+ibus_m17n_scheduler_block (void)
+{
+    block_count++;
+}
+
+void
+ibus_m17n_scheduler_unblock (void)
+{
+    guint i;
+
+    g_return_if_fail (block_count > 0);
+
+    if (--block_count > 0)
+        return;
+    for (i = 0; i < G_N_ELEMENTS (queues); i++)
+        ibus_m17n_task_queue_wake (&queues[i]);
+}
@@ -0,0 +1,136 @@
+/* vim:set et sts=4: */
+/* Log-linear latency histograms.
+
+   Values below 8 have a bucket each; above, every power of two is
+   split into 8 buckets, so that a bucket is at most 12.5% wide.
+   Values from 2^36 (about a minute, in nanoseconds) on share the last
+   bucket.  Adding a value is a few shifts and an increment. */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <time.h>
+#include "m17nutil.h"
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+
+static guint
+ibus_m17n_histogram_bucket (guint64 value)
+{
+    guint exponent;
+
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return value;
+
+    exponent = g_bit_storage (value) - 1;
+    return MIN (HISTOGRAM_SUB_BUCKETS +
+                (exponent - HISTOGRAM_SUB_BITS) * HISTOGRAM_SUB_BUCKETS +
+                ((value >> (exponent - HISTOGRAM_SUB_BITS)) &
+                 (HISTOGRAM_SUB_BUCKETS - 1)),
+                IBUS_M17N_HISTOGRAM_N_BUCKETS - 1);
+}
+
+/* Return the largest value counted in BUCKET. */
+static guint64
+ibus_m17n_histogram_bucket_limit (guint bucket)
+{
+    guint exponent, sub;
+
+    if (bucket < HISTOGRAM_SUB_BUCKETS)
+        return bucket;
+    if (bucket == IBUS_M17N_HISTOGRAM_N_BUCKETS - 1)
+        return G_MAXUINT64;
+
+    exponent = (bucket - HISTOGRAM_SUB_BUCKETS) / HISTOGRAM_SUB_BUCKETS +
+        HISTOGRAM_SUB_BITS;
+    sub = bucket % HISTOGRAM_SUB_BUCKETS;
+    return (((guint64) (HISTOGRAM_SUB_BUCKETS + sub + 1)) <<
+            (exponent - HISTOGRAM_SUB_BITS)) - 1;
+}
+
+void
+ibus_m17n_histogram_add (IBusM17NHistogram *histogram,
+                         guint64            value)
+{
+    histogram->buckets[ibus_m17n_histogram_bucket (value)]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value > histogram->max)
+        histogram->max = value;
+}
+
+/* Return an upper bound of the PERCENTILE-th percentile, within the
+   width of a bucket. */
+guint64
+ibus_m17n_histogram_get_percentile (const IBusM17NHistogram *histogram,
+                                    gdouble                  percentile)
+{
+    guint64 rank, seen = 0;
+    guint i;
+
+    if (histogram->count == 0)
+        return 0;
+
+    rank = (guint64) (histogram->count * percentile / 100.0 + 0.5);
+    rank = CLAMP (rank, 1, histogram->count);
+    for (i = 0; i < IBUS_M17N_HISTOGRAM_N_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank)
+            return MIN (ibus_m17n_histogram_bucket_limit (i),
+                        histogram->max);
+    }
+    return histogram->max;
+}
+
+/* Return HISTOGRAM as a{sv}: "count", "sum", "max", "p50", "p90" and
+   "p99", and "buckets", the non-empty buckets as (upper limit,
+   count). */
+GVariant *
+ibus_m17n_histogram_serialize (const IBusM17NHistogram *histogram)
+{
+    GVariantBuilder builder, buckets;
+    guint i;
+
+    g_variant_builder_init (&buckets, G_VARIANT_TYPE ("a(tu)"));
+    for (i = 0; i < IBUS_M17N_HISTOGRAM_N_BUCKETS; i++) {
+        if (histogram->buckets[i] > 0)
+            g_variant_builder_add (&buckets, "(tu)",
+                                   ibus_m17n_histogram_bucket_limit (i),
+                                   histogram->buckets[i]);
+    }
+
+    g_variant_builder_init (&builder, G_VARIANT_TYPE_VARDICT);
+    g_variant_builder_add (&builder, "{sv}", "count",
+                           g_variant_new_uint64 (histogram->count));
+    g_variant_builder_add (&builder, "{sv}", "sum",
+                           g_variant_new_uint64 (histogram->sum));
+    g_variant_builder_add (&builder, "{sv}", "max",
+                           g_variant_new_uint64 (histogram->max));
+    g_variant_builder_add (&builder, "{sv}", "p50",
+                           g_variant_new_uint64 (
+                               ibus_m17n_histogram_get_percentile (histogram, 50)));
+    g_variant_builder_add (&builder, "{sv}", "p90",
+                           g_variant_new_uint64 (
+                               ibus_m17n_histogram_get_percentile (histogram, 90)));
+    g_variant_builder_add (&builder, "{sv}", "p99",
+                           g_variant_new_uint64 (
+                               ibus_m17n_histogram_get_percentile (histogram, 99)));
+    g_variant_builder_add (&builder, "{sv}", "buckets",
+                           g_variant_builder_end (&buckets));
+    return g_variant_builder_end (&builder);
+}
+
+/* Return a monotonic time in nanoseconds, for the histograms. */
+guint64
+ibus_m17n_stats_now (void)
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    if (clock_gettime (CLOCK_MONOTONIC, &ts) == 0)
+        return (guint64) ts.tv_sec * G_GUINT64_CONSTANT (1000000000) +
+            ts.tv_nsec;
+#endif  /* CLOCK_MONOTONIC */
+    return (guint64) g_get_monotonic_time () * 1000;
+}
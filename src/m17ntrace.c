@@ -0,0 +1,431 @@
+/* vim:set et sts=4: */
+/* Compact binary traces of the events an engine receives.
+
+   A trace starts with the 8 bytes "IBM17NT\1", followed by records:
+
+   type      1 byte, IBusM17NTraceEventType
+   delta     varint, microseconds since the previous record
+   engine    varint, index of the engine name; the first use of an
+             index is followed by the name as a varint length and bytes
+   keyval    varint  \
+   keycode   varint   | key events only
+   modifiers varint   |
+   handled   1 byte  /
+
+   Varints are unsigned LEB128.  Printable keys are obfuscated before
+   they are written: each is replaced by a key of the same class
+   (lowercase, uppercase, digit, unshifted or shifted punctuation of a
+   US keyboard, or the same 128 code point block) through a
+   substitution drawn at random for each trace.  A key is replaced the
+   same way all through a trace, so repetitions and n-grams, which
+   decide what a MIM does, survive; the keycode written is the one of
+   the replacement on a US keyboard, or 0 if it has none.  Since a
+   long trace is open to frequency analysis, a writer created with
+   SCRAMBLE draws a new replacement for every key instead, keeping the
+   key classes only.  Traces are created readable by the user only. */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib/gstdio.h>
+#include "m17nutil.h"
+
+#define TRACE_MAGIC "IBM17NT\1"
+#define TRACE_MAGIC_LEN 8
+#define TRACE_FLUSH_SIZE 4096
+
+struct _IBusM17NTraceWriter {
+    FILE *file;
+    GByteArray *buffer;
+    GHashTable *engine_ids;
+    guint n_engines;
+    gint64 last_time;
+    guint32 salt;
+    gboolean scramble;
+    guint32 n_keys;
+    /* the substitution of this trace, by class and position in it */
+    gchar *substitutes[5];
+    guint8 block_substitutes[128];
+    /* keycodes of the ASCII keyvals on a US keyboard */
+    guint16 keycodes[128];
+};
+
+struct _IBusM17NTraceReader {
+    gchar *filename;
+    guchar *data;
+    gsize length;
+    gsize pos;
+    GPtrArray *engine_names;
+    gint64 time;
+};
+
+static const gchar *key_classes[] = {
+    "abcdefghijklmnopqrstuvwxyz",
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ",
+    "0123456789",
+    "`-=[]\\;',./",
+    "~!@#$%^&*()_+{}|:\"<>?",
+};
+
+static void
+ibus_m17n_trace_put_varint (GByteArray *buffer,
+                            guint64     value)
+{
+    guint8 byte;
+
+    while (value >= 0x80) {
+        byte = (value & 0x7f) | 0x80;
+        g_byte_array_append (buffer, &byte, 1);
+        value >>= 7;
+    }
+    byte = value;
+    g_byte_array_append (buffer, &byte, 1);
+}
+
+static void
+ibus_m17n_trace_shuffle (GRand  *rand,
+                         guint8 *items,
+                         guint   n_items)
+{
+    guint i, j;
+    guint8 item;
+
+    for (i = n_items - 1; i > 0; i--) {
+        j = g_rand_int_range (rand, 0, i + 1);
+        item = items[i];
+        items[i] = items[j];
+        items[j] = item;
+    }
+}
+
+/* Draw the substitution of WRITER, and find the keycodes its keys
+   have on a US keyboard. */
+static void
+ibus_m17n_trace_writer_init_keys (IBusM17NTraceWriter *writer)
+{
+    static const guint states[] = { 0, IBUS_SHIFT_MASK };
+    IBusKeymap *keymap;
+    GRand *rand;
+    guint i, j, keyval;
+
+    G_STATIC_ASSERT (G_N_ELEMENTS (key_classes) ==
+                     G_N_ELEMENTS (writer->substitutes));
+
+    rand = g_rand_new_with_seed (writer->salt);
+    for (i = 0; i < G_N_ELEMENTS (key_classes); i++) {
+        writer->substitutes[i] = g_strdup (key_classes[i]);
+        ibus_m17n_trace_shuffle (rand, (guint8 *) writer->substitutes[i],
+                                 strlen (key_classes[i]));
+    }
+    for (i = 0; i < G_N_ELEMENTS (writer->block_substitutes); i++)
+        writer->block_substitutes[i] = i;
+    ibus_m17n_trace_shuffle (rand, writer->block_substitutes,
+                             G_N_ELEMENTS (writer->block_substitutes));
+    g_rand_free (rand);
+
+    keymap = ibus_keymap_get ("us");
+    if (keymap == NULL)
+        return;
+    for (i = 0; i < G_N_ELEMENTS (states); i++) {
+        for (j = 0; j < 256; j++) {
+            keyval = ibus_keymap_lookup_keysym (keymap, j, states[i]);
+            if (keyval < G_N_ELEMENTS (writer->keycodes) &&
+                writer->keycodes[keyval] == 0)
+                writer->keycodes[keyval] = j;
+        }
+    }
+    g_object_unref (keymap);
+}
+
+/* Replace *KEYVAL and *KEYCODE if the key is printable. */
+static void
+ibus_m17n_trace_obfuscate (IBusM17NTraceWriter *writer,
+                           guint               *keyval,
+                           guint               *keycode)
+{
+    gunichar c = ibus_keyval_to_unicode (*keyval);
+    guint32 hash = 0;
+    guint i;
+
+    if (c == 0 || !g_unichar_isgraph (c))
+        return;
+
+    if (writer->scramble) {
+        hash = (c ^ writer->salt ^ (writer->n_keys++ * 0x85ebca6b)) * 0x9e3779b1;
+        hash ^= hash >> 16;
+    }
+
+    *keycode = 0;
+    if (c < 0x80) {
+        for (i = 0; i < G_N_ELEMENTS (key_classes); i++) {
+            const gchar *p = strchr (key_classes[i], c);
+
+            if (p != NULL) {
+                /* keyvals of ASCII characters are the characters */
+                if (writer->scramble)
+                    *keyval = key_classes[i][hash % strlen (key_classes[i])];
+                else
+                    *keyval = writer->substitutes[i][p - key_classes[i]];
+                *keycode = writer->keycodes[*keyval];
+                break;
+            }
+        }
+    }
+    else {
+        /* the same substitution in every block would show which
+           characters of two blocks correspond */
+        guint low = (c ^ ((c >> 7) * 0x9e3779b1 >> 25)) & 0x7f;
+
+        if (writer->scramble)
+            low = hash;
+        *keyval = 0x01000000 | (c & ~0x7f) |
+            writer->block_substitutes[low & 0x7f];
+    }
+}
+
+static void
+ibus_m17n_trace_writer_flush (IBusM17NTraceWriter *writer)
+{
+    if (writer->buffer->len == 0)
+        return;
+    fwrite (writer->buffer->data, 1, writer->buffer->len, writer->file);
+    fflush (writer->file);
+    g_byte_array_set_size (writer->buffer, 0);
+}
+
+/* Start a trace in FILENAME, replacing the file.  With SCRAMBLE, keys
+   are not replaced the same way twice. */
+IBusM17NTraceWriter *
+ibus_m17n_trace_writer_new (const gchar *filename,
+                            gboolean     scramble,
+                            GError     **error)
+{
+    IBusM17NTraceWriter *writer;
+    FILE *file = NULL;
+    gint fd;
+
+    /* keys are recorded, so the file is private whatever the umask */
+    fd = g_open (filename, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd >= 0) {
+        file = fdopen (fd, "wb");
+        if (file == NULL) {
+            gint saved_errno = errno;
+            close (fd);
+            errno = saved_errno;
+        }
+    }
+    if (file == NULL) {
+        gint saved_errno = errno;
+        g_set_error (error, G_FILE_ERROR, g_file_error_from_errno (saved_errno),
+                     "%s: %s", filename, g_strerror (saved_errno));
+        return NULL;
+    }
+
+    writer = g_slice_new0 (IBusM17NTraceWriter);
+    writer->file = file;
+    writer->buffer = g_byte_array_new ();
+    writer->engine_ids = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                g_free, NULL);
+    writer->last_time = -1;
+    writer->salt = g_random_int ();
+    writer->scramble = scramble;
+    ibus_m17n_trace_writer_init_keys (writer);
+
+    g_byte_array_append (writer->buffer,
+                         (const guint8 *) TRACE_MAGIC, TRACE_MAGIC_LEN);
+    return writer;
+}
+
+void
+ibus_m17n_trace_writer_free (IBusM17NTraceWriter *writer)
+{
+    guint i;
+
+    ibus_m17n_trace_writer_flush (writer);
+    fclose (writer->file);
+    g_byte_array_free (writer->buffer, TRUE);
+    g_hash_table_destroy (writer->engine_ids);
+    for (i = 0; i < G_N_ELEMENTS (writer->substitutes); i++)
+        g_free (writer->substitutes[i]);
+    g_slice_free (IBusM17NTraceWriter, writer);
+}
+
+/* Append EVENT.  Records are buffered, and written out every few
+   kilobytes or when FLUSH is TRUE. */
+void
+ibus_m17n_trace_writer_add (IBusM17NTraceWriter      *writer,
+                            const IBusM17NTraceEvent *event,
+                            gboolean                  flush)
+{
+    GByteArray *buffer = writer->buffer;
+    gpointer id;
+    guint8 byte;
+
+    byte = event->type;
+    g_byte_array_append (buffer, &byte, 1);
+
+    if (writer->last_time < 0 || event->time < writer->last_time)
+        ibus_m17n_trace_put_varint (buffer, 0);
+    else
+        ibus_m17n_trace_put_varint (buffer, event->time - writer->last_time);
+    writer->last_time = event->time;
+
+    if (g_hash_table_lookup_extended (writer->engine_ids, event->engine_name,
+                                      NULL, &id)) {
+        ibus_m17n_trace_put_varint (buffer, GPOINTER_TO_UINT (id));
+    }
+    else {
+        gsize len = strlen (event->engine_name);
+
+        g_hash_table_insert (writer->engine_ids,
+                             g_strdup (event->engine_name),
+                             GUINT_TO_POINTER (writer->n_engines));
+        ibus_m17n_trace_put_varint (buffer, writer->n_engines++);
+        ibus_m17n_trace_put_varint (buffer, len);
+        g_byte_array_append (buffer, (const guint8 *) event->engine_name, len);
+    }
+
+    if (event->type == IBUS_M17N_TRACE_KEY) {
+        guint keyval = event->keyval;
+        guint keycode = event->keycode;
+
+        ibus_m17n_trace_obfuscate (writer, &keyval, &keycode);
+        ibus_m17n_trace_put_varint (buffer, keyval);
+        ibus_m17n_trace_put_varint (buffer, keycode);
+        ibus_m17n_trace_put_varint (buffer, event->modifiers);
+        byte = event->handled ? 1 : 0;
+        g_byte_array_append (buffer, &byte, 1);
+    }
+
+    if (flush || buffer->len >= TRACE_FLUSH_SIZE)
+        ibus_m17n_trace_writer_flush (writer);
+}
+
+IBusM17NTraceReader *
+ibus_m17n_trace_reader_new (const gchar *filename,
+                            GError     **error)
+{
+    IBusM17NTraceReader *reader;
+    gchar *data;
+    gsize length;
+
+    if (!g_file_get_contents (filename, &data, &length, error))
+        return NULL;
+
+    if (length < TRACE_MAGIC_LEN ||
+        memcmp (data, TRACE_MAGIC, TRACE_MAGIC_LEN) != 0) {
+        g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                     "%s is not an ibus-m17n trace", filename);
+        g_free (data);
+        return NULL;
+    }
+
+    reader = g_slice_new0 (IBusM17NTraceReader);
+    reader->filename = g_strdup (filename);
+    reader->data = (guchar *) data;
+    reader->length = length;
+    reader->pos = TRACE_MAGIC_LEN;
+    reader->engine_names = g_ptr_array_new_with_free_func (g_free);
+    return reader;
+}
+
+void
+ibus_m17n_trace_reader_free (IBusM17NTraceReader *reader)
+{
+    g_free (reader->filename);
+    g_free (reader->data);
+    g_ptr_array_free (reader->engine_names, TRUE);
+    g_slice_free (IBusM17NTraceReader, reader);
+}
+
+static gboolean
+ibus_m17n_trace_get_varint (IBusM17NTraceReader *reader,
+                            guint64             *value)
+{
+    guint shift = 0;
+
+    *value = 0;
+    while (reader->pos < reader->length && shift < 64) {
+        guchar byte = reader->data[reader->pos++];
+
+        *value |= (guint64) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0)
+            return TRUE;
+        shift += 7;
+    }
+    return FALSE;
+}
+
+static gboolean
+ibus_m17n_trace_get_byte (IBusM17NTraceReader *reader,
+                          guint8              *value)
+{
+    if (reader->pos >= reader->length)
+        return FALSE;
+    *value = reader->data[reader->pos++];
+    return TRUE;
+}
+
+/* Read the next record into EVENT, whose time is counted from the
+   first record and whose engine name is owned by READER.  Returns
+   FALSE at the end of the trace, setting ERROR if it is truncated or
+   corrupt. */
+gboolean
+ibus_m17n_trace_reader_next (IBusM17NTraceReader *reader,
+                             IBusM17NTraceEvent  *event,
+                             GError             **error)
+{
+    guint64 delta, id, len, keyval, keycode, modifiers;
+    guint8 type, handled;
+
+    if (reader->pos == reader->length)
+        return FALSE;
+
+    memset (event, 0, sizeof (*event));
+
+    if (!ibus_m17n_trace_get_byte (reader, &type) ||
+        type > IBUS_M17N_TRACE_CURSOR_DOWN ||
+        !ibus_m17n_trace_get_varint (reader, &delta) ||
+        !ibus_m17n_trace_get_varint (reader, &id) ||
+        id > reader->engine_names->len)
+        goto corrupt;
+
+    if (id == reader->engine_names->len) {
+        if (!ibus_m17n_trace_get_varint (reader, &len) ||
+            len > reader->length - reader->pos)
+            goto corrupt;
+        g_ptr_array_add (reader->engine_names,
+                         g_strndup ((const gchar *) reader->data + reader->pos,
+                                    len));
+        reader->pos += len;
+    }
+
+    if (type == IBUS_M17N_TRACE_KEY) {
+        if (!ibus_m17n_trace_get_varint (reader, &keyval) ||
+            !ibus_m17n_trace_get_varint (reader, &keycode) ||
+            !ibus_m17n_trace_get_varint (reader, &modifiers) ||
+            !ibus_m17n_trace_get_byte (reader, &handled))
+            goto corrupt;
+        event->keyval = keyval;
+        event->keycode = keycode;
+        event->modifiers = modifiers;
+        event->handled = handled != 0;
+    }
+
+    reader->time += delta;
+    event->type = type;
+    event->time = reader->time;
+    event->engine_name = g_ptr_array_index (reader->engine_names, id);
+    return TRUE;
+
+  corrupt:
+    g_set_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                 "%s: corrupt record at offset %" G_GSIZE_FORMAT,
+                 reader->filename, reader->pos);
+    reader->pos = reader->length;
+    return FALSE;
+}
@@ -0,0 +1,564 @@
+/* vim:set et sts=4: */
+/* UTF-8 <-> UCS-4 kernels with SIMD fast paths for ASCII runs.
+
+   Every function has a scalar implementation; the vectorized variants
+   (SSE2 and AVX2 on x86) only speed up the common cases, i.e. skipping
+   ASCII and counting character starts, and hand everything else to
+   the scalar code.  The variant is chosen once at
+   run time from what the CPU supports. */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include "m17nutil.h"
+
+#if defined(__GNUC__) && defined(__x86_64__) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define HAVE_UTF8_SSE2 1
+#define HAVE_UTF8_AVX2 1
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#define HAVE_UTF8_SSE2 1
+#include <emmintrin.h>
+#endif
+
+typedef struct _Utf8Kernels Utf8Kernels;
+
+struct _Utf8Kernels {
+    const gchar *name;
+    /* number of leading bytes in 0x01..0x7f */
+    gsize (*ascii_span) (const guchar *s, gsize len);
+    /* number of bytes which start a character, i.e. are not 10xxxxxx */
+    gsize (*count_starts) (const guchar *s, gsize len);
+    /* number of bytes needed to encode the characters in UTF-8, those
+       above U+10FFFF being replaced with U+FFFD */
+    gsize (*ucs4_utf8_len) (const gunichar *s, gsize len);
+    /* widen/narrow the leading ASCII characters, returning how many */
+    gsize (*ascii_to_ucs4) (const guchar *s, gsize len, gunichar *out);
+    gsize (*ucs4_to_ascii) (const gunichar *s, gsize len, guchar *out);
+};
+
+/* scalar kernels */
+
+static gsize
+ascii_span_scalar (const guchar *s, gsize len)
+{
+    gsize i;
+
+    for (i = 0; i < len && s[i] != 0 && s[i] < 0x80; i++)
+        ;
+    return i;
+}
+
+static gsize
+count_starts_scalar (const guchar *s, gsize len)
+{
+    gsize i, n = 0;
+
+    for (i = 0; i < len; i++)
+        n += (s[i] & 0xc0) != 0x80;
+    return n;
+}
+
+static gsize
+ucs4_utf8_len_scalar (const gunichar *s, gsize len)
+{
+    gsize i, n = 0;
+
+    for (i = 0; i < len; i++)
+        n += 1 + (s[i] >= 0x80) + (s[i] >= 0x800) + (s[i] >= 0x10000) -
+            (s[i] > 0x10ffff);
+    return n;
+}
+
+static gsize
+ascii_to_ucs4_scalar (const guchar *s, gsize len, gunichar *out)
+{
+    gsize i;
+
+    for (i = 0; i < len && s[i] < 0x80; i++)
+        out[i] = s[i];
+    return i;
+}
+
+static gsize
+ucs4_to_ascii_scalar (const gunichar *s, gsize len, guchar *out)
+{
+    gsize i;
+
+    for (i = 0; i < len && s[i] < 0x80; i++)
+        out[i] = s[i];
+    return i;
+}
+
+static const Utf8Kernels scalar_kernels = {
+    "scalar",
+    ascii_span_scalar,
+    count_starts_scalar,
+    ucs4_utf8_len_scalar,
+    ascii_to_ucs4_scalar,
+    ucs4_to_ascii_scalar
+};
+
+#ifdef HAVE_UTF8_SSE2
+static gsize
+ascii_span_sse2 (const guchar *s, gsize len)
+{
+    const __m128i zero = _mm_setzero_si128 ();
+    gsize i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128 ((const __m128i *) (s + i));
+        guint mask = _mm_movemask_epi8 (v) |
+            _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, zero));
+        if (mask != 0)
+            return i + __builtin_ctz (mask);
+    }
+    return i + ascii_span_scalar (s + i, len - i);
+}
+
+static gsize
+count_starts_sse2 (const guchar *s, gsize len)
+{
+    /* continuation bytes are -128..-65 as signed bytes */
+    const __m128i limit = _mm_set1_epi8 (-65);
+    gsize i = 0, n = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128 ((const __m128i *) (s + i));
+        n += __builtin_popcount (_mm_movemask_epi8 (_mm_cmpgt_epi8 (v, limit)));
+    }
+    return n + count_starts_scalar (s + i, len - i);
+}
+
+static gsize
+ucs4_utf8_len_sse2 (const gunichar *s, gsize len)
+{
+    /* there are only signed comparisons, so values and limits are
+       biased by 0x80000000 to compare them unsigned */
+    const __m128i bias = _mm_set1_epi32 ((gint) 0x80000000);
+    const __m128i c80 = _mm_set1_epi32 ((gint) (0x7f ^ 0x80000000));
+    const __m128i c800 = _mm_set1_epi32 ((gint) (0x7ff ^ 0x80000000));
+    const __m128i c10000 = _mm_set1_epi32 ((gint) (0xffff ^ 0x80000000));
+    const __m128i c110000 = _mm_set1_epi32 ((gint) (0x10ffff ^ 0x80000000));
+    __m128i acc = _mm_setzero_si128 ();
+    guint32 lanes[4];
+    gsize i = 0, n;
+
+    for (; i + 4 <= len; i += 4) {
+        __m128i v = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) (s + i)),
+                                   bias);
+        /* each comparison yields -1 where true */
+        acc = _mm_sub_epi32 (acc, _mm_cmpgt_epi32 (v, c80));
+        acc = _mm_sub_epi32 (acc, _mm_cmpgt_epi32 (v, c800));
+        acc = _mm_sub_epi32 (acc, _mm_cmpgt_epi32 (v, c10000));
+        acc = _mm_add_epi32 (acc, _mm_cmpgt_epi32 (v, c110000));
+    }
+    _mm_storeu_si128 ((__m128i *) lanes, acc);
+    n = i + lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    return n + ucs4_utf8_len_scalar (s + i, len - i);
+}
+
+static gsize
+ascii_to_ucs4_sse2 (const guchar *s, gsize len, gunichar *out)
+{
+    const __m128i zero = _mm_setzero_si128 ();
+    gsize i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128 ((const __m128i *) (s + i));
+        __m128i lo, hi;
+
+        if (_mm_movemask_epi8 (v) != 0)
+            break;
+        lo = _mm_unpacklo_epi8 (v, zero);
+        hi = _mm_unpackhi_epi8 (v, zero);
+        _mm_storeu_si128 ((__m128i *) (out + i), _mm_unpacklo_epi16 (lo, zero));
+        _mm_storeu_si128 ((__m128i *) (out + i + 4), _mm_unpackhi_epi16 (lo, zero));
+        _mm_storeu_si128 ((__m128i *) (out + i + 8), _mm_unpacklo_epi16 (hi, zero));
+        _mm_storeu_si128 ((__m128i *) (out + i + 12), _mm_unpackhi_epi16 (hi, zero));
+    }
+    return i + ascii_to_ucs4_scalar (s + i, len - i, out + i);
+}
+
+static gsize
+ucs4_to_ascii_sse2 (const gunichar *s, gsize len, guchar *out)
+{
+    const __m128i c80 = _mm_set1_epi32 (0x7f);
+    gsize i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        __m128i a = _mm_loadu_si128 ((const __m128i *) (s + i));
+        __m128i b = _mm_loadu_si128 ((const __m128i *) (s + i + 4));
+        __m128i big = _mm_or_si128 (_mm_cmpgt_epi32 (a, c80),
+                                    _mm_cmpgt_epi32 (b, c80));
+        __m128i packed;
+
+        /* also catches values that are negative as signed */
+        big = _mm_or_si128 (big, _mm_or_si128 (_mm_srai_epi32 (a, 31),
+                                               _mm_srai_epi32 (b, 31)));
+        if (_mm_movemask_epi8 (big) != 0)
+            break;
+        packed = _mm_packs_epi32 (a, b);
+        packed = _mm_packus_epi16 (packed, packed);
+        _mm_storel_epi64 ((__m128i *) (out + i), packed);
+    }
+    return i + ucs4_to_ascii_scalar (s + i, len - i, out + i);
+}
+
+static const Utf8Kernels sse2_kernels = {
+    "sse2",
+    ascii_span_sse2,
+    count_starts_sse2,
+    ucs4_utf8_len_sse2,
+    ascii_to_ucs4_sse2,
+    ucs4_to_ascii_sse2
+};
+#endif  /* HAVE_UTF8_SSE2 */
+
+#ifdef HAVE_UTF8_AVX2
+__attribute__((target("avx2"))) static gsize
+ascii_span_avx2 (const guchar *s, gsize len)
+{
+    const __m256i zero = _mm256_setzero_si256 ();
+    gsize i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256 ((const __m256i *) (s + i));
+        guint mask = (guint) _mm256_movemask_epi8 (v) |
+            (guint) _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, zero));
+        if (mask != 0)
+            return i + __builtin_ctz (mask);
+    }
+    return i + ascii_span_sse2 (s + i, len - i);
+}
+
+__attribute__((target("avx2"))) static gsize
+count_starts_avx2 (const guchar *s, gsize len)
+{
+    const __m256i limit = _mm256_set1_epi8 (-65);
+    gsize i = 0, n = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256 ((const __m256i *) (s + i));
+        n += __builtin_popcount (
+            (guint) _mm256_movemask_epi8 (_mm256_cmpgt_epi8 (v, limit)));
+    }
+    return n + count_starts_sse2 (s + i, len - i);
+}
+
+__attribute__((target("avx2"))) static gsize
+ucs4_utf8_len_avx2 (const gunichar *s, gsize len)
+{
+    const __m256i bias = _mm256_set1_epi32 ((gint) 0x80000000);
+    const __m256i c80 = _mm256_set1_epi32 ((gint) (0x7f ^ 0x80000000));
+    const __m256i c800 = _mm256_set1_epi32 ((gint) (0x7ff ^ 0x80000000));
+    const __m256i c10000 = _mm256_set1_epi32 ((gint) (0xffff ^ 0x80000000));
+    const __m256i c110000 = _mm256_set1_epi32 ((gint) (0x10ffff ^ 0x80000000));
+    __m256i acc = _mm256_setzero_si256 ();
+    guint32 lanes[8];
+    gsize i = 0, n;
+    gint j;
+
+    for (; i + 8 <= len; i += 8) {
+        __m256i v = _mm256_xor_si256 (
+            _mm256_loadu_si256 ((const __m256i *) (s + i)), bias);
+        acc = _mm256_sub_epi32 (acc, _mm256_cmpgt_epi32 (v, c80));
+        acc = _mm256_sub_epi32 (acc, _mm256_cmpgt_epi32 (v, c800));
+        acc = _mm256_sub_epi32 (acc, _mm256_cmpgt_epi32 (v, c10000));
+        acc = _mm256_add_epi32 (acc, _mm256_cmpgt_epi32 (v, c110000));
+    }
+    _mm256_storeu_si256 ((__m256i *) lanes, acc);
+    n = i;
+    for (j = 0; j < 8; j++)
+        n += lanes[j];
+    return n + ucs4_utf8_len_scalar (s + i, len - i);
+}
+
+__attribute__((target("avx2"))) static gsize
+ascii_to_ucs4_avx2 (const guchar *s, gsize len, gunichar *out)
+{
+    gsize i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128 ((const __m128i *) (s + i));
+
+        if (_mm_movemask_epi8 (v) != 0)
+            break;
+        _mm256_storeu_si256 ((__m256i *) (out + i),
+                             _mm256_cvtepu8_epi32 (v));
+        _mm256_storeu_si256 ((__m256i *) (out + i + 8),
+                             _mm256_cvtepu8_epi32 (_mm_srli_si128 (v, 8)));
+    }
+    return i + ascii_to_ucs4_scalar (s + i, len - i, out + i);
+}
+
+static const Utf8Kernels avx2_kernels = {
+    "avx2",
+    ascii_span_avx2,
+    count_starts_avx2,
+    ucs4_utf8_len_avx2,
+    ascii_to_ucs4_avx2,
+    ucs4_to_ascii_sse2
+};
+#endif  /* HAVE_UTF8_AVX2 */
+
+static const Utf8Kernels *
+utf8_kernels_lookup (const gchar *name)
+{
+    if (g_strcmp0 (name, "scalar") == 0)
+        return &scalar_kernels;
+#ifdef HAVE_UTF8_SSE2
+    if (g_strcmp0 (name, "sse2") == 0)
+        return &sse2_kernels;
+#endif  /* HAVE_UTF8_SSE2 */
+#ifdef HAVE_UTF8_AVX2
+    if (g_strcmp0 (name, "avx2") == 0) {
+        __builtin_cpu_init ();
+        if (__builtin_cpu_supports ("avx2"))
+            return &avx2_kernels;
+    }
+#endif  /* HAVE_UTF8_AVX2 */
+    return NULL;
+}
+
+static const Utf8Kernels *
+utf8_kernels_detect (void)
+{
+    const Utf8Kernels *kernels;
+
+    kernels = utf8_kernels_lookup (g_getenv ("IBUS_M17N_UTF8_KERNELS"));
+    if (kernels)
+        return kernels;
+
+    if ((kernels = utf8_kernels_lookup ("avx2")) != NULL ||
+        (kernels = utf8_kernels_lookup ("sse2")) != NULL)
+        return kernels;
+    return &scalar_kernels;
+}
+
+static const Utf8Kernels *utf8_kernels = NULL;
+
+static inline const Utf8Kernels *
+utf8_get_kernels (void)
+{
+    static gsize once = 0;
+
+    if (g_once_init_enter (&once)) {
+        utf8_kernels = utf8_kernels_detect ();
+        g_once_init_leave (&once, 1);
+    }
+    return utf8_kernels;
+}
+
+gboolean
+ibus_m17n_utf8_select_kernels (const gchar *name)
+{
+    const Utf8Kernels *kernels;
+
+    utf8_get_kernels ();
+    kernels = name ? utf8_kernels_lookup (name) : utf8_kernels_detect ();
+    if (kernels == NULL)
+        return FALSE;
+    utf8_kernels = kernels;
+    return TRUE;
+}
+
+const gchar *
+ibus_m17n_utf8_get_kernels (void)
+{
+    return utf8_get_kernels ()->name;
+}
+
+/* Validate one non-ASCII sequence at P, which has LEN bytes left.
+   Returns its length, or 0 if it is invalid or truncated. */
+static inline gsize
+utf8_validate_char (const guchar *p, gsize len)
+{
+    guchar c = p[0];
+
+    if (c >= 0xc2 && c <= 0xdf) {
+        if (len < 2 || (p[1] & 0xc0) != 0x80)
+            return 0;
+        return 2;
+    }
+    if (c >= 0xe0 && c <= 0xef) {
+        if (len < 3 || (p[1] & 0xc0) != 0x80 || (p[2] & 0xc0) != 0x80)
+            return 0;
+        if (c == 0xe0 && p[1] < 0xa0)   /* overlong */
+            return 0;
+        if (c == 0xed && p[1] >= 0xa0)  /* surrogate */
+            return 0;
+        return 3;
+    }
+    if (c >= 0xf0 && c <= 0xf4) {
+        if (len < 4 || (p[1] & 0xc0) != 0x80 || (p[2] & 0xc0) != 0x80 ||
+            (p[3] & 0xc0) != 0x80)
+            return 0;
+        if (c == 0xf0 && p[1] < 0x90)   /* overlong */
+            return 0;
+        if (c == 0xf4 && p[1] >= 0x90)  /* above U+10FFFF */
+            return 0;
+        return 4;
+    }
+    return 0;
+}
+
+/* Like g_utf8_validate() with a length, i.e. nul bytes are invalid. */
+gboolean
+ibus_m17n_utf8_validate (const gchar  *str,
+                         gsize         len,
+                         const gchar **end)
+{
+    const Utf8Kernels *kernels = utf8_get_kernels ();
+    const guchar *p = (const guchar *) str;
+    gsize i = 0;
+    gboolean valid = TRUE;
+
+    while (i < len) {
+        gsize n;
+
+        i += kernels->ascii_span (p + i, len - i);
+        if (i == len)
+            break;
+        n = utf8_validate_char (p + i, len - i);
+        if (n == 0) {
+            valid = FALSE;
+            break;
+        }
+        i += n;
+    }
+
+    if (end)
+        *end = str + i;
+    return valid;
+}
+
+/* The functions below expect valid UTF-8 or UCS-4, as their GLib
+   counterparts g_utf8_strlen(), g_utf8_offset_to_pointer(),
+   g_utf8_to_ucs4_fast() and g_ucs4_to_utf8() do.  Offsets must not be
+   negative, and results never point past STR + LEN. */
+glong
+ibus_m17n_utf8_strlen (const gchar *str,
+                       gsize        len)
+{
+    return utf8_get_kernels ()->count_starts ((const guchar *) str, len);
+}
+
+const gchar *
+ibus_m17n_utf8_offset_to_pointer (const gchar *str,
+                                  gsize        len,
+                                  glong        offset)
+{
+    const Utf8Kernels *kernels = utf8_get_kernels ();
+    const guchar *p = (const guchar *) str;
+    gsize i = 0;
+
+    /* skip whole blocks which end before the wanted character */
+    while (offset > 0 && len - i >= 64) {
+        gsize n = kernels->count_starts (p + i, 64);
+
+        if (n > (gsize) offset)
+            break;
+        offset -= n;
+        i += 64;
+    }
+
+    /* the block skip may stop in the middle of a character */
+    while (i < len && (p[i] & 0xc0) == 0x80)
+        i++;
+
+    for (; offset > 0 && i < len; offset--)
+        i = MIN (len, i + g_utf8_skip[p[i]]);
+
+    return str + i;
+}
+
+/* Steps back OFFSET characters from P, but not before STR, so the cost
+   grows with OFFSET and not with the distance of P from STR. */
+const gchar *
+ibus_m17n_utf8_rewind (const gchar *str,
+                       const gchar *p,
+                       glong        offset)
+{
+    const guchar *s = (const guchar *) str;
+    const guchar *q = (const guchar *) p;
+
+    for (; offset > 0 && q > s; offset--) {
+        q--;
+        while (q > s && (*q & 0xc0) == 0x80)
+            q--;
+    }
+    return (const gchar *) q;
+}
+
+gunichar *
+ibus_m17n_utf8_to_ucs4 (const gchar *str,
+                        gsize        len,
+                        glong       *items_written)
+{
+    const Utf8Kernels *kernels = utf8_get_kernels ();
+    const guchar *p = (const guchar *) str;
+    gunichar *ucs;
+    gsize i = 0, n = 0;
+
+    ucs = g_new (gunichar, kernels->count_starts (p, len) + 1);
+
+    while (i < len) {
+        gsize ascii = kernels->ascii_to_ucs4 (p + i, len - i, ucs + n);
+
+        i += ascii;
+        n += ascii;
+        if (i == len)
+            break;
+        ucs[n++] = g_utf8_get_char ((const gchar *) p + i);
+        i += g_utf8_skip[p[i]];
+    }
+    ucs[n] = 0;
+
+    if (items_written)
+        *items_written = n;
+    return ucs;
+}
+
+gsize
+ibus_m17n_ucs4_utf8_len (const gunichar *str,
+                         gsize           len)
+{
+    return utf8_get_kernels ()->ucs4_utf8_len (str, len);
+}
+
+gchar *
+ibus_m17n_ucs4_to_utf8 (const gunichar *str,
+                        gsize           len,
+                        glong          *items_written)
+{
+    const Utf8Kernels *kernels = utf8_get_kernels ();
+    gchar *buf;
+    gsize i = 0, n = 0;
+
+    buf = g_malloc (kernels->ucs4_utf8_len (str, len) + 1);
+
+    while (i < len) {
+        gsize ascii = kernels->ucs4_to_ascii (str + i, len - i,
+                                              (guchar *) buf + n);
+
+        i += ascii;
+        n += ascii;
+        if (i == len)
+            break;
+        /* characters outside Unicode, which m17n-lib may use, are
+           replaced as counted by ucs4_utf8_len */
+        if (str[i] > 0x10ffff)
+            n += g_unichar_to_utf8 (0xfffd, buf + n);
+        else
+            n += g_unichar_to_utf8 (str[i], buf + n);
+        i++;
+    }
+    buf[n] = 0;
+
+    if (items_written)
+        *items_written = n;
+    return buf;
+}
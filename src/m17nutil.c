@@ -5,18 +5,32 @@
 
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 #include "m17nutil.h"
 
 #define N_(text) text
 
-static MConverter *utf8_converter = NULL;
+/* The conversions to UTF-8 and UTF-32 only read the data and the
+   characters of an M-text, and leave the coding machinery of m17n-lib,
+   which is global and not reentrant, alone.  So they run in parallel
+   in any number of threads, without a lock, as long as each thread
+   converts M-texts of its own: reading the characters of an M-text
+   updates its position cache. */
+
+/* stands for keys that no MIM binds */
+static MSymbol unknown_key = NULL;
+
+/* the combinations of modifiers the keys of opened MIMs have, indexed
+   by ibus_m17n_key_name_modifiers() */
+static guint32 used_key_modifiers[128 / 32];
 
 #define DEFAULT_XML (SETUPDIR "/default.xml")
 
 typedef enum {
     ENGINE_CONFIG_RANK_MASK = 1 << 0,
     ENGINE_CONFIG_SYMBOL_MASK = 1 << 1,
-    ENGINE_CONFIG_PREEDIT_HIGHLIGHT_MASK = 1 << 2
+    ENGINE_CONFIG_PREEDIT_HIGHLIGHT_MASK = 1 << 2,
+    ENGINE_CONFIG_SHARD_MASK = 1 << 3
 } EngineConfigMask;
 
 struct _EngineConfigNode {
@@ -27,62 +41,219 @@ struct _EngineConfigNode {
 typedef struct _EngineConfigNode EngineConfigNode;
 
 static GSList *config_list = NULL;
+static gboolean config_loaded = FALSE;
+
+struct _IBusM17NCandidateIndex {
+    /* offsets[i] is the index of the first candidate of group i;
+       offsets[n_groups] is the total number of candidates */
+    GArray *offsets;
+    GPtrArray *groups;
+};
 
 void
 ibus_m17n_init_common (void)
 {
     M17N_INIT ();
 
-    if (utf8_converter == NULL) {
-        utf8_converter = mconv_buffer_converter (Mcoding_utf_8, NULL, 0);
-    }
+    if (unknown_key == NULL)
+        unknown_key = msymbol (" ibus-m17n-unknown-key");
+    /* keys without modifiers are always interned */
+    used_key_modifiers[0] |= 1;
 }
 
 gchar *
 ibus_m17n_mtext_to_utf8 (MText *text)
 {
-    gint bufsize;
+    enum MTextFormat format;
+    gint nunits;
+    gunichar *ucs;
+    gint len;
     gchar *buf;
+    void *data;
 
     if (text == NULL)
         return NULL;
 
-    mconv_reset_converter (utf8_converter);
+    /* M-texts stored as ASCII or UTF-8 are copied as they are, and
+       those stored as native UTF-32 are transcoded directly */
+    data = mtext_data (text, &format, &nunits, NULL, NULL);
+    if (format == MTEXT_FORMAT_US_ASCII || format == MTEXT_FORMAT_UTF_8) {
+        buf = (gchar *) g_malloc (nunits + 1);
+        memcpy (buf, data, nunits);
+        buf [nunits] = 0;
+        return buf;
+    }
+    if (format == MTEXT_FORMAT_UTF_32)
+        return ibus_m17n_ucs4_to_utf8 ((const gunichar *) data, nunits, NULL);
+
+    /* the other formats go through UTF-32; its encoder sizes the
+       buffer by the rules it encodes with, characters outside Unicode
+       included, so it cannot write past the end as mconv_encode could
+       with a size counted apart */
+    len = mtext_len (text);
+    ucs = g_new (gunichar, len);
+    ibus_m17n_mtext_get_ucs4 (text, 0, len, ucs);
+    buf = ibus_m17n_ucs4_to_utf8 (ucs, len, NULL);
+    g_free (ucs);
+
+    return buf;
+}
+
+IBusText *
+ibus_m17n_mtext_to_text (MText *text)
+{
+    IBusText *itext;
+    gchar *buf;
+
+    buf = ibus_m17n_mtext_to_utf8 (text);
+    if (buf == NULL)
+        return NULL;
 
-    bufsize = (mtext_len (text) + 1) * 6;
-    buf = (gchar *) g_malloc (bufsize);
+    /* hand the buffer over to the IBusText instead of copying it */
+    itext = g_object_new (IBUS_TYPE_TEXT, NULL);
+    itext->is_static = FALSE;
+    itext->text = buf;
 
-    mconv_rebind_buffer (utf8_converter, buf, bufsize);
-    mconv_encode (utf8_converter, text);
+    return itext;
+}
 
-    buf [utf8_converter->nbytes] = 0;
+gint
+ibus_m17n_mtext_get_ucs4 (MText    *text,
+                          gint      from,
+                          gint      to,
+                          gunichar *buf)
+{
+    enum MTextFormat format;
+    gint i;
+    void *data;
+
+    from = MAX (from, 0);
+    to = MIN (to, mtext_len (text));
+    if (from >= to)
+        return 0;
+
+    /* M-texts stored in native UTF-32 are copied as they are */
+    data = mtext_data (text, &format, NULL, NULL, NULL);
+    if (format == MTEXT_FORMAT_UTF_32) {
+        memcpy (buf, (gunichar *) data + from, (to - from) * sizeof (gunichar));
+        return to - from;
+    }
 
-    return buf;
+    for (i = from; i < to; i++)
+        buf[i - from] = mtext_ref_char (text, i);
+    return to - from;
 }
 
 gunichar *
 ibus_m17n_mtext_to_ucs4 (MText *text, glong *nchars)
 {
-    glong bufsize;
-    gchar *buf;
+    gint len;
     gunichar *ucs;
 
     if (text == NULL)
         return NULL;
 
-    mconv_reset_converter (utf8_converter);
+    len = mtext_len (text);
+    ucs = g_new (gunichar, len + 1);
+    ibus_m17n_mtext_get_ucs4 (text, 0, len, ucs);
+    ucs[len] = 0;
 
-    bufsize = (mtext_len (text) + 1) * 6;
-    buf = (gchar *) g_malloc (bufsize);
+    if (nchars)
+        *nchars = len;
+    return ucs;
+}
 
-    mconv_rebind_buffer (utf8_converter, buf, bufsize);
-    if (mconv_encode (utf8_converter, text) < 0) {
-        g_free (buf);
-        return NULL;
+IBusM17NCandidateIndex *
+ibus_m17n_candidate_index_new (MPlist *candidate_list)
+{
+    IBusM17NCandidateIndex *index;
+    MPlist *group;
+    gint offset = 0;
+
+    index = g_slice_new (IBusM17NCandidateIndex);
+    index->offsets = g_array_new (FALSE, FALSE, sizeof (gint));
+    index->groups = g_ptr_array_new ();
+
+    for (group = candidate_list;
+         group && mplist_key (group) != Mnil;
+         group = mplist_next (group)) {
+        g_array_append_val (index->offsets, offset);
+        g_ptr_array_add (index->groups, group);
+
+        if (mplist_key (group) == Mtext)
+            offset += mtext_len ((MText *) mplist_value (group));
+        else
+            offset += mplist_length ((MPlist *) mplist_value (group));
     }
-    ucs = g_utf8_to_ucs4_fast (buf, bufsize, nchars);
-    g_free (buf);
-    return ucs;
+    g_array_append_val (index->offsets, offset);
+
+    return index;
+}
+
+void
+ibus_m17n_candidate_index_free (IBusM17NCandidateIndex *index)
+{
+    g_array_free (index->offsets, TRUE);
+    g_ptr_array_free (index->groups, TRUE);
+    g_slice_free (IBusM17NCandidateIndex, index);
+}
+
+gint
+ibus_m17n_candidate_index_lookup (IBusM17NCandidateIndex *index,
+                                  gint                    candidate_index,
+                                  gint                   *group_start,
+                                  gint                   *group_len)
+{
+    const gint *offsets = (const gint *) index->offsets->data;
+    gint lo = 0, hi = index->groups->len;
+
+    if (candidate_index < 0 || candidate_index >= offsets[hi])
+        return -1;
+
+    /* find the last group whose first candidate is <= candidate_index */
+    while (hi - lo > 1) {
+        gint mid = lo + (hi - lo) / 2;
+
+        if (offsets[mid] <= candidate_index)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    if (group_start)
+        *group_start = offsets[lo];
+    if (group_len)
+        *group_len = offsets[lo + 1] - offsets[lo];
+    return lo;
+}
+
+MPlist *
+ibus_m17n_candidate_index_get_group (IBusM17NCandidateIndex *index,
+                                     gint                    group)
+{
+    g_return_val_if_fail (group >= 0 && (guint) group < index->groups->len, NULL);
+    return (MPlist *) g_ptr_array_index (index->groups, group);
+}
+
+void
+ibus_m17n_candidate_index_get_group_range (IBusM17NCandidateIndex *index,
+                                           gint                    group,
+                                           gint                   *group_start,
+                                           gint                   *group_len)
+{
+    const gint *offsets = (const gint *) index->offsets->data;
+
+    g_return_if_fail (group >= 0 && (guint) group < index->groups->len);
+    if (group_start)
+        *group_start = offsets[group];
+    if (group_len)
+        *group_len = offsets[group + 1] - offsets[group];
+}
+
+gint
+ibus_m17n_candidate_index_get_n_groups (IBusM17NCandidateIndex *index)
+{
+    return index->groups->len;
 }
 
 guint
@@ -270,6 +441,8 @@ ibus_m17n_get_engine_config (const gchar *engine_name)
                 config->symbol = cnode->config.symbol;
             if (cnode->mask & ENGINE_CONFIG_PREEDIT_HIGHLIGHT_MASK)
                 config->preedit_highlight = cnode->config.preedit_highlight;
+            if (cnode->mask & ENGINE_CONFIG_SHARD_MASK)
+                config->shard = cnode->config.shard;
         }
     }
     return config;
@@ -314,20 +487,108 @@ ibus_m17n_engine_config_parse_xml_node (EngineConfigNode *cnode,
             cnode->mask |= ENGINE_CONFIG_PREEDIT_HIGHLIGHT_MASK;
             continue;
         }
+        if (g_strcmp0 (sub_node->name , "shard") == 0) {
+            /* an empty element puts the engine back in the default
+               process */
+            cnode->config.shard = sub_node->text && *sub_node->text ?
+                g_strdup (sub_node->text) : NULL;
+            cnode->mask |= ENGINE_CONFIG_SHARD_MASK;
+            continue;
+        }
         g_warning ("<engine> element contains invalid element <%s>",
                    sub_node->name);
     }
     return TRUE;
 }
 
+static void
+ibus_m17n_engine_config_node_free (EngineConfigNode *cnode)
+{
+    g_free (cnode->name);
+    g_free (cnode->config.symbol);
+    g_free (cnode->config.shard);
+    g_slice_free (EngineConfigNode, cnode);
+}
+
+/* Replace the engine defaults with those in FILENAME, which is in the
+   format of default.xml, or with the installed default.xml if
+   FILENAME is NULL.  Configs returned by ibus_m17n_get_engine_config
+   must be freed before. */
+gboolean
+ibus_m17n_load_engine_config (const gchar *filename)
+{
+    XMLNode *node;
+    GList *p;
+
+    if (filename == NULL)
+        filename = DEFAULT_XML;
+    config_loaded = TRUE;
+
+    g_slist_free_full (config_list,
+                       (GDestroyNotify) ibus_m17n_engine_config_node_free);
+    config_list = NULL;
+
+    node = ibus_xml_parse_file (filename);
+    if (node == NULL || g_strcmp0 (node->name, "engines") != 0) {
+        g_warning ("failed to parse %s", filename);
+        if (node)
+            ibus_xml_free (node);
+        return FALSE;
+    }
+
+    for (p = node->sub_nodes; p != NULL; p = p->next) {
+        XMLNode *sub_node = p->data;
+        EngineConfigNode *cnode;
+
+        if (g_strcmp0 (sub_node->name, "engine") != 0) {
+            g_warning ("<engines> element contains invalid element <%s>",
+                       sub_node->name);
+            continue;
+        }
+
+        cnode = g_slice_new0 (EngineConfigNode);
+        if (!ibus_m17n_engine_config_parse_xml_node (cnode, sub_node)) {
+            ibus_m17n_engine_config_node_free (cnode);
+            continue;
+        }
+        config_list = g_slist_prepend (config_list, cnode);
+    }
+    config_list = g_slist_reverse (config_list);
+    ibus_xml_free (node);
+
+    return TRUE;
+}
+
 IBusComponent *
 ibus_m17n_get_component (void)
+{
+    return ibus_m17n_get_component_for_shard (NULL);
+}
+
+/* Return the name of the component serving SHARD, or the default
+   component if SHARD is NULL. */
+gchar *
+ibus_m17n_get_component_name (const gchar *shard)
+{
+    if (shard)
+        return g_strdup_printf ("org.freedesktop.IBus.M17n.%s", shard);
+    return g_strdup ("org.freedesktop.IBus.M17n");
+}
+
+/* Return the component of the process serving SHARD, i.e. with the
+   engines whose <shard> in default.xml is SHARD, or with no <shard>
+   if SHARD is NULL.  default.xml is loaded unless engine defaults have
+   been loaded already. */
+IBusComponent *
+ibus_m17n_get_component_for_shard (const gchar *shard)
 {
     GList *engines, *p;
     IBusComponent *component;
-    XMLNode *node;
+    gchar *component_name;
+
+    component_name = ibus_m17n_get_component_name (shard);
 
-    component = ibus_component_new ("org.freedesktop.IBus.M17n",
+    component = ibus_component_new (component_name,
                                     N_("M17N"),
                                     "0.1.0",
                                     "GPL",
@@ -335,38 +596,270 @@ ibus_m17n_get_component (void)
                                     "http://code.google.com/p/ibus/",
                                     "",
                                     "ibus-m17n");
+    g_free (component_name);
 
-    node = ibus_xml_parse_file (DEFAULT_XML);
-    if (node && g_strcmp0 (node->name, "engines") == 0) {
-        for (p = node->sub_nodes; p != NULL; p = p->next) {
-            XMLNode *sub_node = p->data;
-            EngineConfigNode *cnode;
+    if (!config_loaded)
+        ibus_m17n_load_engine_config (NULL);
 
-            if (g_strcmp0 (sub_node->name, "engine") != 0) {
-                g_warning ("<engines> element contains invalid element <%s>",
-                           sub_node->name);
-                continue;
-            }
+    engines = ibus_m17n_list_engines ();
 
-            cnode = g_slice_new0 (EngineConfigNode);
-            if (!ibus_m17n_engine_config_parse_xml_node (cnode, sub_node)) {
-                g_slice_free (EngineConfigNode, cnode);
-                continue;
+    for (p = engines; p != NULL; p = p->next) {
+        IBusEngineDesc *engine = p->data;
+#if IBUS_CHECK_VERSION(1,3,99)
+        const gchar *engine_name = ibus_engine_desc_get_name (engine);
+#else
+        const gchar *engine_name = engine->name;
+#endif  /* !IBUS_CHECK_VERSION(1,3,99) */
+        IBusM17NEngineConfig *config;
+
+        config = ibus_m17n_get_engine_config (engine_name);
+        if (g_strcmp0 (config->shard, shard) == 0)
+            ibus_component_add_engine (component, engine);
+        else
+            g_object_unref (g_object_ref_sink (engine));
+        ibus_m17n_engine_config_free (config);
+    }
+
+    g_list_free (engines);
+
+    return component;
+}
+
+/* Note on AltGr (Level3 Shift) handling: While currently we expect
+   AltGr == mod5, it would be better to not expect the modifier always
+   be assigned to particular modX.  However, it needs some code like:
+
+   KeyCode altgr = XKeysymToKeycode (display, XK_ISO_Level3_Shift);
+   XModifierKeymap *mods = XGetModifierMapping (display);
+   for (i = 3; i < 8; i++)
+     for (j = 0; j < mods->max_keypermod; j++) {
+       KeyCode code = mods->modifiermap[i * mods->max_keypermod + j];
+       if (code == altgr)
+         ...
+     }
+                
+   Since IBus engines are supposed to be cross-platform, the code
+   should go into IBus core, instead of ibus-m17n. */
+gchar *
+ibus_m17n_key_event_to_name (guint keycode,
+                             guint keyval,
+                             guint modifiers)
+{
+    GString *keysym;
+    guint mask = 0;
+    IBusKeymap *keymap;
+
+    if (keyval >= IBUS_Shift_L && keyval <= IBUS_Hyper_R) {
+        return NULL;
+    }
+
+    /* Here, keyval is already translated by IBUS_MOD5_MASK.  Obtain
+       the untranslated keyval from the underlying keymap and
+       represent the translated keyval as the form "G-<untranslated
+       keyval>", which m17n-lib accepts. */
+    if (modifiers & IBUS_MOD5_MASK) {
+        keymap = ibus_keymap_get ("us");
+        keyval = ibus_keymap_lookup_keysym (keymap, keycode,
+                                            modifiers & ~IBUS_MOD5_MASK);
+        g_object_unref (keymap);
+    }
+
+    keysym = g_string_new ("");
+
+    if (keyval >= IBUS_space && keyval <= IBUS_asciitilde) {
+        gint c = keyval;
+
+        if (keyval == IBUS_space && modifiers & IBUS_SHIFT_MASK)
+            mask |= IBUS_SHIFT_MASK;
+
+        if (modifiers & IBUS_CONTROL_MASK) {
+            if (c >= IBUS_a && c <= IBUS_z)
+                c += IBUS_A - IBUS_a;
+            mask |= IBUS_CONTROL_MASK;
+        }
+
+        g_string_append_c (keysym, c);
+    }
+    else {
+        mask |= modifiers & (IBUS_CONTROL_MASK | IBUS_SHIFT_MASK);
+        g_string_append (keysym, ibus_keyval_name (keyval));
+        if (keysym->len == 0) {
+            g_string_free (keysym, TRUE);
+            return NULL;
+        }
+    }
+
+    mask |= modifiers & (IBUS_MOD1_MASK |
+                         IBUS_MOD5_MASK |
+                         IBUS_META_MASK |
+                         IBUS_SUPER_MASK |
+                         IBUS_HYPER_MASK);
+
+
+    if (mask & IBUS_HYPER_MASK) {
+        g_string_prepend (keysym, "H-");
+    }
+    if (mask & IBUS_SUPER_MASK) {
+        g_string_prepend (keysym, "s-");
+    }
+    if (mask & IBUS_MOD5_MASK) {
+        g_string_prepend (keysym, "G-");
+    }
+    if (mask & IBUS_MOD1_MASK) {
+        g_string_prepend (keysym, "A-");
+    }
+    if (mask & IBUS_META_MASK) {
+        g_string_prepend (keysym, "M-");
+    }
+    if (mask & IBUS_CONTROL_MASK) {
+        g_string_prepend (keysym, "C-");
+    }
+    if (mask & IBUS_SHIFT_MASK) {
+        g_string_prepend (keysym, "S-");
+    }
+
+    return g_string_free (keysym, FALSE);
+}
+
+/* Return the combination of modifiers of the m17n key NAME, as a
+   number below 128 which is 0 for a key without modifiers. */
+guint
+ibus_m17n_key_name_modifiers (const gchar *name)
+{
+    static const gchar prefixes[] = "SCMAGsH";
+    const gchar *p, *prefix;
+    guint mods = 0;
+
+    for (p = name; p[0] != '\0' && p[1] == '-' && p[2] != '\0'; p += 2) {
+        prefix = strchr (prefixes, p[0]);
+        if (prefix == NULL)
+            break;
+        mods |= 1 << (prefix - prefixes);
+    }
+    return mods;
+}
+
+static void ibus_m17n_note_im_keys (MSymbol lang,
+                                    MSymbol name,
+                                    MSymbol extra,
+                                    gint    depth);
+
+static void
+ibus_m17n_scan_key_modifiers (MPlist *plist,
+                              gint    depth)
+{
+    MPlist *sub;
+    guint mods;
+
+    for (; plist != NULL && mplist_key (plist) != Mnil;
+         plist = mplist_next (plist)) {
+        if (mplist_key (plist) == Msymbol) {
+            mods = ibus_m17n_key_name_modifiers (
+                msymbol_name ((MSymbol) mplist_value (plist)));
+            used_key_modifiers[mods / 32] |= 1U << (mods % 32);
+        }
+        else if (mplist_key (plist) == Mplist) {
+            sub = (MPlist *) mplist_value (plist);
+            /* (include (LANG NAME ...) ...) takes in keys of another MIM */
+            if (mplist_key (sub) == Msymbol &&
+                mplist_value (sub) == msymbol ("include") &&
+                mplist_key (mplist_next (sub)) == Mplist) {
+                MPlist *tags = mplist_value (mplist_next (sub));
+                MSymbol tag[3] = { Mnil, Mnil, Mnil };
+                gint i;
+
+                for (i = 0; i < 3 && mplist_key (tags) == Msymbol; i++) {
+                    tag[i] = mplist_value (tags);
+                    tags = mplist_next (tags);
+                }
+                if (depth < 8)
+                    ibus_m17n_note_im_keys (tag[0], tag[1], tag[2],
+                                            depth + 1);
             }
-            config_list = g_slist_prepend (config_list, cnode);
+            ibus_m17n_scan_key_modifiers (sub, depth);
         }
-        config_list = g_slist_reverse (config_list);
-    } else
-        g_warning ("failed to parse %s", DEFAULT_XML);
-    if (node)
-        ibus_xml_free (node);
+    }
+}
 
-    engines = ibus_m17n_list_engines ();
+/* Note the combinations of modifiers the keys of the MIM LANG NAME
+   EXTRA have, before it is opened. */
+static void
+ibus_m17n_note_im_keys (MSymbol lang,
+                        MSymbol name,
+                        MSymbol extra,
+                        gint    depth)
+{
+    MDatabase *mdb;
+    MPlist *plist;
+
+    mdb = mdatabase_find (Minput_method, lang, name, extra);
+    if (mdb == NULL || (plist = mdatabase_load (mdb)) == NULL)
+        return;
+    ibus_m17n_scan_key_modifiers (plist, depth);
+    m17n_object_unref (plist);
+}
 
-    for (p = engines; p != NULL; p = p->next)
-        ibus_component_add_engine (component, p->data);
+/* Open the MIM LANG NAME like minput_open_im(), and let
+   ibus_m17n_key_event_to_symbol() intern the keys with the modifiers
+   it binds keys with. */
+MInputMethod *
+ibus_m17n_open_im (MSymbol lang,
+                   MSymbol name)
+{
+    /* every MIM takes in the commands of the global one */
+    ibus_m17n_note_im_keys (Mt, Mnil, msymbol ("global"), 0);
+    ibus_m17n_note_im_keys (lang, name, Mnil, 0);
+    return minput_open_im (lang, name, NULL);
+}
 
-    g_list_free (engines);
+MSymbol
+ibus_m17n_key_event_to_symbol (guint keycode,
+                               guint keyval,
+                               guint modifiers)
+{
+    gchar *name;
+    MSymbol mkeysym;
+    guint mods;
+
+    name = ibus_m17n_key_event_to_name (keycode, keyval, modifiers);
+    if (name == NULL)
+        return Mnil;
+
+    /* m17n symbols are never freed.  Keysym names are a bounded set,
+       and so are their combinations with the modifiers opened MIMs
+       bind keys with.  The names of unnamed keyvals and the other
+       combinations are not, and are only interned if something did
+       already, since no binding can match them otherwise. */
+    mods = ibus_m17n_key_name_modifiers (name);
+    if (g_str_has_prefix (name, "0x") ||
+        g_str_has_prefix (name, "U+") ||
+        (used_key_modifiers[mods / 32] & (1U << (mods % 32))) == 0) {
+        mkeysym = msymbol_exist (name);
+        if (mkeysym == Mnil)
+            mkeysym = unknown_key;
+    }
+    else
+        mkeysym = msymbol (name);
+    g_free (name);
 
-    return component;
+    return mkeysym;
+}
+
+/* Return the resident set size of the process in bytes, or 0 if it
+   cannot be determined. */
+gsize
+ibus_m17n_get_rss (void)
+{
+    gchar *contents = NULL;
+    gsize rss = 0;
+
+    if (g_file_get_contents ("/proc/self/statm", &contents, NULL, NULL)) {
+        gchar **fields = g_strsplit (contents, " ", 3);
+
+        if (g_strv_length (fields) >= 2)
+            rss = g_ascii_strtoull (fields[1], NULL, 10) * sysconf (_SC_PAGESIZE);
+        g_strfreev (fields);
+        g_free (contents);
+    }
+    return rss;
 }
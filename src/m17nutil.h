@@ -9,6 +9,7 @@
 /* default configuration */
 #define PREEDIT_FOREGROUND 0x00000000
 #define PREEDIT_BACKGROUND 0x00c8c8f0
+#define LOOKUP_TABLE_PAGE_SIZE 10
 
 struct _IBusM17NEngineConfig {
     /* engine rank */
@@ -19,19 +20,210 @@ struct _IBusM17NEngineConfig {
 
     /* whether to highlight preedit */
     gboolean preedit_highlight;
+
+    /* process serving the engine, NULL for the default one */
+    gchar *shard;
 };
 
 typedef struct _IBusM17NEngineConfig IBusM17NEngineConfig;
 
+/* prefix-sum index over the candidate groups of an m17n candidate list */
+typedef struct _IBusM17NCandidateIndex IBusM17NCandidateIndex;
+
+/* persistent record of engine usage; see m17nhistory.c */
+typedef struct _IBusM17NHistory IBusM17NHistory;
+
+/* priorities of the scheduler; see m17nsched.c */
+typedef enum {
+    IBUS_M17N_TASK_UI,
+    IBUS_M17N_TASK_BACKGROUND
+} IBusM17NTaskPriority;
+
+typedef gboolean (*IBusM17NTaskFunc) (gpointer user_data);
+
+/* worker thread fed through a lock-free ring; see m17nworker.c */
+typedef struct _IBusM17NWorker IBusM17NWorker;
+
+typedef void (*IBusM17NWorkerFunc) (gpointer user_data);
+
+/* log-linear histogram of latencies; see m17nstats.c */
+#define IBUS_M17N_HISTOGRAM_N_BUCKETS 272
+
+typedef struct _IBusM17NHistogram IBusM17NHistogram;
+
+struct _IBusM17NHistogram {
+    guint64 count;
+    guint64 sum;
+    guint64 max;
+    guint32 buckets[IBUS_M17N_HISTOGRAM_N_BUCKETS];
+};
+
+/* binary traces of engine events; see m17ntrace.c */
+typedef struct _IBusM17NTraceWriter IBusM17NTraceWriter;
+typedef struct _IBusM17NTraceReader IBusM17NTraceReader;
+
+typedef enum {
+    IBUS_M17N_TRACE_KEY,
+    IBUS_M17N_TRACE_FOCUS_IN,
+    IBUS_M17N_TRACE_FOCUS_OUT,
+    IBUS_M17N_TRACE_RESET,
+    IBUS_M17N_TRACE_PAGE_UP,
+    IBUS_M17N_TRACE_PAGE_DOWN,
+    IBUS_M17N_TRACE_CURSOR_UP,
+    IBUS_M17N_TRACE_CURSOR_DOWN
+} IBusM17NTraceEventType;
+
+typedef struct _IBusM17NTraceEvent IBusM17NTraceEvent;
+
+struct _IBusM17NTraceEvent {
+    IBusM17NTraceEventType type;
+    /* microseconds, in g_get_monotonic_time terms when written and
+       since the first event when read */
+    gint64 time;
+    const gchar *engine_name;
+    /* key events only */
+    guint keyval;
+    guint keycode;
+    guint modifiers;
+    gboolean handled;
+};
+
 void           ibus_m17n_init_common       (void);
-void           ibus_m17n_init              (IBusBus     *bus);
+void           ibus_m17n_init              (IBusBus     *bus,
+                                            const gchar *shard);
 GList         *ibus_m17n_list_engines      (void);
 IBusComponent *ibus_m17n_get_component     (void);
+gchar         *ibus_m17n_get_component_name
+                                           (const gchar *shard);
+IBusComponent *ibus_m17n_get_component_for_shard
+                                           (const gchar *shard);
+gboolean       ibus_m17n_load_engine_config
+                                           (const gchar *filename);
 gchar         *ibus_m17n_mtext_to_utf8     (MText       *text);
+IBusText      *ibus_m17n_mtext_to_text     (MText       *text);
 gunichar      *ibus_m17n_mtext_to_ucs4     (MText       *text,
                                             glong       *nchars);
+gint           ibus_m17n_mtext_get_ucs4    (MText       *text,
+                                            gint         from,
+                                            gint         to,
+                                            gunichar    *buf);
 guint          ibus_m17n_parse_color       (const gchar *hex);
+MSymbol        ibus_m17n_key_event_to_symbol
+                                           (guint        keycode,
+                                            guint        keyval,
+                                            guint        modifiers);
+gchar         *ibus_m17n_key_event_to_name (guint        keycode,
+                                            guint        keyval,
+                                            guint        modifiers);
+guint          ibus_m17n_key_name_modifiers
+                                           (const gchar *name);
+MInputMethod  *ibus_m17n_open_im           (MSymbol      lang,
+                                            MSymbol      name);
+gsize          ibus_m17n_get_rss           (void);
+
+/* UTF-8 kernels; see m17nutf8.c */
+gboolean       ibus_m17n_utf8_validate     (const gchar *str,
+                                            gsize        len,
+                                            const gchar **end);
+glong          ibus_m17n_utf8_strlen       (const gchar *str,
+                                            gsize        len);
+const gchar   *ibus_m17n_utf8_offset_to_pointer
+                                           (const gchar *str,
+                                            gsize        len,
+                                            glong        offset);
+const gchar   *ibus_m17n_utf8_rewind       (const gchar *str,
+                                            const gchar *p,
+                                            glong        offset);
+gunichar      *ibus_m17n_utf8_to_ucs4      (const gchar *str,
+                                            gsize        len,
+                                            glong       *items_written);
+gsize          ibus_m17n_ucs4_utf8_len     (const gunichar *str,
+                                            gsize        len);
+gchar         *ibus_m17n_ucs4_to_utf8      (const gunichar *str,
+                                            gsize        len,
+                                            glong       *items_written);
+gboolean       ibus_m17n_utf8_select_kernels
+                                           (const gchar *name);
+const gchar   *ibus_m17n_utf8_get_kernels  (void);
 IBusM17NEngineConfig
               *ibus_m17n_get_engine_config (const gchar *engine_name);
 void           ibus_m17n_engine_config_free (IBusM17NEngineConfig *config);
+
+IBusM17NCandidateIndex
+              *ibus_m17n_candidate_index_new
+                                           (MPlist      *candidate_list);
+void           ibus_m17n_candidate_index_free
+                                           (IBusM17NCandidateIndex *index);
+gint           ibus_m17n_candidate_index_lookup
+                                           (IBusM17NCandidateIndex *index,
+                                            gint         candidate_index,
+                                            gint        *group_start,
+                                            gint        *group_len);
+MPlist        *ibus_m17n_candidate_index_get_group
+                                           (IBusM17NCandidateIndex *index,
+                                            gint         group);
+void           ibus_m17n_candidate_index_get_group_range
+                                           (IBusM17NCandidateIndex *index,
+                                            gint         group,
+                                            gint        *group_start,
+                                            gint        *group_len);
+gint           ibus_m17n_candidate_index_get_n_groups
+                                           (IBusM17NCandidateIndex *index);
+
+IBusM17NHistory
+              *ibus_m17n_history_new       (const gchar *filename);
+void           ibus_m17n_history_free      (IBusM17NHistory *history);
+void           ibus_m17n_history_record    (IBusM17NHistory *history,
+                                            const gchar *engine_name);
+gchar        **ibus_m17n_history_get_top   (IBusM17NHistory *history,
+                                            guint        n);
+gchar         *ibus_m17n_history_get_next  (IBusM17NHistory *history,
+                                            const gchar *engine_name);
+gboolean       ibus_m17n_history_save      (IBusM17NHistory *history,
+                                            GError     **error);
+
+guint          ibus_m17n_scheduler_add     (IBusM17NTaskPriority priority,
+                                            IBusM17NTaskFunc func,
+                                            gpointer     user_data,
+                                            GDestroyNotify destroy);
+void           ibus_m17n_scheduler_remove  (guint        id);
+void           ibus_m17n_scheduler_set_budget
+                                           (gint64       usec);
+void           ibus_m17n_scheduler_block   (void);
+void           ibus_m17n_scheduler_unblock (void);
+
+IBusM17NWorker
+              *ibus_m17n_worker_new        (guint        capacity);
+void           ibus_m17n_worker_free       (IBusM17NWorker *worker);
+gboolean       ibus_m17n_worker_push       (IBusM17NWorker *worker,
+                                            IBusM17NWorkerFunc func,
+                                            GSourceFunc  done,
+                                            gpointer     user_data);
+gboolean       ibus_m17n_worker_wait       (IBusM17NWorker *worker,
+                                            gint64       end_time);
+
+void           ibus_m17n_histogram_add     (IBusM17NHistogram *histogram,
+                                            guint64      value);
+guint64        ibus_m17n_histogram_get_percentile
+                                           (const IBusM17NHistogram *histogram,
+                                            gdouble      percentile);
+GVariant      *ibus_m17n_histogram_serialize
+                                           (const IBusM17NHistogram *histogram);
+guint64        ibus_m17n_stats_now         (void);
+
+IBusM17NTraceWriter
+              *ibus_m17n_trace_writer_new  (const gchar *filename,
+                                            gboolean     scramble,
+                                            GError     **error);
+void           ibus_m17n_trace_writer_free (IBusM17NTraceWriter *writer);
+void           ibus_m17n_trace_writer_add  (IBusM17NTraceWriter *writer,
+                                            const IBusM17NTraceEvent *event,
+                                            gboolean     flush);
+IBusM17NTraceReader
+              *ibus_m17n_trace_reader_new  (const gchar *filename,
+                                            GError     **error);
+void           ibus_m17n_trace_reader_free (IBusM17NTraceReader *reader);
+gboolean       ibus_m17n_trace_reader_next (IBusM17NTraceReader *reader,
+                                            IBusM17NTraceEvent *event,
+                                            GError     **error);
 #endif
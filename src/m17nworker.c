@@ -0,0 +1,189 @@
+/* vim:set et sts=4: */
+/* Worker thread fed through a single-producer single-consumer ring.
+
+   The thread which creates the worker is the only producer; the
+   worker thread is the only consumer.  Slots are handed over with
+   atomic head and tail counters.  The mutex and condition are only
+   taken when the worker parks on an empty ring, or someone waits for
+   it to become idle: each side stores its own flag, then loads the
+   other side's counter, and those sequentially consistent accesses
+   make sure that at least one of them sees the other and goes
+   through the mutex. */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "m17nutil.h"
+
+typedef struct _IBusM17NWorkerSlot IBusM17NWorkerSlot;
+
+struct _IBusM17NWorkerSlot {
+    IBusM17NWorkerFunc func;
+    GSourceFunc done;
+    gpointer user_data;
+};
+
+struct _IBusM17NWorker {
+    GThread *thread;
+    IBusM17NWorkerSlot *slots;
+    guint mask;
+
+    /* number of slots pushed and taken; only the producer writes
+       tail and only the worker writes head */
+    volatile gint head;
+    volatile gint tail;
+    /* number of slots whose function has returned */
+    volatile gint completed;
+
+    /* set by the worker before it parks, and counting the threads in
+       ibus_m17n_worker_wait */
+    volatile gint sleeping;
+    volatile gint waiting;
+
+    GMutex lock;
+    GCond cond;
+    gboolean quit;
+};
+
+static gpointer
+ibus_m17n_worker_thread (gpointer data)
+{
+    IBusM17NWorker *worker = data;
+
+    for (;;) {
+        IBusM17NWorkerSlot slot;
+        gint head = g_atomic_int_get (&worker->head);
+
+        if (head == g_atomic_int_get (&worker->tail)) {
+            g_atomic_int_set (&worker->sleeping, TRUE);
+            if (head == g_atomic_int_get (&worker->tail)) {
+                g_mutex_lock (&worker->lock);
+                while (!worker->quit &&
+                       head == g_atomic_int_get (&worker->tail))
+                    g_cond_wait (&worker->cond, &worker->lock);
+                if (worker->quit &&
+                    head == g_atomic_int_get (&worker->tail)) {
+                    g_mutex_unlock (&worker->lock);
+                    break;
+                }
+                g_mutex_unlock (&worker->lock);
+            }
+            g_atomic_int_set (&worker->sleeping, FALSE);
+        }
+
+        slot = worker->slots[head & worker->mask];
+        /* free the slot before running it, so that the producer can
+           push the next request meanwhile */
+        g_atomic_int_set (&worker->head, head + 1);
+
+        slot.func (slot.user_data);
+
+        g_atomic_int_inc (&worker->completed);
+        if (g_atomic_int_get (&worker->waiting) > 0) {
+            g_mutex_lock (&worker->lock);
+            g_cond_broadcast (&worker->cond);
+            g_mutex_unlock (&worker->lock);
+        }
+
+        if (slot.done)
+            g_main_context_invoke (NULL, slot.done, slot.user_data);
+    }
+
+    return NULL;
+}
+
+/* Start a worker thread with a ring of CAPACITY slots, rounded up to
+   a power of two. */
+IBusM17NWorker *
+ibus_m17n_worker_new (guint capacity)
+{
+    IBusM17NWorker *worker = g_slice_new0 (IBusM17NWorker);
+    guint size = 1;
+
+    while (size < capacity)
+        size <<= 1;
+
+    worker->slots = g_new0 (IBusM17NWorkerSlot, size);
+    worker->mask = size - 1;
+    g_mutex_init (&worker->lock);
+    g_cond_init (&worker->cond);
+
+    worker->thread = g_thread_new ("ibus-m17n-worker",
+                                   ibus_m17n_worker_thread,
+                                   worker);
+    return worker;
+}
+
+/* Run the pushed requests, then stop and free WORKER. */
+void
+ibus_m17n_worker_free (IBusM17NWorker *worker)
+{
+    g_mutex_lock (&worker->lock);
+    worker->quit = TRUE;
+    g_cond_broadcast (&worker->cond);
+    g_mutex_unlock (&worker->lock);
+
+    g_thread_join (worker->thread);
+
+    g_mutex_clear (&worker->lock);
+    g_cond_clear (&worker->cond);
+    g_free (worker->slots);
+    g_slice_free (IBusM17NWorker, worker);
+}
+
+/* Have FUNC called with USER_DATA on the worker thread, and DONE, if
+   not NULL, in the default main context afterwards.  Returns FALSE if
+   the ring is full. */
+gboolean
+ibus_m17n_worker_push (IBusM17NWorker    *worker,
+                       IBusM17NWorkerFunc func,
+                       GSourceFunc        done,
+                       gpointer           user_data)
+{
+    gint tail = g_atomic_int_get (&worker->tail);
+    IBusM17NWorkerSlot *slot;
+
+    if (tail - g_atomic_int_get (&worker->head) > (gint) worker->mask)
+        return FALSE;
+
+    slot = &worker->slots[tail & worker->mask];
+    slot->func = func;
+    slot->done = done;
+    slot->user_data = user_data;
+    g_atomic_int_set (&worker->tail, tail + 1);
+
+    if (g_atomic_int_get (&worker->sleeping)) {
+        g_mutex_lock (&worker->lock);
+        g_cond_broadcast (&worker->cond);
+        g_mutex_unlock (&worker->lock);
+    }
+
+    return TRUE;
+}
+
+/* Wait until every pushed function has returned, or until
+   END_TIME (in g_get_monotonic_time terms; -1 for no limit).  Returns
+   whether the worker is idle. */
+gboolean
+ibus_m17n_worker_wait (IBusM17NWorker *worker,
+                       gint64          end_time)
+{
+    gboolean idle;
+
+    g_atomic_int_inc (&worker->waiting);
+    g_mutex_lock (&worker->lock);
+    while (!(idle = g_atomic_int_get (&worker->completed) ==
+                    g_atomic_int_get (&worker->tail))) {
+        if (end_time < 0)
+            g_cond_wait (&worker->cond, &worker->lock);
+        else if (!g_cond_wait_until (&worker->cond, &worker->lock, end_time))
+            break;
+    }
+    if (!idle)
+        idle = g_atomic_int_get (&worker->completed) ==
+               g_atomic_int_get (&worker->tail);
+    g_mutex_unlock (&worker->lock);
+    g_atomic_int_add (&worker->waiting, -1);
+
+    return idle;
+}
@@ -7,21 +7,29 @@
 #include <locale.h>
 #include <m17n.h>
 #include "engine.h"
+#include "debug.h"
 #include "m17nutil.h"
+#include "probes.h"
 
 static IBusBus *bus = NULL;
 static IBusFactory *factory = NULL;
 
 /* options */
 static gboolean xml = FALSE;
+static gboolean component_xml = FALSE;
 static gboolean ibus = FALSE;
 static gboolean verbose = FALSE;
+static gchar *shard = NULL;
+static gboolean dump_stats = FALSE;
 
 static const GOptionEntry entries[] =
 {
     { "xml", 'x', 0, G_OPTION_ARG_NONE, &xml, "generate xml for engines", NULL },
+    { "component", 'c', 0, G_OPTION_ARG_NONE, &component_xml, "generate the component xml of the shard", NULL },
     { "ibus", 'i', 0, G_OPTION_ARG_NONE, &ibus, "component is executed by ibus", NULL },
     { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "verbose", NULL },
+    { "dump-stats", 'd', 0, G_OPTION_ARG_NONE, &dump_stats, "print the statistics of the running component", NULL },
+    { "shard", 's', 0, G_OPTION_ARG_STRING, &shard, "serve the engines of shard NAME only", "NAME" },
     { NULL },
 };
 
@@ -35,22 +43,36 @@ ibus_disconnected_cb (IBusBus  *bus,
 }
 
 
+/* the bus name of the component serving shard */
+static gchar *
+get_bus_name (void)
+{
+    if (shard)
+        return ibus_m17n_get_component_name (shard);
+    return g_strdup ("org.freedesktop.IBus.M17N");
+}
+
 static void
 start_component (void)
 {
     GList *engines, *p;
     IBusComponent *component;
 
+    IBUS_M17N_PROBE1 (startup, "init");
     ibus_init ();
 
     bus = ibus_bus_new ();
     g_signal_connect (bus, "disconnected", G_CALLBACK (ibus_disconnected_cb), NULL);
-    ibus_m17n_init (bus);
+    ibus_m17n_init (bus, shard);
 
-    component = ibus_m17n_get_component ();
+    IBUS_M17N_PROBE1 (startup, "component");
+    component = ibus_m17n_get_component_for_shard (shard);
 
+    IBUS_M17N_PROBE1 (startup, "factory");
     factory = ibus_factory_new (ibus_bus_get_connection (bus));
 
+    ibus_m17n_debug_init (ibus_bus_get_connection (bus));
+
     engines = ibus_component_get_engines (component);
     for (p = engines; p != NULL; p = p->next) {
         IBusEngineDesc *engine = (IBusEngineDesc *)p->data;
@@ -69,7 +91,10 @@ start_component (void)
     }
 
     if (ibus) {
-        ibus_bus_request_name (bus, "org.freedesktop.IBus.M17N", 0);
+        gchar *name = get_bus_name ();
+
+        ibus_bus_request_name (bus, name, 0);
+        g_free (name);
     }
     else {
         ibus_bus_register_component (bus, component);
@@ -77,6 +102,7 @@ start_component (void)
 
     g_object_unref (component);
 
+    IBUS_M17N_PROBE1 (startup, "registered");
     ibus_main ();
 }
 
@@ -90,7 +116,7 @@ print_engines_xml (void)
 
     ibus_m17n_init_common ();
 
-    component = ibus_m17n_get_component ();
+    component = ibus_m17n_get_component_for_shard (shard);
     output = g_string_new ("");
 
     ibus_component_output_engines (component, output, 0);
@@ -98,7 +124,113 @@ print_engines_xml (void)
     fprintf (stdout, "%s", output->str);
 
     g_string_free (output, TRUE);
+    g_object_unref (component);
+}
 
+/* Print a component file for the process serving shard, to be
+   installed next to m17n.xml. */
+static void
+print_component_xml (void)
+{
+    gchar *name, *option, *str;
+
+    name = get_bus_name ();
+    option = shard ? g_strdup_printf (" --shard %s", shard) : g_strdup ("");
+
+    str = g_markup_printf_escaped (
+        "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+        "<component>\n"
+        "\t<name>%s</name>\n"
+        "\t<description>M17N Component</description>\n"
+        "\t<exec>%s/ibus-engine-m17n --ibus%s</exec>\n"
+        "\t<version>%s</version>\n"
+        "\t<author>Peng Huang &lt;shawn.p.huang@gmail.com&gt;</author>\n"
+        "\t<license>GPL</license>\n"
+        "\t<homepage>http://code.google.com/p/ibus</homepage>\n"
+        "\t<textdomain>ibus-m17n</textdomain>\n"
+        "\t<observed-paths>\n"
+        "\t\t<path>/usr/share/m17n/</path>\n"
+        "\t\t<path>%s</path>\n"
+        "\t\t<path>~/.m17n.d/</path>\n"
+        "\t</observed-paths>\n"
+        "\t<engines exec=\"%s/ibus-engine-m17n --xml%s\" />\n"
+        "</component>\n",
+        name, LIBEXECDIR, option, VERSION, SETUPDIR "/default.xml",
+        LIBEXECDIR, option);
+    fprintf (stdout, "%s", str);
+
+    g_free (str);
+    g_free (option);
+    g_free (name);
+}
+
+static GVariant *
+call_debug_method (GDBusConnection *connection,
+                   const gchar     *name,
+                   const gchar     *method_name)
+{
+    GVariant *reply;
+    GError *error = NULL;
+
+    reply = g_dbus_connection_call_sync (connection,
+                                         name,
+                                         IBUS_M17N_DEBUG_PATH,
+                                         IBUS_M17N_DEBUG_INTERFACE,
+                                         method_name,
+                                         NULL, NULL,
+                                         G_DBUS_CALL_FLAGS_NONE,
+                                         -1, NULL, &error);
+    if (reply == NULL) {
+        g_print ("Can not get statistics from %s: %s\n",
+                 name, error->message);
+        exit (-1);
+    }
+    return reply;
+}
+
+static void
+print_stats (void)
+{
+    GDBusConnection *connection;
+    GVariant *stats, *key_stats;
+    gchar *name, *str;
+
+    ibus_init ();
+
+    bus = ibus_bus_new ();
+    if (!ibus_bus_is_connected (bus)) {
+        g_print ("Can not connect to ibus-daemon\n");
+        exit (-1);
+    }
+    connection = ibus_bus_get_connection (bus);
+
+    name = get_bus_name ();
+    stats = call_debug_method (connection, name, "GetStats");
+    key_stats = call_debug_method (connection, name, "GetKeyStats");
+
+    str = ibus_m17n_debug_format_stats (stats, key_stats);
+    fprintf (stdout, "%s", str);
+    g_free (str);
+
+    g_variant_unref (key_stats);
+    g_variant_unref (stats);
+    g_free (name);
+    g_object_unref (bus);
+}
+
+/* A shard name ends up in a D-Bus name, so keep it to what an element
+   of one allows. */
+static gboolean
+shard_name_is_valid (const gchar *name)
+{
+    const gchar *p;
+
+    if (!g_ascii_isalpha (*name) && *name != '_')
+        return FALSE;
+    for (p = name; *p != '\0'; p++)
+        if (!g_ascii_isalnum (*p) && *p != '_')
+            return FALSE;
+    return TRUE;
 }
 
 int
@@ -118,11 +250,26 @@ main (gint argc, gchar **argv)
         exit (-1);
     }
 
+    if (shard && !shard_name_is_valid (shard)) {
+        g_print ("Invalid shard name: %s\n", shard);
+        exit (-1);
+    }
+
     if (xml) {
         print_engines_xml ();
         exit (0);
     }
 
+    if (component_xml) {
+        print_component_xml ();
+        exit (0);
+    }
+
+    if (dump_stats) {
+        print_stats ();
+        exit (0);
+    }
+
     start_component ();
     return 0;
 }
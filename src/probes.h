@@ -0,0 +1,70 @@
+/* vim:set et sts=4: */
+/* Static probes of provider ibus_m17n, for SystemTap, perf or
+   bpftrace, compiled in with --enable-probes.  Otherwise the macros
+   expand to nothing and their arguments are not evaluated.
+
+   startup (phase)
+   key-start (engine, keyval, keycode, modifiers)
+   key-done (engine, keyval, handled)
+   filter-start (engine, key)          filter-done (engine, retval)
+   lookup-start (engine, key)          lookup-done (engine, retval)
+   callback (engine, command)
+   commit (engine, text)
+   im-open-start (engine)              im-open-done (engine, opened)
+   im-close (engine)
+
+   Strings are passed as char pointers; key and command are the names
+   of m17n symbols.  Each probe has a semaphore, which tracers count up
+   while attached, and its arguments are only computed then. */
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+#ifdef HAVE_PROBES
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define IBUS_M17N_PROBE_SEMAPHORE(name) \
+    unsigned short ibus_m17n_##name##_semaphore \
+        __attribute__ ((unused)) __attribute__ ((section (".probes")))
+
+/* defined in engine.c */
+extern IBUS_M17N_PROBE_SEMAPHORE (startup);
+extern IBUS_M17N_PROBE_SEMAPHORE (key__start);
+extern IBUS_M17N_PROBE_SEMAPHORE (key__done);
+extern IBUS_M17N_PROBE_SEMAPHORE (filter__start);
+extern IBUS_M17N_PROBE_SEMAPHORE (filter__done);
+extern IBUS_M17N_PROBE_SEMAPHORE (lookup__start);
+extern IBUS_M17N_PROBE_SEMAPHORE (lookup__done);
+extern IBUS_M17N_PROBE_SEMAPHORE (callback);
+extern IBUS_M17N_PROBE_SEMAPHORE (commit);
+extern IBUS_M17N_PROBE_SEMAPHORE (im__open__start);
+extern IBUS_M17N_PROBE_SEMAPHORE (im__open__done);
+extern IBUS_M17N_PROBE_SEMAPHORE (im__close);
+
+#define IBUS_M17N_PROBE_ENABLED(name) \
+    __builtin_expect (ibus_m17n_##name##_semaphore, 0)
+
+#define IBUS_M17N_PROBE1(name, a) G_STMT_START { \
+    if (IBUS_M17N_PROBE_ENABLED (name)) \
+        DTRACE_PROBE1 (ibus_m17n, name, a); \
+} G_STMT_END
+#define IBUS_M17N_PROBE2(name, a, b) G_STMT_START { \
+    if (IBUS_M17N_PROBE_ENABLED (name)) \
+        DTRACE_PROBE2 (ibus_m17n, name, a, b); \
+} G_STMT_END
+#define IBUS_M17N_PROBE3(name, a, b, c) G_STMT_START { \
+    if (IBUS_M17N_PROBE_ENABLED (name)) \
+        DTRACE_PROBE3 (ibus_m17n, name, a, b, c); \
+} G_STMT_END
+#define IBUS_M17N_PROBE4(name, a, b, c, d) G_STMT_START { \
+    if (IBUS_M17N_PROBE_ENABLED (name)) \
+        DTRACE_PROBE4 (ibus_m17n, name, a, b, c, d); \
+} G_STMT_END
+#else
+#define IBUS_M17N_PROBE1(name, a)
+#define IBUS_M17N_PROBE2(name, a, b)
+#define IBUS_M17N_PROBE3(name, a, b, c)
+#define IBUS_M17N_PROBE4(name, a, b, c, d)
+#endif  /* !HAVE_PROBES */
+
+#endif
@@ -0,0 +1,544 @@
+/* vim:set et sts=4: */
+/* Feed a key sequence to an engine without ibus-daemon and report the
+   latency of each key event, the allocations it makes and the signals
+   the engine emits.
+
+   The engine is exported on one end of a socket pair, and the signals
+   are counted on the other end, where ibus-daemon would be.  Keys are
+   read one per line from a file, as "a", "space" or
+   "Control+Shift+Left", taken from a trace recorded with
+   IBUS_M17N_TRACE, or generated from a fixed seed.  Exits with 77,
+   which automake reads as a skipped test, if the engine is not
+   installed. */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <ibus.h>
+#include <locale.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <gio/gio.h>
+#include "engine.h"
+#include "m17nutil.h"
+
+#define DEFAULT_ENGINE "m17n:hi:inscript"
+#define ENGINE_PATH "/org/freedesktop/IBus/Engine/1"
+#define EXIT_SKIP 77
+
+/* options */
+static gchar *engine_name = NULL;
+static gchar *keys_file = NULL;
+static gchar *trace_file = NULL;
+static gboolean realtime = FALSE;
+static gint n_synthetic_keys = 2000;
+static gint seed = 1;
+
+static const GOptionEntry entries[] =
+{
+    { "engine", 'e', 0, G_OPTION_ARG_STRING, &engine_name, "engine to replay keys to, " DEFAULT_ENGINE " by default", "NAME" },
+    { "keys", 'k', 0, G_OPTION_ARG_FILENAME, &keys_file, "read keys from FILE instead of generating them", "FILE" },
+    { "trace", 't', 0, G_OPTION_ARG_FILENAME, &trace_file, "replay the key events of the engine in trace FILE", "FILE" },
+    { "realtime", 'r', 0, G_OPTION_ARG_NONE, &realtime, "keep the timing of the trace between keys", NULL },
+    { "count", 'n', 0, G_OPTION_ARG_INT, &n_synthetic_keys, "number of keys to generate", "N" },
+    { "seed", 's', 0, G_OPTION_ARG_INT, &seed, "seed of the generated keys", "SEED" },
+    { NULL },
+};
+
+#ifdef __GLIBC__
+/* Count the allocations made by the thread replaying keys, by
+   interposing the allocator.  Allocations of the GDBus worker thread,
+   which writes the signals out, are not counted. */
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t nmemb, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+static __thread gboolean counting = FALSE;
+static __thread guint64 n_allocations = 0;
+
+void *
+malloc (size_t size)
+{
+    if (counting)
+        n_allocations++;
+    return __libc_malloc (size);
+}
+
+void *
+calloc (size_t nmemb,
+        size_t size)
+{
+    if (counting)
+        n_allocations++;
+    return __libc_calloc (nmemb, size);
+}
+
+void *
+realloc (void   *ptr,
+         size_t  size)
+{
+    if (counting)
+        n_allocations++;
+    return __libc_realloc (ptr, size);
+}
+#define HAVE_ALLOCATION_COUNT 1
+#endif  /* __GLIBC__ */
+
+typedef struct _ReplayKey ReplayKey;
+
+struct _ReplayKey {
+    guint keyval;
+    /* 0 unless read from a trace, which keeps it for unprintable keys */
+    guint keycode;
+    guint modifiers;
+    /* microseconds since the previous key, from a trace */
+    gint64 delay;
+};
+
+static const struct {
+    const gchar *name;
+    guint mask;
+} modifier_names[] = {
+    { "Shift", IBUS_SHIFT_MASK },
+    { "Control", IBUS_CONTROL_MASK },
+    { "Alt", IBUS_MOD1_MASK },
+    { "Super", IBUS_SUPER_MASK },
+    { "Release", IBUS_RELEASE_MASK },
+};
+
+static gboolean
+parse_key (const gchar *line,
+           ReplayKey   *key)
+{
+    gchar **tokens;
+    guint n_tokens, i, j;
+
+    tokens = g_strsplit (line, "+", -1);
+    n_tokens = g_strv_length (tokens);
+    if (n_tokens == 0) {
+        g_strfreev (tokens);
+        return FALSE;
+    }
+
+    key->modifiers = 0;
+    for (i = 0; i < n_tokens - 1; i++) {
+        for (j = 0; j < G_N_ELEMENTS (modifier_names); j++) {
+            if (g_ascii_strcasecmp (tokens[i], modifier_names[j].name) == 0)
+                break;
+        }
+        if (j == G_N_ELEMENTS (modifier_names)) {
+            g_strfreev (tokens);
+            return FALSE;
+        }
+        key->modifiers |= modifier_names[j].mask;
+    }
+    key->keyval = ibus_keyval_from_name (tokens[n_tokens - 1]);
+    g_strfreev (tokens);
+
+    return key->keyval != IBUS_VoidSymbol;
+}
+
+static GArray *
+read_keys (const gchar *filename,
+           GError     **error)
+{
+    gchar *contents, **lines;
+    GArray *keys;
+    guint i;
+
+    if (!g_file_get_contents (filename, &contents, NULL, error))
+        return NULL;
+
+    keys = g_array_new (FALSE, FALSE, sizeof (ReplayKey));
+    lines = g_strsplit (contents, "\n", -1);
+    for (i = 0; lines[i] != NULL; i++) {
+        gchar *line = g_strstrip (lines[i]);
+        ReplayKey key = { 0, 0, 0, 0 };
+
+        if (*line == '\0' || *line == '#')
+            continue;
+        if (!parse_key (line, &key)) {
+            g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                         "%s:%u: invalid key \"%s\"", filename, i + 1, line);
+            g_array_free (keys, TRUE);
+            keys = NULL;
+            break;
+        }
+        g_array_append_val (keys, key);
+    }
+    g_strfreev (lines);
+    g_free (contents);
+
+    return keys;
+}
+
+/* Read the key events of ENGINE from a trace. */
+static GArray *
+read_trace (const gchar *filename,
+            const gchar *engine,
+            GError     **error)
+{
+    IBusM17NTraceReader *reader;
+    IBusM17NTraceEvent event;
+    GArray *keys;
+    gint64 last_time = -1;
+
+    reader = ibus_m17n_trace_reader_new (filename, error);
+    if (reader == NULL)
+        return NULL;
+
+    keys = g_array_new (FALSE, FALSE, sizeof (ReplayKey));
+    while (ibus_m17n_trace_reader_next (reader, &event, error)) {
+        ReplayKey key;
+
+        if (event.type != IBUS_M17N_TRACE_KEY ||
+            g_strcmp0 (event.engine_name, engine) != 0)
+            continue;
+        key.keyval = event.keyval;
+        key.keycode = event.keycode;
+        key.modifiers = event.modifiers;
+        key.delay = last_time < 0 ? 0 : event.time - last_time;
+        last_time = event.time;
+        g_array_append_val (keys, key);
+    }
+    ibus_m17n_trace_reader_free (reader);
+
+    if (error && *error) {
+        g_array_free (keys, TRUE);
+        return NULL;
+    }
+    return keys;
+}
+
+/* Mostly printable ASCII, which most keymaps translate, with some
+   editing keys in between. */
+static GArray *
+generate_keys (guint n,
+               guint seed)
+{
+    static const guint editing_keys[] = {
+        IBUS_space, IBUS_BackSpace, IBUS_Return, IBUS_Left, IBUS_Right,
+    };
+    GArray *keys = g_array_sized_new (FALSE, FALSE, sizeof (ReplayKey), n);
+    GRand *rand = g_rand_new_with_seed (seed);
+    guint i;
+
+    for (i = 0; i < n; i++) {
+        ReplayKey key = { 0, 0, 0, 0 };
+
+        if (g_rand_int_range (rand, 0, 8) == 0)
+            key.keyval = editing_keys[g_rand_int_range (rand, 0, G_N_ELEMENTS (editing_keys))];
+        else
+            key.keyval = g_rand_int_range (rand, IBUS_exclam, IBUS_asciitilde + 1);
+        g_array_append_val (keys, key);
+    }
+    g_rand_free (rand);
+
+    return keys;
+}
+
+static gboolean
+engine_is_available (const gchar *name)
+{
+    GList *engines, *p;
+    gboolean found = FALSE;
+
+    engines = ibus_m17n_list_engines ();
+    for (p = engines; p != NULL; p = p->next) {
+        IBusEngineDesc *engine = p->data;
+
+        if (g_strcmp0 (ibus_engine_desc_get_name (engine), name) == 0)
+            found = TRUE;
+        g_object_unref (g_object_ref_sink (engine));
+    }
+    g_list_free (engines);
+
+    return found;
+}
+
+static void
+connection_ready_cb (GObject      *source_object,
+                     GAsyncResult *res,
+                     gpointer      user_data)
+{
+    GDBusConnection **connection = user_data;
+    GError *error = NULL;
+
+    *connection = g_dbus_connection_new_finish (res, &error);
+    if (*connection == NULL)
+        g_error ("Can not set up connection: %s", error->message);
+}
+
+/* Connect the two ends of a socket pair as D-Bus peers. */
+static void
+new_peer_connections (GDBusConnection **server,
+                      GDBusConnection **client)
+{
+    gint fds[2];
+    GSocket *socket;
+    GSocketConnection *stream;
+    gchar *guid;
+    guint i;
+
+    if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0)
+        g_error ("Can not create socket pair: %s", g_strerror (errno));
+
+    guid = g_dbus_generate_guid ();
+    *server = *client = NULL;
+    for (i = 0; i < 2; i++) {
+        socket = g_socket_new_from_fd (fds[i], NULL);
+        stream = g_socket_connection_factory_create_connection (socket);
+        /* both ends authenticate at once, so neither can block */
+        g_dbus_connection_new (G_IO_STREAM (stream),
+                               i == 0 ? guid : NULL,
+                               i == 0 ?
+                               G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_SERVER |
+                               G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_ALLOW_ANONYMOUS :
+                               G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT,
+                               NULL, NULL,
+                               connection_ready_cb,
+                               i == 0 ? server : client);
+        g_object_unref (stream);
+        g_object_unref (socket);
+    }
+    g_free (guid);
+
+    while (*server == NULL || *client == NULL)
+        g_main_context_iteration (NULL, TRUE);
+}
+
+static void
+signal_cb (GDBusConnection *connection,
+           const gchar     *sender_name,
+           const gchar     *object_path,
+           const gchar     *interface_name,
+           const gchar     *signal_name,
+           GVariant        *parameters,
+           gpointer         user_data)
+{
+    GHashTable *signals = user_data;
+    guint count;
+
+    count = GPOINTER_TO_UINT (g_hash_table_lookup (signals, signal_name));
+    g_hash_table_replace (signals, g_strdup (signal_name),
+                          GUINT_TO_POINTER (count + 1));
+}
+
+/* Run until every signal sent before has been counted: the reply to a
+   ping comes after them on the same connection. */
+static void
+sync_signals (GDBusConnection *connection)
+{
+    GVariant *reply;
+
+    reply = g_dbus_connection_call_sync (connection,
+                                         NULL,
+                                         "/",
+                                         "org.freedesktop.DBus.Peer",
+                                         "Ping",
+                                         NULL, NULL,
+                                         G_DBUS_CALL_FLAGS_NONE,
+                                         -1, NULL, NULL);
+    if (reply != NULL)
+        g_variant_unref (reply);
+    while (g_main_context_iteration (NULL, FALSE))
+        ;
+}
+
+/* Let pending work, such as opening the input method, finish. */
+static void
+run_pending (void)
+{
+    while (g_main_context_iteration (NULL, FALSE))
+        ;
+}
+
+static gint
+compare_int64 (gconstpointer a,
+               gconstpointer b)
+{
+    gint64 x = *(const gint64 *) a, y = *(const gint64 *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static gint64
+percentile (GArray *sorted,
+            guint   p)
+{
+    guint i = (sorted->len * p + 99) / 100;
+
+    return g_array_index (sorted, gint64, i > 0 ? i - 1 : 0);
+}
+
+static void
+print_signal (gpointer key,
+              gpointer value,
+              gpointer user_data)
+{
+    g_print ("  %s: %u\n", (const gchar *) key, GPOINTER_TO_UINT (value));
+}
+
+int
+main (gint argc, gchar **argv)
+{
+    GError *error = NULL;
+    GOptionContext *context;
+    GDBusConnection *engine_connection, *daemon_connection;
+    GHashTable *signals;
+    IBusEngine *engine;
+    IBusEngineClass *engine_class;
+    GArray *keys, *latencies;
+    guint64 allocations = 0;
+    guint n_handled = 0, i;
+    GType type;
+
+    setlocale (LC_ALL, "");
+
+    context = g_option_context_new ("- replay keys to an m17n engine");
+    g_option_context_add_main_entries (context, entries, "ibus-m17n");
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_print ("Option parsing failed: %s\n", error->message);
+        exit (-1);
+    }
+    g_option_context_free (context);
+
+    if (engine_name == NULL)
+        engine_name = g_strdup (DEFAULT_ENGINE);
+
+    ibus_init ();
+    ibus_m17n_init_common ();
+
+    if (!engine_is_available (engine_name)) {
+        g_print ("%s is not installed, skipping\n", engine_name);
+        return EXIT_SKIP;
+    }
+
+    type = ibus_m17n_engine_get_type_for_name (engine_name);
+    if (type == G_TYPE_INVALID) {
+        g_print ("Invalid engine name: %s\n", engine_name);
+        exit (-1);
+    }
+
+    if (trace_file != NULL) {
+        keys = read_trace (trace_file, engine_name, &error);
+        if (keys == NULL) {
+            g_print ("Can not read trace: %s\n", error->message);
+            exit (-1);
+        }
+    }
+    else if (keys_file != NULL) {
+        keys = read_keys (keys_file, &error);
+        if (keys == NULL) {
+            g_print ("Can not read keys: %s\n", error->message);
+            exit (-1);
+        }
+    }
+    else
+        keys = generate_keys (n_synthetic_keys, seed);
+
+    new_peer_connections (&engine_connection, &daemon_connection);
+
+    signals = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    g_dbus_connection_signal_subscribe (daemon_connection,
+                                        NULL,
+                                        "org.freedesktop.IBus.Engine",
+                                        NULL,
+                                        ENGINE_PATH,
+                                        NULL,
+                                        G_DBUS_SIGNAL_FLAGS_NONE,
+                                        signal_cb,
+                                        signals,
+                                        NULL);
+
+    engine = g_object_new (type,
+                           "engine-name", engine_name,
+                           "object-path", ENGINE_PATH,
+                           "connection", engine_connection,
+                           NULL);
+    if (engine == NULL) {
+        g_print ("Can not create %s\n", engine_name);
+        exit (-1);
+    }
+    g_object_ref_sink (engine);
+    engine_class = IBUS_ENGINE_GET_CLASS (engine);
+
+    engine_class->enable (engine);
+    engine_class->focus_in (engine);
+    run_pending ();
+    sync_signals (daemon_connection);
+    g_hash_table_remove_all (signals);
+
+    latencies = g_array_sized_new (FALSE, FALSE, sizeof (gint64), keys->len);
+    for (i = 0; i < keys->len; i++) {
+        ReplayKey *key = &g_array_index (keys, ReplayKey, i);
+        gint64 start, elapsed;
+        gboolean handled;
+
+        if (realtime && key->delay > 0)
+            g_usleep (key->delay);
+
+#ifdef HAVE_ALLOCATION_COUNT
+        n_allocations = 0;
+        counting = TRUE;
+#endif  /* HAVE_ALLOCATION_COUNT */
+        start = g_get_monotonic_time ();
+        handled = engine_class->process_key_event (engine,
+                                                   key->keyval,
+                                                   key->keycode,
+                                                   key->modifiers);
+        elapsed = g_get_monotonic_time () - start;
+#ifdef HAVE_ALLOCATION_COUNT
+        counting = FALSE;
+        allocations += n_allocations;
+#endif  /* HAVE_ALLOCATION_COUNT */
+
+        g_array_append_val (latencies, elapsed);
+        if (handled)
+            n_handled++;
+
+        /* UI updates deferred behind the key are part of its cost to
+           the daemon, but not of its latency */
+        run_pending ();
+    }
+    sync_signals (daemon_connection);
+
+    g_print ("engine: %s\n", engine_name);
+    g_print ("keys: %u (%u handled)\n", keys->len, n_handled);
+    if (latencies->len > 0) {
+        g_array_sort (latencies, compare_int64);
+        g_print ("latency: p50 %" G_GINT64_FORMAT " us,"
+                 " p99 %" G_GINT64_FORMAT " us,"
+                 " max %" G_GINT64_FORMAT " us\n",
+                 percentile (latencies, 50),
+                 percentile (latencies, 99),
+                 g_array_index (latencies, gint64, latencies->len - 1));
+#ifdef HAVE_ALLOCATION_COUNT
+        g_print ("allocations per key: %.1f\n",
+                 (gdouble) allocations / latencies->len);
+#endif  /* HAVE_ALLOCATION_COUNT */
+    }
+    g_print ("signals:\n");
+    g_hash_table_foreach (signals, print_signal, NULL);
+
+    engine_class->focus_out (engine);
+    engine_class->disable (engine);
+    ibus_object_destroy ((IBusObject *) engine);
+    g_object_unref (engine);
+    run_pending ();
+
+    g_hash_table_destroy (signals);
+    g_array_free (latencies, TRUE);
+    g_array_free (keys, TRUE);
+    g_dbus_connection_close_sync (daemon_connection, NULL, NULL);
+    g_dbus_connection_close_sync (engine_connection, NULL, NULL);
+    g_object_unref (daemon_connection);
+    g_object_unref (engine_connection);
+    g_free (engine_name);
+    g_free (keys_file);
+    g_free (trace_file);
+
+    return 0;
+}
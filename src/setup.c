@@ -50,8 +50,7 @@ format_m17n_value (MPlist *plist)
         return g_strdup (msymbol_name ((MSymbol) mplist_value (plist)));
 
     if (mplist_key (plist) == Mtext)
-        return g_strdup (mtext_data ((MText *) mplist_value (plist),
-                                     NULL, NULL, NULL, NULL));
+        return ibus_m17n_mtext_to_utf8 ((MText *) mplist_value (plist));
 
     if (mplist_key (plist) == Minteger)
         return g_strdup_printf ("%d", (gint) (long) mplist_value (plist));
@@ -5,6 +5,8 @@
 
 #include <ibus.h>
 #include <locale.h>
+#include <string.h>
+#include <glib/gstdio.h>
 #include "m17nutil.h"
 
 static void
@@ -33,6 +35,7 @@ test_engine_config (void)
     config = ibus_m17n_get_engine_config ("m17n:non:exsistent");
     g_assert_cmpint (config->rank, ==, 0);
     g_assert_cmpint (config->preedit_highlight, ==, 0);
+    g_assert (config->shard == NULL);
     ibus_m17n_engine_config_free (config);
 
     config = ibus_m17n_get_engine_config ("m17n:si:wijesekera");
@@ -51,6 +54,923 @@ test_engine_config (void)
     ibus_m17n_engine_config_free (config);
 }
 
+static guint
+count_component_engines (IBusComponent *component)
+{
+    GList *engines = ibus_component_get_engines (component);
+    guint n = g_list_length (engines);
+
+    g_list_free (engines);
+    return n;
+}
+
+static void
+test_shard (void)
+{
+    GString *xml;
+    GList *engines, *p;
+    IBusComponent *component;
+    IBusM17NEngineConfig *config;
+    gchar *dirname, *filename;
+    const gchar *sharded = NULL;
+    guint n_engines, n_default, n_sharded;
+
+    engines = ibus_m17n_list_engines ();
+    n_engines = g_list_length (engines);
+    if (engines != NULL) {
+#if IBUS_CHECK_VERSION(1,3,99)
+        sharded = ibus_engine_desc_get_name (engines->data);
+#else
+        sharded = ((IBusEngineDesc *) engines->data)->name;
+#endif  /* !IBUS_CHECK_VERSION(1,3,99) */
+    }
+
+    xml = g_string_new ("<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+                        "<engines>\n"
+                        "\t<engine>\n"
+                        "\t\t<name>m17n:zz:*</name>\n"
+                        "\t\t<shard>test</shard>\n"
+                        "\t</engine>\n"
+                        "\t<engine>\n"
+                        "\t\t<name>m17n:zz:unsharded</name>\n"
+                        "\t\t<shard></shard>\n"
+                        "\t</engine>\n");
+    if (sharded)
+        g_string_append_printf (xml,
+                                "\t<engine>\n"
+                                "\t\t<name>%s</name>\n"
+                                "\t\t<shard>test</shard>\n"
+                                "\t</engine>\n",
+                                sharded);
+    g_string_append (xml, "</engines>\n");
+
+    dirname = g_dir_make_tmp ("test-m17n-XXXXXX", NULL);
+    g_assert (dirname != NULL);
+    filename = g_build_filename (dirname, "default.xml", NULL);
+    g_assert (g_file_set_contents (filename, xml->str, xml->len, NULL));
+    g_string_free (xml, TRUE);
+    g_assert (ibus_m17n_load_engine_config (filename));
+    g_unlink (filename);
+    g_rmdir (dirname);
+    g_free (filename);
+    g_free (dirname);
+
+    config = ibus_m17n_get_engine_config ("m17n:zz:any");
+    g_assert_cmpstr (config->shard, ==, "test");
+    ibus_m17n_engine_config_free (config);
+    config = ibus_m17n_get_engine_config ("m17n:zz:unsharded");
+    g_assert (config->shard == NULL);
+    ibus_m17n_engine_config_free (config);
+
+    /* every engine is served by exactly one shard */
+    component = ibus_m17n_get_component_for_shard (NULL);
+    n_default = count_component_engines (component);
+    g_object_unref (component);
+    component = ibus_m17n_get_component_for_shard ("test");
+    n_sharded = count_component_engines (component);
+    g_object_unref (component);
+    g_assert_cmpuint (n_sharded, ==, sharded ? 1 : 0);
+    g_assert_cmpuint (n_default + n_sharded, ==, n_engines);
+
+    for (p = engines; p != NULL; p = p->next)
+        g_object_unref (g_object_ref_sink (p->data));
+    g_list_free (engines);
+
+    ibus_m17n_load_engine_config (NULL);
+}
+
+static MText *
+new_mtext (const gchar *str)
+{
+    return mtext_from_data (str, strlen (str), MTEXT_FORMAT_US_ASCII);
+}
+
+static void
+test_candidate_index (void)
+{
+    MPlist *candidates, *group;
+    MText *mt;
+    IBusM17NCandidateIndex *index;
+    gint start, len;
+
+    /* groups: "abc" (chars), ("de" "fgh") (strings), "ij" (chars) */
+    candidates = mplist ();
+    mt = new_mtext ("abc");
+    mplist_add (candidates, Mtext, mt);
+    m17n_object_unref (mt);
+
+    group = mplist ();
+    mt = new_mtext ("de");
+    mplist_add (group, Mtext, mt);
+    m17n_object_unref (mt);
+    mt = new_mtext ("fgh");
+    mplist_add (group, Mtext, mt);
+    m17n_object_unref (mt);
+    mplist_add (candidates, Mplist, group);
+    m17n_object_unref (group);
+
+    mt = new_mtext ("ij");
+    mplist_add (candidates, Mtext, mt);
+    m17n_object_unref (mt);
+
+    index = ibus_m17n_candidate_index_new (candidates);
+    g_assert_cmpint (ibus_m17n_candidate_index_get_n_groups (index), ==, 3);
+
+    g_assert_cmpint (ibus_m17n_candidate_index_lookup (index, 0, &start, &len), ==, 0);
+    g_assert_cmpint (start, ==, 0);
+    g_assert_cmpint (len, ==, 3);
+    g_assert_cmpint (ibus_m17n_candidate_index_lookup (index, 2, &start, &len), ==, 0);
+    g_assert_cmpint (ibus_m17n_candidate_index_lookup (index, 3, &start, &len), ==, 1);
+    g_assert_cmpint (start, ==, 3);
+    g_assert_cmpint (len, ==, 2);
+    g_assert_cmpint (ibus_m17n_candidate_index_lookup (index, 5, &start, &len), ==, 2);
+    g_assert_cmpint (start, ==, 5);
+    g_assert_cmpint (len, ==, 2);
+    g_assert_cmpint (ibus_m17n_candidate_index_lookup (index, 7, NULL, NULL), ==, -1);
+    g_assert_cmpint (ibus_m17n_candidate_index_lookup (index, -1, NULL, NULL), ==, -1);
+
+    g_assert (ibus_m17n_candidate_index_get_group (index, 1) ==
+              mplist_next (candidates));
+    ibus_m17n_candidate_index_get_group_range (index, 2, &start, &len);
+    g_assert_cmpint (start, ==, 5);
+    g_assert_cmpint (len, ==, 2);
+
+    ibus_m17n_candidate_index_free (index);
+    m17n_object_unref (candidates);
+}
+
+static void
+test_mtext_to_utf8 (void)
+{
+    /* ASCII, Devanagari, CJK and an emoji */
+    const gchar *str = "a\xe0\xa4\x95\xe4\xb8\xad\xf0\x9f\x98\x80";
+    MText *mt;
+    gchar *buf;
+    IBusText *text;
+
+    mt = mconv_decode_buffer (Mcoding_utf_8,
+                              (const unsigned char *) str, strlen (str));
+
+    buf = ibus_m17n_mtext_to_utf8 (mt);
+    g_assert_cmpstr (buf, ==, str);
+    g_free (buf);
+
+    text = ibus_m17n_mtext_to_text (mt);
+    g_assert_cmpstr (text->text, ==, str);
+    g_object_unref (g_object_ref_sink (text));
+
+    m17n_object_unref (mt);
+
+    g_assert (ibus_m17n_mtext_to_utf8 (NULL) == NULL);
+}
+
+static void
+test_mtext_to_ucs4 (void)
+{
+    const gchar *str = "a\xe0\xa4\x95\xe4\xb8\xad\xf0\x9f\x98\x80";
+    const gunichar expected[] = { 0x61, 0x915, 0x4e2d, 0x1f600 };
+    MText *mt;
+    gunichar *ucs, buf[4];
+    glong nchars;
+
+    mt = mconv_decode_buffer (Mcoding_utf_8,
+                              (const unsigned char *) str, strlen (str));
+
+    ucs = ibus_m17n_mtext_to_ucs4 (mt, &nchars);
+    g_assert_cmpint (nchars, ==, 4);
+    g_assert (memcmp (ucs, expected, sizeof (expected)) == 0);
+    g_assert_cmpint (ucs[4], ==, 0);
+    g_free (ucs);
+
+    g_assert_cmpint (ibus_m17n_mtext_get_ucs4 (mt, 1, 3, buf), ==, 2);
+    g_assert_cmpint (buf[0], ==, 0x915);
+    g_assert_cmpint (buf[1], ==, 0x4e2d);
+    g_assert_cmpint (ibus_m17n_mtext_get_ucs4 (mt, 3, 10, buf), ==, 1);
+    g_assert_cmpint (buf[0], ==, 0x1f600);
+
+    m17n_object_unref (mt);
+}
+
+static void
+test_history (void)
+{
+    gchar *dirname, *filename, *next;
+    gchar **top;
+    IBusM17NHistory *history;
+
+    dirname = g_dir_make_tmp ("test-m17n-XXXXXX", NULL);
+    g_assert (dirname != NULL);
+    filename = g_build_filename (dirname, "cache", "history", NULL);
+
+    history = ibus_m17n_history_new (filename);
+    ibus_m17n_history_record (history, "m17n:hi:inscript");
+    ibus_m17n_history_record (history, "m17n:hi:itrans");
+    ibus_m17n_history_record (history, "m17n:hi:inscript");
+    ibus_m17n_history_record (history, "m17n:hi:inscript");
+    ibus_m17n_history_record (history, "m17n:ja:anthy");
+    ibus_m17n_history_record (history, "m17n:hi:inscript");
+    g_assert (ibus_m17n_history_save (history, NULL));
+    ibus_m17n_history_free (history);
+
+    /* reloaded from the file */
+    history = ibus_m17n_history_new (filename);
+
+    top = ibus_m17n_history_get_top (history, 2);
+    g_assert_cmpuint (g_strv_length (top), ==, 2);
+    g_assert_cmpstr (top[0], ==, "m17n:hi:inscript");
+    g_assert_cmpstr (top[1], ==, "m17n:hi:itrans");
+    g_strfreev (top);
+
+    next = ibus_m17n_history_get_next (history, "m17n:hi:inscript");
+    g_assert_cmpstr (next, ==, "m17n:hi:itrans");
+    g_free (next);
+    g_assert (ibus_m17n_history_get_next (history, "m17n:ja:tcode") == NULL);
+
+    ibus_m17n_history_free (history);
+
+    g_unlink (filename);
+    g_free (filename);
+    filename = g_build_filename (dirname, "cache", NULL);
+    g_rmdir (filename);
+    g_rmdir (dirname);
+    g_free (filename);
+    g_free (dirname);
+}
+
+static void
+test_trace (void)
+{
+    static const IBusM17NTraceEvent events[] = {
+        { IBUS_M17N_TRACE_FOCUS_IN, 1000, "m17n:hi:inscript", },
+        { IBUS_M17N_TRACE_KEY, 1250, "m17n:hi:inscript", IBUS_k, 45, 0, TRUE },
+        { IBUS_M17N_TRACE_KEY, 1400, "m17n:hi:inscript", IBUS_BackSpace, 22, 0, FALSE },
+        { IBUS_M17N_TRACE_KEY, 300000, "m17n:ja:anthy", IBUS_Q, 24, IBUS_SHIFT_MASK, TRUE },
+        { IBUS_M17N_TRACE_FOCUS_OUT, 300001, "m17n:hi:inscript", },
+        { IBUS_M17N_TRACE_KEY, 300002, "m17n:hi:inscript", IBUS_k, 45, 0, TRUE },
+        { IBUS_M17N_TRACE_KEY, 300003, "m17n:hi:inscript", IBUS_j, 44, 0, TRUE },
+    };
+    IBusM17NTraceWriter *writer;
+    IBusM17NTraceReader *reader;
+    IBusM17NTraceEvent event;
+    IBusKeymap *keymap;
+    GError *error = NULL;
+    gchar *dirname, *filename;
+    GStatBuf st;
+    guint i, keyval = 0;
+    gboolean scramble;
+
+    dirname = g_dir_make_tmp ("test-m17n-XXXXXX", NULL);
+    g_assert (dirname != NULL);
+    filename = g_build_filename (dirname, "trace", NULL);
+
+    writer = ibus_m17n_trace_writer_new (filename, FALSE, NULL);
+    g_assert (writer != NULL);
+    g_assert_cmpint (g_stat (filename, &st), ==, 0);
+    g_assert_cmpint (st.st_mode & 0777, ==, 0600);
+    for (i = 0; i < G_N_ELEMENTS (events); i++)
+        ibus_m17n_trace_writer_add (writer, &events[i], FALSE);
+    ibus_m17n_trace_writer_free (writer);
+
+    reader = ibus_m17n_trace_reader_new (filename, NULL);
+    g_assert (reader != NULL);
+    for (i = 0; ibus_m17n_trace_reader_next (reader, &event, &error); i++) {
+        g_assert_cmpuint (i, <, G_N_ELEMENTS (events));
+        g_assert_cmpint (event.type, ==, events[i].type);
+        g_assert_cmpint (event.time, ==, events[i].time - events[0].time);
+        g_assert_cmpstr (event.engine_name, ==, events[i].engine_name);
+        g_assert_cmpint (event.handled, ==, events[i].handled);
+        g_assert_cmpuint (event.modifiers, ==, events[i].modifiers);
+    }
+    g_assert_no_error (error);
+    g_assert_cmpuint (i, ==, G_N_ELEMENTS (events));
+    ibus_m17n_trace_reader_free (reader);
+
+    /* printable keys keep their class, and by default are replaced the
+       same way all through the trace; the keycodes written are those
+       of the replacements; others are kept as is */
+    keymap = ibus_keymap_get ("us");
+    for (scramble = FALSE; scramble <= TRUE; scramble++) {
+        if (scramble) {
+            writer = ibus_m17n_trace_writer_new (filename, TRUE, NULL);
+            for (i = 0; i < G_N_ELEMENTS (events); i++)
+                ibus_m17n_trace_writer_add (writer, &events[i], FALSE);
+            ibus_m17n_trace_writer_free (writer);
+        }
+
+        reader = ibus_m17n_trace_reader_new (filename, NULL);
+        for (i = 0; ibus_m17n_trace_reader_next (reader, &event, NULL); i++) {
+            if (i == 1 || i == 5 || i == 6)
+                g_assert (g_ascii_islower (event.keyval));
+            if (i == 1)
+                keyval = event.keyval;
+            if (i == 2) {
+                g_assert_cmpuint (event.keyval, ==, IBUS_BackSpace);
+                g_assert_cmpuint (event.keycode, ==, 22);
+            }
+            if (i == 3)
+                g_assert (g_ascii_isupper (event.keyval));
+            if (!scramble && i == 5)
+                g_assert_cmpuint (event.keyval, ==, keyval);
+            if (!scramble && i == 6)
+                g_assert_cmpuint (event.keyval, !=, keyval);
+            if (keymap != NULL && events[i].type == IBUS_M17N_TRACE_KEY &&
+                events[i].keyval != IBUS_BackSpace)
+                g_assert_cmpuint (ibus_keymap_lookup_keysym (keymap,
+                                                             event.keycode,
+                                                             event.modifiers),
+                                  ==, event.keyval);
+        }
+        ibus_m17n_trace_reader_free (reader);
+    }
+    if (keymap != NULL)
+        g_object_unref (keymap);
+
+    /* truncated */
+    g_assert (g_file_set_contents (filename, "IBM17NT\1\0\x80", 10, NULL));
+    reader = ibus_m17n_trace_reader_new (filename, NULL);
+    g_assert (reader != NULL);
+    g_assert (!ibus_m17n_trace_reader_next (reader, &event, &error));
+    g_assert_error (error, G_FILE_ERROR, G_FILE_ERROR_INVAL);
+    g_clear_error (&error);
+    ibus_m17n_trace_reader_free (reader);
+
+    g_unlink (filename);
+    g_rmdir (dirname);
+    g_free (filename);
+    g_free (dirname);
+}
+
+static gboolean
+count_task (gpointer user_data)
+{
+    gint *count = user_data;
+    return --*count > 0;
+}
+
+static gboolean
+quit_task (gpointer user_data)
+{
+    g_main_loop_quit (user_data);
+    return FALSE;
+}
+
+static void
+test_histogram (void)
+{
+    IBusM17NHistogram *histogram = g_new0 (IBusM17NHistogram, 1);
+    GVariant *values, *buckets;
+    guint64 value, p;
+    guint i;
+
+    g_assert_cmpuint (ibus_m17n_histogram_get_percentile (histogram, 50),
+                      ==, 0);
+
+    /* 1..1000 */
+    for (i = 1; i <= 1000; i++)
+        ibus_m17n_histogram_add (histogram, i);
+    g_assert_cmpuint (histogram->count, ==, 1000);
+    g_assert_cmpuint (histogram->sum, ==, 500500);
+    g_assert_cmpuint (histogram->max, ==, 1000);
+
+    /* an upper bound, off by at most a bucket width */
+    p = ibus_m17n_histogram_get_percentile (histogram, 50);
+    g_assert_cmpuint (p, >=, 500);
+    g_assert_cmpuint (p, <=, 500 + 500 / 8);
+    p = ibus_m17n_histogram_get_percentile (histogram, 99);
+    g_assert_cmpuint (p, >=, 990);
+    g_assert_cmpuint (p, <=, 1000);
+    g_assert_cmpuint (ibus_m17n_histogram_get_percentile (histogram, 100),
+                      ==, 1000);
+
+    /* larger than the last bucket */
+    ibus_m17n_histogram_add (histogram, G_MAXUINT64 / 2);
+    g_assert_cmpuint (histogram->max, ==, G_MAXUINT64 / 2);
+
+    values = g_variant_ref_sink (ibus_m17n_histogram_serialize (histogram));
+    g_assert (g_variant_lookup (values, "count", "t", &value));
+    g_assert_cmpuint (value, ==, 1001);
+    buckets = g_variant_lookup_value (values, "buckets",
+                                      G_VARIANT_TYPE ("a(tu)"));
+    g_assert (buckets != NULL);
+    g_assert_cmpuint (g_variant_n_children (buckets), <,
+                      IBUS_M17N_HISTOGRAM_N_BUCKETS);
+    g_variant_unref (buckets);
+    g_variant_unref (values);
+
+    g_free (histogram);
+}
+
+static void
+test_scheduler (void)
+{
+    GMainLoop *loop = g_main_loop_new (NULL, FALSE);
+    gint a = 3, b = G_MAXINT, last_b;
+    guint id;
+
+    id = ibus_m17n_scheduler_add (IBUS_M17N_TASK_BACKGROUND,
+                                  count_task, &b, NULL);
+    ibus_m17n_scheduler_add (IBUS_M17N_TASK_UI, count_task, &a, NULL);
+    ibus_m17n_scheduler_add (IBUS_M17N_TASK_UI, quit_task, loop, NULL);
+    g_main_loop_run (loop);
+
+    /* UI tasks run before background ones, and take turns */
+    g_assert_cmpint (a, ==, 0);
+    g_assert_cmpint (b, ==, G_MAXINT);
+
+    g_timeout_add (10, quit_task, loop);
+    g_main_loop_run (loop);
+    g_assert_cmpint (b, <, G_MAXINT);
+
+    ibus_m17n_scheduler_remove (id);
+    last_b = b;
+    g_timeout_add (10, quit_task, loop);
+    g_main_loop_run (loop);
+    g_assert_cmpint (b, ==, last_b);
+
+    /* nothing runs while blocked, even tasks added meanwhile */
+    a = 3;
+    ibus_m17n_scheduler_block ();
+    ibus_m17n_scheduler_add (IBUS_M17N_TASK_UI, count_task, &a, NULL);
+    g_timeout_add (10, quit_task, loop);
+    g_main_loop_run (loop);
+    g_assert_cmpint (a, ==, 3);
+
+    ibus_m17n_scheduler_unblock ();
+    ibus_m17n_scheduler_add (IBUS_M17N_TASK_UI, quit_task, loop, NULL);
+    g_main_loop_run (loop);
+    g_assert_cmpint (a, ==, 0);
+
+    g_main_loop_unref (loop);
+}
+
+#define KEY_INTERVAL 3          /* milliseconds */
+#define N_KEYS 300
+
+typedef struct {
+    GMainLoop *loop;
+    gint64 expected;
+    gint64 max_latency;
+    gint n_keys;
+} KeyLatency;
+
+static gboolean
+simulate_key (gpointer user_data)
+{
+    KeyLatency *latency = user_data;
+    gint64 now = g_get_monotonic_time ();
+
+    if (latency->expected > 0)
+        latency->max_latency = MAX (latency->max_latency,
+                                    now - latency->expected);
+    latency->expected = now + KEY_INTERVAL * 1000;
+
+    if (++latency->n_keys < N_KEYS)
+        return TRUE;
+    g_main_loop_quit (latency->loop);
+    return FALSE;
+}
+
+static gboolean
+busy_task (gpointer user_data)
+{
+    gint64 end = g_get_monotonic_time () + 500;
+    while (g_get_monotonic_time () < end)
+        ;
+    return TRUE;
+}
+
+static gint64
+measure_key_latency (gint n_background_tasks)
+{
+    KeyLatency latency = { NULL, 0, 0, 0 };
+    guint ids[8];
+    gint i;
+
+    latency.loop = g_main_loop_new (NULL, FALSE);
+    for (i = 0; i < n_background_tasks; i++)
+        ids[i] = ibus_m17n_scheduler_add (IBUS_M17N_TASK_BACKGROUND,
+                                          busy_task, NULL, NULL);
+    /* key events come from D-Bus at the default priority */
+    g_timeout_add (KEY_INTERVAL, simulate_key, &latency);
+    g_main_loop_run (latency.loop);
+    for (i = 0; i < n_background_tasks; i++)
+        ibus_m17n_scheduler_remove (ids[i]);
+    g_main_loop_unref (latency.loop);
+
+    return latency.max_latency;
+}
+
+/* The worst-case latency of key events must not grow by more than a
+   slice budget when background work is running. */
+static void
+test_scheduler_latency (void)
+{
+    const gint64 budget = 2000;
+    gint64 idle, busy;
+
+    ibus_m17n_scheduler_set_budget (budget);
+    idle = measure_key_latency (0);
+    busy = measure_key_latency (8);
+
+    g_test_minimized_result (busy / 1000.0,
+                             "worst key latency %.3f ms with background "
+                             "work, %.3f ms without",
+                             busy / 1000.0, idle / 1000.0);
+    g_assert_cmpint (busy, <=, idle + budget + 1000);
+}
+
+#define N_WORKER_REQUESTS 1000
+
+typedef struct {
+    GMainLoop *loop;
+    GThread *main_thread;
+    gint next_run;
+    gint next_done;
+    gboolean ok;
+} WorkerTest;
+
+typedef struct {
+    WorkerTest *test;
+    gint n;
+} WorkerRequest;
+
+static void
+worker_run (gpointer user_data)
+{
+    WorkerRequest *request = user_data;
+    WorkerTest *test = request->test;
+
+    /* requests run in order, off the main thread */
+    if (g_thread_self () == test->main_thread ||
+        request->n != test->next_run++)
+        test->ok = FALSE;
+}
+
+static gboolean
+worker_done (gpointer user_data)
+{
+    WorkerRequest *request = user_data;
+    WorkerTest *test = request->test;
+
+    if (g_thread_self () != test->main_thread ||
+        request->n != test->next_done++)
+        test->ok = FALSE;
+    if (test->next_done == N_WORKER_REQUESTS)
+        g_main_loop_quit (test->loop);
+    g_slice_free (WorkerRequest, request);
+    return FALSE;
+}
+
+static void
+test_worker (void)
+{
+    WorkerTest test = { NULL, NULL, 0, 0, TRUE };
+    IBusM17NWorker *worker;
+    gint i;
+
+    test.loop = g_main_loop_new (NULL, FALSE);
+    test.main_thread = g_thread_self ();
+    worker = ibus_m17n_worker_new (4);
+
+    for (i = 0; i < N_WORKER_REQUESTS; i++) {
+        WorkerRequest *request = g_slice_new (WorkerRequest);
+
+        request->test = &test;
+        request->n = i;
+        /* the ring holds four requests; wait for room */
+        while (!ibus_m17n_worker_push (worker, worker_run, worker_done,
+                                       request))
+            ibus_m17n_worker_wait (worker, -1);
+    }
+    g_assert (ibus_m17n_worker_wait (worker, -1));
+    g_assert_cmpint (test.next_run, ==, N_WORKER_REQUESTS);
+
+    g_main_loop_run (test.loop);
+    g_assert (test.ok);
+    g_assert_cmpint (test.next_done, ==, N_WORKER_REQUESTS);
+
+    ibus_m17n_worker_free (worker);
+    g_main_loop_unref (test.loop);
+}
+
+#define N_CONVERSION_THREADS 8
+#define N_CONVERSIONS 2000
+
+static const gchar conversion_utf8[] =
+    "a\xe0\xa4\x95\xe4\xb8\xad\xf0\x9f\x98\x80";
+
+static gpointer
+convert_mtexts (gpointer data)
+{
+    MText **texts = data;
+    gint i, j;
+
+    for (i = 0; i < N_CONVERSIONS; i++) {
+        for (j = 0; texts[j] != NULL; j++) {
+            gchar *buf = ibus_m17n_mtext_to_utf8 (texts[j]);
+            if (strcmp (buf, conversion_utf8) != 0) {
+                g_free (buf);
+                return GINT_TO_POINTER (FALSE);
+            }
+            g_free (buf);
+        }
+    }
+    return GINT_TO_POINTER (TRUE);
+}
+
+/* Run conversions from several threads at once.  Each thread converts
+   its own M-texts, in every storage format, and nothing serializes
+   them; build with -fsanitize=thread to have the races reported. */
+static void
+test_threaded_conversion (void)
+{
+    const guint32 ucs4[] = { 0x61, 0x915, 0x4e2d, 0x1f600 };
+    const gunichar2 utf16[] = { 0x61, 0x915, 0x4e2d, 0xd83d, 0xde00 };
+    MText *texts[N_CONVERSION_THREADS][4];
+    GThread *threads[N_CONVERSION_THREADS];
+    gint i, j;
+
+    for (i = 0; i < N_CONVERSION_THREADS; i++) {
+        texts[i][0] = mtext_from_data (conversion_utf8,
+                                       strlen (conversion_utf8),
+                                       MTEXT_FORMAT_UTF_8);
+        texts[i][1] = mtext_from_data (utf16, G_N_ELEMENTS (utf16),
+                                       MTEXT_FORMAT_UTF_16);
+        texts[i][2] = mtext_from_data (ucs4, G_N_ELEMENTS (ucs4),
+                                       MTEXT_FORMAT_UTF_32);
+        texts[i][3] = NULL;
+    }
+
+    for (i = 0; i < N_CONVERSION_THREADS; i++)
+        threads[i] = g_thread_new ("convert", convert_mtexts, texts[i]);
+
+    for (i = 0; i < N_CONVERSION_THREADS; i++)
+        g_assert (GPOINTER_TO_INT (g_thread_join (threads[i])));
+
+    for (i = 0; i < N_CONVERSION_THREADS; i++)
+        for (j = 0; texts[i][j] != NULL; j++)
+            m17n_object_unref (texts[i][j]);
+}
+
+static guint
+random_keyval (void)
+{
+    switch (g_test_rand_int_range (0, 4)) {
+    case 0:
+        return g_test_rand_int_range (IBUS_space, IBUS_asciitilde + 1);
+    case 1:
+        /* function and editing keys */
+        return g_test_rand_int_range (IBUS_BackSpace, IBUS_Delete + 1);
+    case 2:
+        /* Unicode keysyms, mostly without names */
+        return 0x01000000 + g_test_rand_int_range (0x100, 0x110000);
+    default:
+        return g_test_rand_int ();
+    }
+}
+
+/* Replay random key events and check that neither the symbol table
+   nor the process grows with them.  Millions of events are replayed
+   in slow mode (-m slow). */
+static void
+test_key_event_soak (void)
+{
+    const guint modifiers[] = {
+        IBUS_SHIFT_MASK, IBUS_CONTROL_MASK, IBUS_MOD1_MASK,
+        IBUS_META_MASK, IBUS_SUPER_MASK, IBUS_HYPER_MASK
+    };
+    gint n_events = g_test_slow () ? 4000000 : 20000;
+    gsize rss_before = 0, rss_after;
+    GHashTable *interned;
+    gint i;
+    guint j;
+
+    /* a plain key is interned, as any MIM may bind it */
+    g_assert (ibus_m17n_key_event_to_symbol (0, IBUS_a, 0) == msymbol ("a"));
+
+    /* a modified key is interned only if an opened MIM binds keys
+       with the same modifiers */
+    g_assert (msymbol_exist ("C-A-M-s-H-F13") == Mnil);
+    g_assert (ibus_m17n_key_event_to_symbol (0, IBUS_F13,
+                                             IBUS_CONTROL_MASK |
+                                             IBUS_MOD1_MASK |
+                                             IBUS_META_MASK |
+                                             IBUS_SUPER_MASK |
+                                             IBUS_HYPER_MASK) != Mnil);
+    g_assert (msymbol_exist ("C-A-M-s-H-F13") == Mnil);
+    g_assert (msymbol_exist ("0x12345678") == Mnil);
+    ibus_m17n_key_event_to_symbol (0, 0x12345678, 0);
+    g_assert (msymbol_exist ("0x12345678") == Mnil);
+
+    /* the names of the symbols the events intern; with no MIM opened,
+       they can only be keysym names without modifiers */
+    interned = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    for (i = 0; i < n_events; i++) {
+        guint mask = 0, keyval = random_keyval ();
+        gchar *name;
+        gboolean existed;
+
+        for (j = 0; j < G_N_ELEMENTS (modifiers); j++)
+            if (g_test_rand_int_range (0, 4) == 0)
+                mask |= modifiers[j];
+
+        name = ibus_m17n_key_event_to_name (0, keyval, mask);
+        existed = name == NULL || msymbol_exist (name) != Mnil;
+        ibus_m17n_key_event_to_symbol (0, keyval, mask);
+        if (!existed && msymbol_exist (name) != Mnil) {
+            g_assert_cmpuint (ibus_m17n_key_name_modifiers (name), ==, 0);
+            g_assert (!g_str_has_prefix (name, "0x"));
+            g_assert (!g_str_has_prefix (name, "U+"));
+            g_hash_table_add (interned, name);
+        }
+        else
+            g_free (name);
+
+        /* measure after warming up the keysym names and allocator */
+        if (i == n_events / 10)
+            rss_before = ibus_m17n_get_rss ();
+    }
+    rss_after = ibus_m17n_get_rss ();
+
+    g_test_message ("%u symbols interned", g_hash_table_size (interned));
+    /* there are a few thousand keysym names */
+    g_assert_cmpuint (g_hash_table_size (interned), <=, 4096);
+    g_hash_table_destroy (interned);
+
+    if (rss_before > 0) {
+        g_test_message ("RSS %" G_GSIZE_FORMAT " -> %" G_GSIZE_FORMAT,
+                        rss_before, rss_after);
+        g_assert_cmpuint (rss_after, <=, rss_before + 4 * 1024 * 1024);
+    }
+    g_assert (msymbol_exist ("C-A-M-s-H-F13") == Mnil);
+}
+
+/* A key with modifiers no opened MIM binds keys with is not interned,
+   but matches once a MIM binding it is opened. */
+static void
+test_late_im_key (void)
+{
+    static const gchar mim[] =
+        "(input-method t ibus-m17n-test)\n"
+        "(title \"test\")\n"
+        "(map (late ((C-A-F14) \"x\")))\n"
+        "(state (init (late)))\n";
+    const guint modifiers = IBUS_CONTROL_MASK | IBUS_MOD1_MASK;
+    gchar *dirname, *filename, *str;
+    MInputMethod *im;
+    MInputContext *ic;
+    MSymbol key;
+    MText *produced;
+
+    g_assert (msymbol_exist ("C-A-F14") == Mnil);
+    key = ibus_m17n_key_event_to_symbol (0, IBUS_F14, modifiers);
+    g_assert (key != Mnil);
+    g_assert (msymbol_exist ("C-A-F14") == Mnil);
+
+    dirname = g_dir_make_tmp ("test-m17n-XXXXXX", NULL);
+    g_assert (dirname != NULL);
+    filename = g_build_filename (dirname, "test.mim", NULL);
+    g_assert (g_file_set_contents (filename, mim, -1, NULL));
+    mdatabase_define (Minput_method, Mt, msymbol ("ibus-m17n-test"), Mnil,
+                      NULL, filename);
+
+    im = ibus_m17n_open_im (Mt, msymbol ("ibus-m17n-test"));
+    g_assert (im != NULL);
+    ic = minput_create_ic (im, NULL);
+    g_assert (ic != NULL);
+
+    key = ibus_m17n_key_event_to_symbol (0, IBUS_F14, modifiers);
+    g_assert (key == msymbol_exist ("C-A-F14"));
+    produced = mtext ();
+    if (!minput_filter (ic, key, NULL))
+        minput_lookup (ic, key, NULL, produced);
+    str = ibus_m17n_mtext_to_utf8 (produced);
+    g_assert_cmpstr (str, ==, "x");
+    g_free (str);
+    m17n_object_unref (produced);
+
+    minput_destroy_ic (ic);
+    minput_close_im (im);
+    g_unlink (filename);
+    g_rmdir (dirname);
+    g_free (filename);
+    g_free (dirname);
+}
+
+static gunichar
+random_unichar (void)
+{
+    gunichar c;
+
+    /* mostly ASCII, Devanagari, CJK and emoji, plus anything else */
+    do {
+        switch (g_test_rand_int_range (0, 6)) {
+        case 0:
+        case 1:
+            c = g_test_rand_int_range (1, 0x80);
+            break;
+        case 2:
+            c = g_test_rand_int_range (0x900, 0x980);
+            break;
+        case 3:
+            c = g_test_rand_int_range (0x4e00, 0x9fa6);
+            break;
+        case 4:
+            c = g_test_rand_int_range (0x1f300, 0x1f650);
+            break;
+        default:
+            c = g_test_rand_int_range (1, 0x110000);
+            break;
+        }
+    } while ((c >= 0xd800 && c < 0xe000) ||
+             /* noncharacters, which older GLib rejects */
+             (c >= 0xfdd0 && c <= 0xfdef) || (c & 0xfffe) == 0xfffe);
+    return c;
+}
+
+/* Differential fuzz test of the UTF-8 kernels against GLib. */
+static void
+test_utf8_kernels (void)
+{
+    const gchar *kernels[] = { "scalar", "sse2", "avx2" };
+    gint iterations = g_test_thorough () ? 100000 : 2000;
+    gint k, i;
+
+    for (k = 0; k < G_N_ELEMENTS (kernels); k++) {
+        if (!ibus_m17n_utf8_select_kernels (kernels[k]))
+            continue;
+
+        for (i = 0; i < iterations; i++) {
+            gunichar ucs[256], raw[256];
+            gchar *utf8, *mine, *theirs;
+            const gchar *my_end, *their_end;
+            gunichar *my_ucs, *their_ucs;
+            glong nchars, nbytes, written, offset;
+
+            nchars = g_test_rand_int_range (0, G_N_ELEMENTS (ucs));
+            for (offset = 0; offset < nchars; offset++) {
+                ucs[offset] = g_test_rand_bit () ? random_unichar ()
+                    : g_test_rand_int_range (1, 0x80);
+                raw[offset] = ucs[offset];
+                /* values outside Unicode, up to those negative as
+                   signed, are converted as U+FFFD */
+                if (g_test_rand_int_range (0, 16) == 0) {
+                    raw[offset] = g_test_rand_bit () ?
+                        0x110000 + g_test_rand_int_range (0, 0x1000000) :
+                        0x80000000 | (guint32) g_test_rand_int ();
+                    ucs[offset] = 0xfffd;
+                }
+            }
+
+            /* UCS-4 -> UTF-8 */
+            theirs = g_ucs4_to_utf8 (ucs, nchars, NULL, &nbytes, NULL);
+            mine = ibus_m17n_ucs4_to_utf8 (raw, nchars, &written);
+            g_assert_cmpint (written, ==, nbytes);
+            g_assert_cmpint (ibus_m17n_ucs4_utf8_len (raw, nchars), ==, nbytes);
+            g_assert (memcmp (mine, theirs, nbytes + 1) == 0);
+            g_free (mine);
+            utf8 = theirs;
+
+            /* UTF-8 -> UCS-4, length and offsets of valid input */
+            their_ucs = g_utf8_to_ucs4_fast (utf8, nbytes, NULL);
+            my_ucs = ibus_m17n_utf8_to_ucs4 (utf8, nbytes, &written);
+            g_assert_cmpint (written, ==, nchars);
+            g_assert (memcmp (my_ucs, their_ucs, (nchars + 1) * sizeof (gunichar)) == 0);
+            g_free (my_ucs);
+            g_free (their_ucs);
+
+            g_assert_cmpint (ibus_m17n_utf8_strlen (utf8, nbytes), ==,
+                             g_utf8_strlen (utf8, nbytes));
+            for (offset = 0; offset <= nchars;
+                 offset += g_test_rand_int_range (1, 8))
+                g_assert (ibus_m17n_utf8_offset_to_pointer (utf8, nbytes, offset) ==
+                          g_utf8_offset_to_pointer (utf8, offset));
+            for (offset = 0; offset <= nchars;
+                 offset += g_test_rand_int_range (1, 8))
+                g_assert (ibus_m17n_utf8_rewind (utf8, utf8 + nbytes, offset) ==
+                          g_utf8_offset_to_pointer (utf8 + nbytes, -offset));
+
+            /* validation of the input and of a corrupted copy */
+            g_assert (ibus_m17n_utf8_validate (utf8, nbytes, &my_end));
+            g_assert (my_end == utf8 + nbytes);
+            if (nbytes > 0) {
+                gint n = g_test_rand_int_range (1, 4);
+
+                while (n-- > 0)
+                    utf8[g_test_rand_int_range (0, nbytes)] =
+                        g_test_rand_int_range (0, 256);
+            }
+            g_assert_cmpint (ibus_m17n_utf8_validate (utf8, nbytes, &my_end), ==,
+                             g_utf8_validate (utf8, nbytes, &their_end));
+            g_assert (my_end == their_end);
+
+            g_free (utf8);
+        }
+    }
+
+    ibus_m17n_utf8_select_kernels (NULL);
+}
+
 int main (int argc, char **argv)
 {
     setlocale (LC_ALL, "");
@@ -61,6 +981,24 @@ int main (int argc, char **argv)
 
     g_test_add_func ("/test-m17n/output-component", test_output_component);
     g_test_add_func ("/test-m17n/engine-config", test_engine_config);
+    g_test_add_func ("/test-m17n/shard", test_shard);
+    g_test_add_func ("/test-m17n/candidate-index", test_candidate_index);
+    g_test_add_func ("/test-m17n/mtext-to-utf8", test_mtext_to_utf8);
+    g_test_add_func ("/test-m17n/mtext-to-ucs4", test_mtext_to_ucs4);
+    g_test_add_func ("/test-m17n/utf8-kernels", test_utf8_kernels);
+    g_test_add_func ("/test-m17n/threaded-conversion",
+                     test_threaded_conversion);
+    g_test_add_func ("/test-m17n/key-event-soak", test_key_event_soak);
+    /* after the soak test, which expects no MIM to be open */
+    g_test_add_func ("/test-m17n/late-im-key", test_late_im_key);
+    g_test_add_func ("/test-m17n/history", test_history);
+    g_test_add_func ("/test-m17n/trace", test_trace);
+    g_test_add_func ("/test-m17n/histogram", test_histogram);
+    g_test_add_func ("/test-m17n/scheduler", test_scheduler);
+    g_test_add_func ("/test-m17n/worker", test_worker);
+    if (g_test_perf ())
+        g_test_add_func ("/test-m17n/scheduler-latency",
+                         test_scheduler_latency);
 
     return g_test_run ();
 }